@@ -0,0 +1,96 @@
+"""
+Web asset pipeline for the status page
+
+Bundles web/*.css and web/*.js, minifies and gzips them into data/ with the
+content hash in the file name (app.<hash>.css.gz), and writes the names to
+src/web_assets.h. Upload the result with "pio run -t uploadfs".
+
+Runs as PlatformIO pre-build script (extra_scripts = pre:scripts/build_web.py)
+or standalone: python scripts/build_web.py
+"""
+import glob
+import gzip
+import hashlib
+import io
+import os
+import re
+
+try:
+    Import("env")  # noqa: F821
+    PROJECT_DIR = env.subst("$PROJECT_DIR")  # noqa: F821
+except NameError:
+    PROJECT_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+WEB_DIR = os.path.join(PROJECT_DIR, "web")
+DATA_DIR = os.path.join(PROJECT_DIR, "data")
+HEADER = os.path.join(PROJECT_DIR, "src", "web_assets.h")
+
+
+def minify_css(text):
+    text = re.sub(r"/\*.*?\*/", "", text, flags=re.S)
+    text = re.sub(r"\s+", " ", text)
+    text = re.sub(r"\s*([{}:;,>])\s*", r"\1", text)
+    return text.replace(";}", "}").strip()
+
+
+def minify_js(text):
+    lines = []
+    for line in text.splitlines():
+        line = line.strip()
+        if line and not line.startswith("//"):
+            lines.append(line)
+    return "\n".join(lines)
+
+
+def bundle(ext, minify):
+    sources = sorted(glob.glob(os.path.join(WEB_DIR, "*." + ext)))
+    text = "\n".join(open(path, encoding="utf-8").read() for path in sources)
+    return minify(text).encode("utf-8")
+
+
+def gzip_bytes(data):
+    # Fixed mtime, so unchanged sources give byte-identical output
+    buf = io.BytesIO()
+    with gzip.GzipFile(fileobj=buf, mode="wb", compresslevel=9, mtime=0) as f:
+        f.write(data)
+    return buf.getvalue()
+
+
+def write_asset(name, ext, data):
+    digest = hashlib.sha1(data).hexdigest()[:8]
+    filename = "%s.%s.%s.gz" % (name, digest, ext)
+    for old in glob.glob(os.path.join(DATA_DIR, "%s.*.%s.gz" % (name, ext))):
+        if os.path.basename(old) != filename:
+            os.remove(old)
+    target = os.path.join(DATA_DIR, filename)
+    if not os.path.exists(target):
+        with open(target, "wb") as f:
+            f.write(gzip_bytes(data))
+        print("build_web: %s (%d bytes, %d gzipped)" % (filename, len(data), os.path.getsize(target)))
+    # Served without the .gz suffix, handleFileRead() prefers the gzipped file
+    return "/%s.%s.%s" % (name, digest, ext)
+
+
+def write_header(css, js):
+    content = (
+        "// Generated by scripts/build_web.py from web/, do not edit\n"
+        "#define WEB_ASSET_CSS \"%s\"\n"
+        "#define WEB_ASSET_JS \"%s\"\n" % (css, js)
+    )
+    if os.path.exists(HEADER) and open(HEADER).read() == content:
+        return
+    with open(HEADER, "w") as f:
+        f.write(content)
+
+
+def main():
+    if not os.path.isdir(WEB_DIR):
+        return
+    if not os.path.isdir(DATA_DIR):
+        os.makedirs(DATA_DIR)
+    css = write_asset("app", "css", bundle("css", minify_css))
+    js = write_asset("app", "js", bundle("js", minify_js))
+    write_header(css, js)
+
+
+main()
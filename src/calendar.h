@@ -0,0 +1,144 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * Calendar-aware polling
+ * Presence mostly changes when a meeting starts or ends. With the setting enabled the
+ * events of the next CALENDAR_WINDOW hours are fetched from me/calendarView every
+ * CALENDAR_REFRESH_INTERVAL (needs the Calendars.Read scope). The poll scheduler then
+ * polls shortly before and after each boundary, and less often in long free or
+ * out-of-office stretches. Times are UTC (configTime() without offset).
+ */
+#define MAX_CALENDAR_EVENTS 12
+#define CALENDAR_WINDOW 4					// Hours ahead
+#define CALENDAR_REFRESH_INTERVAL 1800		// Fetch the calendar again after (s)
+#define CALENDAR_LEAD 20					// Poll before an event starts / ends (s)
+#define CALENDAR_LAG 45						// Poll after an event starts / ends, Teams needs some time to update (s)
+#define CALENDAR_IDLE_MIN 1800				// A free stretch without boundaries must last at least (s)
+#define CALENDAR_IDLE_FACTOR 2				// Interval is multiplied by this in free stretches
+#define CALENDAR_OOF_FACTOR 4				// ... and by this while out of office
+#define CALENDAR_URL_LEN 256
+#define CALENDAR_SCOPE "%20Calendars.Read"
+
+#define CALENDAR_FETCH_NONE 0				// Not fetched with this poll
+#define CALENDAR_FETCH_OK 1
+#define CALENDAR_FETCH_FAILED 2
+#define CALENDAR_FETCH_DENIED 3				// Scope missing (403)
+
+struct CalendarEvent {
+	time_t start;
+	time_t end;
+	boolean oof;
+};
+
+CalendarEvent calendarEvents[MAX_CALENDAR_EVENTS];
+uint8_t numCalendarEvents = 0;
+boolean calendarValid = false;				// Only set after a fetch with synced clock
+unsigned long calendarFetchedAt = 0;
+boolean calendarDenied = false;				// Scope missing, not fetched again until the next login
+
+CalendarEvent fetchedCalendarEvents[MAX_CALENDAR_EVENTS];	// Written by the network task, taken over with the job result
+uint8_t numFetchedCalendarEvents = 0;
+
+
+// Parse Graph dateTime (UTC), e.g. "2026-10-16T10:00:00.0000000", 0 if invalid
+time_t parseCalendarTime(const char* dateTime) {
+	struct tm tm = {};
+	if (sscanf(dateTime, "%4d-%2d-%2dT%2d:%2d:%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+		return 0;
+	}
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	return mktime(&tm);
+}
+
+// Format for calendarView parameters, e.g. "2026-10-16T10:00:00Z"
+void formatCalendarTime(char* buf, size_t size, time_t t) {
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	strftime(buf, size, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+// Loop task: take over the result of a fetch
+void applyCalendarFetch(uint8_t status) {
+	if (status == CALENDAR_FETCH_NONE) {
+		return;
+	}
+	calendarFetchedAt = millis();
+	if (status == CALENDAR_FETCH_OK) {
+		memcpy(calendarEvents, fetchedCalendarEvents, numFetchedCalendarEvents * sizeof(CalendarEvent));
+		numCalendarEvents = numFetchedCalendarEvents;
+		calendarValid = true;
+	} else if (status == CALENDAR_FETCH_DENIED) {
+		calendarDenied = true;
+		calendarValid = false;
+	}
+}
+
+// Failed fetches are retried after the refresh interval too
+boolean isCalendarDue() {
+	return !calendarDenied && (calendarFetchedAt == 0 || millis() - calendarFetchedAt > CALENDAR_REFRESH_INTERVAL * 1000UL);
+}
+
+// Earliest poll time around an event boundary that is after now, 0 if there is none
+time_t getNextCalendarPoll(time_t now) {
+	time_t next = 0;
+	for (uint8_t i = 0; i < numCalendarEvents; i++) {
+		const time_t candidates[4] = {
+			calendarEvents[i].start - CALENDAR_LEAD, calendarEvents[i].start + CALENDAR_LAG,
+			calendarEvents[i].end - CALENDAR_LEAD, calendarEvents[i].end + CALENDAR_LAG
+		};
+		for (time_t t : candidates) {
+			if (t > now && (next == 0 || t < next)) {
+				next = t;
+			}
+		}
+	}
+	return next;
+}
+
+boolean isOutOfOffice(time_t now) {
+	for (uint8_t i = 0; i < numCalendarEvents; i++) {
+		if (calendarEvents[i].oof && calendarEvents[i].start <= now && now < calendarEvents[i].end) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Delay until the next poll according to the calendar, given the regular delay (ms).
+ * Returns 0 if the calendar has nothing to say, stretched is set if the delay got longer.
+ */
+uint32_t getCalendarPollDelay(uint32_t delayMillis, boolean& stretched) {
+	if (!calendarValid) {
+		return 0;
+	}
+	time_t now = time(NULL);
+	time_t next = getNextCalendarPoll(now);
+	// Ends of long out-of-office events may be weeks ahead
+	uint32_t untilNext = (next > 0 && next - now < UINT32_MAX / 1000) ? (next - now) * 1000 : UINT32_MAX;
+
+	// A boundary comes before the regular poll
+	if (untilNext < delayMillis) {
+		stretched = false;
+		return untilNext;
+	}
+
+	// Nothing happens for a while, poll less often, but still before the next boundary
+	if (untilNext > CALENDAR_IDLE_MIN * 1000UL) {
+		uint8_t factor = isOutOfOffice(now) ? CALENDAR_OOF_FACTOR : CALENDAR_IDLE_FACTOR;
+		stretched = true;
+		return min(delayMillis * factor, untilNext);
+	}
+	return 0;
+}
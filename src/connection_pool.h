@@ -0,0 +1,478 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * HTTPS connection pool
+ * Keeps one TLS connection per API host open (HTTP/1.1 keep-alive), so polling
+ * does not need a full TLS handshake for every request. Idle connections are closed
+ * by the loop task (TIMER_REAP), an open TLS connection holds ~40 KB of heap.
+ * All access is serialized by netMutex.
+ */
+#define POOL_HOST_LOGIN 0
+#define POOL_HOST_GRAPH 1
+#define POOL_SIZE 2
+#define POOL_IDLE_TIMEOUT 50000		// Close pooled connections idle for longer than this (ms), the servers drop them anyway
+#define HTTP_CONNECT_TIMEOUT 10		// Timeout for connect and TLS handshake (seconds)
+#define HTTP_READ_TIMEOUT 10000		// Timeout while waiting for response data (ms)
+#define HTTP_LINE_LEN 256			// Max. length of status and header lines, longer lines get truncated
+#define HTTP_DRAIN_LIMIT 4096		// Max. number of unread body bytes to skip to keep a connection reusable
+
+#define TLS_SESSION_FILE_LOGIN "/tls_login.bin"
+#define TLS_SESSION_FILE_GRAPH "/tls_graph.bin"
+
+struct PooledConnection {
+	const char* host;
+	const char* sessionFile;
+	TlsClient client;
+	unsigned long lastUsed;
+	unsigned int fullHandshakes;
+	unsigned int resumedHandshakes;
+	unsigned long handshakeMillis;	// Duration of the last handshake
+	unsigned int requests;
+};
+
+struct HttpResponseHeaders {
+	int status;
+	long length;		// Content-Length, -1 if unknown
+	boolean chunked;
+	boolean close;
+	long retryAfter;	// Retry-After in seconds, 0 if not given (HTTP dates are not supported)
+};
+
+PooledConnection connectionPool[POOL_SIZE];
+
+
+// Read one CRLF terminated line, returns its length without CRLF or -1 on timeout / disconnect
+int readHttpLine(Client& client, char* buf, size_t len) {
+	size_t pos = 0;
+	unsigned long start = millis();
+	for (;;) {
+		if (!client.available()) {
+			if (!client.connected() || millis() - start > HTTP_READ_TIMEOUT) {
+				buf[pos] = '\0';
+				return -1;
+			}
+			delay(1);
+			continue;
+		}
+		int c = client.read();
+		if (c == '\n') {
+			break;
+		}
+		if (c != '\r' && pos < len - 1) {
+			buf[pos++] = (char)c;
+		}
+	}
+	buf[pos] = '\0';
+	return pos;
+}
+
+// Read one byte, wait for data if needed. Returns -1 on timeout / disconnect
+int readHttpByte(Client& client) {
+	unsigned long start = millis();
+	while (!client.available()) {
+		if (!client.connected() || millis() - start > HTTP_READ_TIMEOUT) {
+			return -1;
+		}
+		delay(1);
+	}
+	return client.read();
+}
+
+
+/**
+ * Stream of a response body, handles Content-Length and chunked transfer encoding.
+ * Reports EOF at the end of the body, so the connection can be used for the next request.
+ */
+class HttpBodyStream : public Stream {
+public:
+	HttpBodyStream(Client& client, const HttpResponseHeaders& headers) :
+		_client(client),
+		_chunked(headers.chunked),
+		_remaining(headers.chunked ? 0 : headers.length),
+		_chunkStarted(false),
+		_complete(!headers.chunked && headers.length == 0),
+		_eof(_complete) {}
+
+	int available() {
+		if (_eof || (_remaining == 0 && !_chunked)) {
+			return 0;
+		}
+		int a = _client.available();
+		if (_remaining > 0 && a > _remaining) {
+			return _remaining;
+		}
+		return a;
+	}
+
+	int read() {
+		if (!prepare()) {
+			return -1;
+		}
+		int c = readHttpByte(_client);
+		if (c < 0) {
+			_eof = true;
+			return -1;
+		}
+		if (_remaining > 0) {
+			_remaining--;
+			if (_remaining == 0 && !_chunked) {
+				_complete = true;
+				_eof = true;
+			}
+		}
+		return c;
+	}
+
+	int peek() {
+		if (!prepare()) {
+			return -1;
+		}
+		unsigned long start = millis();
+		while (!_client.available()) {
+			if (!_client.connected() || millis() - start > HTTP_READ_TIMEOUT) {
+				return -1;
+			}
+			delay(1);
+		}
+		return _client.peek();
+	}
+
+	size_t write(uint8_t) {
+		return 0;
+	}
+
+	void flush() {}
+
+	// Skip the unread rest of the body, returns true if the body was read completely
+	boolean drain() {
+		size_t skipped = 0;
+		while (!_eof && skipped < HTTP_DRAIN_LIMIT) {
+			if (read() < 0) {
+				break;
+			}
+			skipped++;
+		}
+		return _complete;
+	}
+
+	boolean complete() {
+		return _complete;
+	}
+
+private:
+	// Make sure there is body data left to read, start the next chunk if needed
+	boolean prepare() {
+		if (_eof) {
+			return false;
+		}
+		if (_chunked && _remaining == 0) {
+			return nextChunk();
+		}
+		return true;
+	}
+
+	boolean nextChunk() {
+		char line[HTTP_LINE_LEN];
+		// Data of the previous chunk is followed by CRLF
+		if (_chunkStarted && readHttpLine(_client, line, sizeof(line)) != 0) {
+			_eof = true;
+			return false;
+		}
+		if (readHttpLine(_client, line, sizeof(line)) <= 0) {
+			_eof = true;
+			return false;
+		}
+		_chunkStarted = true;
+		_remaining = strtol(line, NULL, 16);
+		if (_remaining <= 0) {
+			// Last chunk, skip trailers up to the empty line
+			int l;
+			while ((l = readHttpLine(_client, line, sizeof(line))) > 0) {}
+			_complete = (l == 0);
+			_eof = true;
+			return false;
+		}
+		return true;
+	}
+
+	Client& _client;
+	boolean _chunked;
+	long _remaining;
+	boolean _chunkStarted;
+	boolean _complete;
+	boolean _eof;
+};
+
+
+/**
+ * Pool handling
+ */
+void initConnectionPool() {
+	connectionPool[POOL_HOST_LOGIN].host = "login.microsoftonline.com";
+	connectionPool[POOL_HOST_LOGIN].sessionFile = TLS_SESSION_FILE_LOGIN;
+	connectionPool[POOL_HOST_GRAPH].host = "graph.microsoft.com";
+	connectionPool[POOL_HOST_GRAPH].sessionFile = TLS_SESSION_FILE_GRAPH;
+
+	// Login and graph use the same CA certificate, so one parsed chain is shared
+	#ifndef DISABLECERTCHECK
+	initTls(rootCACertificate);
+	#else
+	initTls(NULL);
+	#endif
+}
+
+// Restore TLS sessions saved before the last reboot, needs mounted SPIFFS
+void loadTlsSessions() {
+	#if TLS_SESSION_PERSISTENCE
+	for (int i = 0; i < POOL_SIZE; i++) {
+		File file = SPIFFS.open(connectionPool[i].sessionFile);
+		if (!file) {
+			continue;
+		}
+		size_t size = file.size();
+		uint8_t* buf = (uint8_t*)malloc(size);
+		if (buf != NULL && file.read(buf, size) == size && connectionPool[i].client.loadSession(buf, size)) {
+			Serial.printf("loadTlsSessions() - Restored session for %s\n", connectionPool[i].host);
+		}
+		free(buf);
+		file.close();
+	}
+	#endif
+}
+
+// Persist a newly negotiated session, so the first request after a reboot can resume it
+void saveTlsSession(PooledConnection* conn) {
+	#if TLS_SESSION_PERSISTENCE
+	size_t size = conn->client.saveSession(NULL, 0);
+	if (size == 0) {
+		return;
+	}
+	uint8_t* buf = (uint8_t*)malloc(size);
+	if (buf != NULL && conn->client.saveSession(buf, size) == size) {
+		File file = SPIFFS.open(conn->sessionFile, FILE_WRITE);
+		if (file) {
+			file.write(buf, size);
+			file.close();
+		}
+	}
+	free(buf);
+	#endif
+}
+
+// Sums of the handshake counters of all hosts
+unsigned int getFullHandshakes() {
+	unsigned int sum = 0;
+	for (int i = 0; i < POOL_SIZE; i++) {
+		sum += connectionPool[i].fullHandshakes;
+	}
+	return sum;
+}
+
+unsigned int getResumedHandshakes() {
+	unsigned int sum = 0;
+	for (int i = 0; i < POOL_SIZE; i++) {
+		sum += connectionPool[i].resumedHandshakes;
+	}
+	return sum;
+}
+
+// Find the pooled connection for the host of an url like https://host/path, returns NULL for unknown hosts
+PooledConnection* getPooledConnection(const char* url, const char** path) {
+	const char* host = strstr(url, "://");
+	host = host ? host + 3 : url;
+	const char* slash = strchr(host, '/');
+	size_t hostLen = slash ? (size_t)(slash - host) : strlen(host);
+	*path = slash ? slash : "/";
+
+	for (int i = 0; i < POOL_SIZE; i++) {
+		if (strlen(connectionPool[i].host) == hostLen && strncmp(connectionPool[i].host, host, hostLen) == 0) {
+			return &connectionPool[i];
+		}
+	}
+	return NULL;
+}
+
+// Close connections that idled too long or were closed by the server, this frees their TLS buffers.
+// Needs netMutex. Returns the time until the next open connection idles out (ms), 0 if none is open.
+unsigned long reapIdleConnections() {
+	unsigned long next = 0;
+	for (int i = 0; i < POOL_SIZE; i++) {
+		PooledConnection* conn = &connectionPool[i];
+		unsigned long idle = millis() - conn->lastUsed;
+		if (conn->client.connected() && idle <= POOL_IDLE_TIMEOUT) {
+			unsigned long left = POOL_IDLE_TIMEOUT - idle + 1;
+			next = (next == 0) ? left : min(next, left);
+			continue;
+		}
+		conn->client.stop();
+	}
+	return next;
+}
+
+// Close the connection if it was closed by the server or idled too long
+boolean poolConnectionAlive(PooledConnection* conn) {
+	if (!conn->client.connected()) {
+		return false;
+	}
+	if (millis() - conn->lastUsed > POOL_IDLE_TIMEOUT) {
+		conn->client.stop();
+		return false;
+	}
+	return true;
+}
+
+boolean poolConnect(PooledConnection* conn) {
+	conn->client.stop();
+	unsigned long start = millis();
+	if (!conn->client.connect(conn->host, 443)) {
+		conn->client.stop();
+		return false;
+	}
+	conn->handshakeMillis = millis() - start;
+
+	if (conn->client.resumed()) {
+		conn->resumedHandshakes++;
+	} else {
+		conn->fullHandshakes++;
+	}
+	Serial.printf("[HTTPS] Connected to %s, %s handshake in %lu ms (full: %u, resumed: %u)\n", conn->host, conn->client.resumed() ? "resumed" : "full", conn->handshakeMillis, conn->fullHandshakes, conn->resumedHandshakes);
+
+	if (conn->client.sessionChanged()) {
+		saveTlsSession(conn);
+	}
+	return true;
+}
+
+// sent is set as soon as any part of the request was written
+boolean poolSendRequest(PooledConnection* conn, const char* method, const char* path, const char* payload, const char* bearer, boolean& sent) {
+	char head[HTTP_LINE_LEN * 2];
+	size_t payloadLen = payload ? strlen(payload) : 0;
+	int len = snprintf(head, sizeof(head),
+		"%s %s HTTP/1.1\r\n"
+		"Host: %s\r\n"
+		"User-Agent: ESPTeamsPresence/" VERSION "\r\n"
+		"Accept: application/json\r\n"
+		"Connection: keep-alive\r\n",
+		method, path, conn->host);
+	if (strcmp(method, "POST") == 0 && len > 0 && len < (int)sizeof(head)) {
+		// Graph takes JSON bodies, the OAuth endpoints form data
+		len += snprintf(head + len, sizeof(head) - len,
+			"Content-Type: %s\r\n"
+			"Content-Length: %u\r\n", (payload && payload[0] == '{') ? "application/json" : "application/x-www-form-urlencoded", (unsigned int)payloadLen);
+	}
+	if (len <= 0 || len >= (int)sizeof(head)) {
+		DBG_PRINTLN(F("[HTTPS] Request header too long"));
+		return false;
+	}
+
+	size_t written = conn->client.write((const uint8_t*)head, len);
+	sent = written > 0;
+	if (written != (size_t)len) {
+		return false;
+	}
+	if (bearer) {
+		conn->client.print(F("Authorization: Bearer "));
+		conn->client.print(bearer);
+		conn->client.print(F("\r\n"));
+	}
+	if (conn->client.print(F("\r\n")) != 2) {
+		return false;
+	}
+	if (payloadLen > 0 && conn->client.write((const uint8_t*)payload, payloadLen) != payloadLen) {
+		return false;
+	}
+	return true;
+}
+
+boolean poolReadHeaders(PooledConnection* conn, HttpResponseHeaders& headers) {
+	char line[HTTP_LINE_LEN];
+	headers.status = 0;
+	headers.length = -1;
+	headers.chunked = false;
+	headers.close = false;
+	headers.retryAfter = 0;
+
+	// Status line, e.g. "HTTP/1.1 200 OK"
+	if (readHttpLine(conn->client, line, sizeof(line)) <= 0 || strncmp(line, "HTTP/1.", 7) != 0) {
+		return false;
+	}
+	headers.close = (line[7] == '0');
+	const char* code = strchr(line, ' ');
+	headers.status = code ? atoi(code + 1) : 0;
+
+	int l;
+	while ((l = readHttpLine(conn->client, line, sizeof(line))) > 0) {
+		if (strncasecmp(line, "Content-Length:", 15) == 0) {
+			headers.length = atol(line + 15);
+		} else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+			headers.chunked = (strstr(line + 18, "chunked") != NULL);
+		} else if (strncasecmp(line, "Connection:", 11) == 0) {
+			headers.close = (strstr(line + 11, "close") != NULL);
+		} else if (strncasecmp(line, "Retry-After:", 12) == 0) {
+			headers.retryAfter = max(atol(line + 12), 0L);
+		}
+	}
+	if (l < 0) {
+		return false;
+	}
+
+	// Responses without body
+	if (headers.status == 204 || headers.status == 304) {
+		headers.length = 0;
+		headers.chunked = false;
+	}
+	// No framing, body ends when the server closes the connection
+	if (!headers.chunked && headers.length < 0) {
+		headers.close = true;
+	}
+	return true;
+}
+
+/**
+ * Send a request on the pooled connection and read the response headers.
+ * A kept-alive socket may have been closed by the server in the meantime, in
+ * that case the request is repeated once on a fresh connection. Once the request
+ * went out only GETs are repeated, the server may have run a POST already
+ * (e.g. redeemed a refresh token).
+ */
+boolean poolRequest(PooledConnection* conn, const char* method, const char* path, const char* payload, const char* bearer, HttpResponseHeaders& headers) {
+	for (int attempt = 0; attempt < 2; attempt++) {
+		boolean reused = poolConnectionAlive(conn);
+		if (!reused && !poolConnect(conn)) {
+			DBG_PRINTLN(F("[HTTPS] Unable to connect"));
+			return false;
+		}
+		conn->lastUsed = millis();
+
+		boolean sent = false;
+		if (poolSendRequest(conn, method, path, payload, bearer, sent) && poolReadHeaders(conn, headers)) {
+			conn->requests++;
+			return true;
+		}
+		conn->client.stop();
+		if (!reused || (sent && strcmp(method, "GET") != 0)) {
+			break;
+		}
+		DBG_PRINTLN(F("[HTTPS] Pooled connection was dead, reconnecting"));
+	}
+	return false;
+}
+
+// Finish a response, keep the connection open if the body was read completely
+void poolRelease(PooledConnection* conn, HttpBodyStream& body, const HttpResponseHeaders& headers) {
+	boolean complete = body.drain();
+	conn->lastUsed = millis();
+	if (headers.close || !complete) {
+		conn->client.stop();
+	}
+}
@@ -0,0 +1,96 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * Statemachine events and timers
+ * Everything the statemachine reacts on arrives as event: from iotWebConf, the web
+ * handlers, push and relay (loop task), from the network task (job done) or from an expired timer.
+ * loop() blocks on the event queue until the next timer is due, at most LOOP_MAX_WAIT, so
+ * iotWebConf runs regularly. Web requests and UDP packets end the wait right away (EVENT_WAKE).
+ * Timers run on millis(), see timers.h.
+ */
+#include "timers.h"
+
+#define EVENT_WIFI_CONNECTING 1		// iotWebConf tries to connect
+#define EVENT_WIFI_CONNECTED 2
+#define EVENT_AP_MODE 3				// iotWebConf opened its access point
+#define EVENT_DEVICELOGIN 4			// Device login was requested from the web UI
+#define EVENT_TIMER 5				// Timer of the current state expired (poll / login poll / refresh due)
+#define EVENT_TOKEN_DUE 6			// Access token expires soon
+#define EVENT_NET_DONE 7			// Network job finished, result attached
+#define EVENT_PUSH 8				// Presence was pushed by a local agent, see push.h
+#define EVENT_RELAY 9				// Presence frame of the relay leader arrived, see relay.h
+#define EVENT_ELECTION 10			// Relay leader election is due
+#define EVENT_SAVE 11				// Context / presence file should be written
+#define EVENT_REAP 12				// Idle pooled connections should be closed
+#define EVENT_WAKE 13				// A socket served by loop() has data, no transition, only ends the wait (socket_wake.h)
+#define EVENT_COUNT 14
+
+#define EVENT_QUEUE_SIZE 8
+#define LOOP_MAX_WAIT 20			// Max. time loop() waits for an event (ms)
+
+#define TIMER_STATE 0				// Due time of the action of the current state
+#define TIMER_TOKEN 1				// Token refresh
+#define TIMER_RELAY 2				// Relay leader election
+#define TIMER_SAVE 3				// Deferred write of the context / presence file
+#define TIMER_REAP 4				// Next pooled connection idles out
+#define TIMER_COUNT 5
+
+struct StateEvent {
+	uint8_t event;
+	NetResult result;				// Only for EVENT_NET_DONE
+};
+
+const uint8_t timerEvents[TIMER_COUNT] = { EVENT_TIMER, EVENT_TOKEN_DUE, EVENT_ELECTION, EVENT_SAVE, EVENT_REAP };
+
+QueueHandle_t eventQueue = NULL;
+TimerSet<TIMER_COUNT> timers(millis);
+
+
+boolean postEvent(uint8_t event) {
+	StateEvent e = { event };
+	return eventQueue != NULL && xQueueSend(eventQueue, &e, 0) == pdTRUE;
+}
+
+// Network task side, waits for room in the queue
+boolean postNetResult(const NetResult& result) {
+	StateEvent e = { EVENT_NET_DONE, result };
+	return xQueueSend(eventQueue, &e, portMAX_DELAY) == pdTRUE;
+}
+
+// (Re)start a timer, it fires once
+void armTimer(uint8_t timer, unsigned long delayMillis) {
+	timers.arm(timer, delayMillis);
+}
+
+void cancelTimer(uint8_t timer) {
+	timers.cancel(timer);
+}
+
+boolean isTimerArmed(uint8_t timer) {
+	return timers.isArmed(timer);
+}
+
+// Remaining time of a timer (ms), negative if overdue, 0 if not armed
+long getTimerRemaining(uint8_t timer) {
+	return timers.remaining(timer);
+}
+
+// Time until the next timer is due, capped at maxWait
+unsigned long getNextTimerDelay(unsigned long maxWait) {
+	return timers.nextDelay(maxWait);
+}
+
+// Turn expired timers into events, a timer stays armed if the queue is full, so the event is not lost
+void runTimers() {
+	timers.fireExpired([](uint8_t timer) { return postEvent(timerEvents[timer]); });
+}
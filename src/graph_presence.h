@@ -0,0 +1,110 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * Presence values from Graph
+ * Availability and activity strings are interned to PRESENCE_* ids once (perfect hash).
+ * The me/presence response is parsed through a filter into a fixed document.
+ * Needs only ArduinoJson, the native tests use it (test/test_presence_parse).
+ */
+#pragma once
+
+#define PRESENCE_NONE 0						// Not set or unknown value
+#define PRESENCE_AVAILABLE 1
+#define PRESENCE_AVAILABLEIDLE 2
+#define PRESENCE_AWAY 3
+#define PRESENCE_BERIGHTBACK 4
+#define PRESENCE_BUSY 5
+#define PRESENCE_BUSYIDLE 6
+#define PRESENCE_DONOTDISTURB 7
+#define PRESENCE_INACALL 8
+#define PRESENCE_INACONFERENCECALL 9
+#define PRESENCE_INACTIVE 10
+#define PRESENCE_INAMEETING 11
+#define PRESENCE_OFFLINE 12
+#define PRESENCE_OFFWORK 13
+#define PRESENCE_OUTOFOFFICE 14
+#define PRESENCE_PRESENCEUNKNOWN 15
+#define PRESENCE_PRESENTING 16
+#define PRESENCE_URGENTINTERRUPTIONSONLY 17
+#define PRESENCE_COUNT 18
+#define PRESENCE_NAME_LEN 32
+#define PRESENCE_HASH_SLOTS 32				// Must be a power of two
+
+const char* const presenceNames[PRESENCE_COUNT] = {
+	"", "Available", "AvailableIdle", "Away", "BeRightBack", "Busy", "BusyIdle", "DoNotDisturb",
+	"InACall", "InAConferenceCall", "Inactive", "InAMeeting", "Offline", "OffWork", "OutOfOffice",
+	"PresenceUnknown", "Presenting", "UrgentInterruptionsOnly"
+};
+
+// Hash over length, third and last character, collision free for all names above
+constexpr size_t presenceNameLength(const char* s, size_t i = 0) {
+	return s[i] ? presenceNameLength(s, i + 1) : i;
+}
+
+constexpr uint8_t presenceHash(const char* s, size_t len) {
+	return (len + s[len - 1] * 22 + s[2] * 4) & (PRESENCE_HASH_SLOTS - 1);
+}
+
+#define PRESENCE_SLOT(name) presenceHash(name, presenceNameLength(name))
+
+// Slot -> PRESENCE_* id
+constexpr uint8_t presenceSlots[PRESENCE_HASH_SLOTS] = {
+	0, 0, PRESENCE_BUSYIDLE, 0, 0, PRESENCE_BERIGHTBACK, 0, 0,
+	PRESENCE_INAMEETING, PRESENCE_OUTOFOFFICE, 0, 0, 0, PRESENCE_OFFLINE, PRESENCE_AWAY, 0,
+	PRESENCE_DONOTDISTURB, PRESENCE_OFFWORK, 0, PRESENCE_INACALL, 0, 0, PRESENCE_BUSY, PRESENCE_PRESENCEUNKNOWN,
+	PRESENCE_PRESENTING, PRESENCE_URGENTINTERRUPTIONSONLY, PRESENCE_INACTIVE, PRESENCE_AVAILABLE, 0, PRESENCE_INACONFERENCECALL, 0, PRESENCE_AVAILABLEIDLE
+};
+
+static_assert(presenceSlots[PRESENCE_SLOT("Available")] == PRESENCE_AVAILABLE, "presence hash");
+static_assert(presenceSlots[PRESENCE_SLOT("AvailableIdle")] == PRESENCE_AVAILABLEIDLE, "presence hash");
+static_assert(presenceSlots[PRESENCE_SLOT("Away")] == PRESENCE_AWAY, "presence hash");
+static_assert(presenceSlots[PRESENCE_SLOT("BeRightBack")] == PRESENCE_BERIGHTBACK, "presence hash");
+static_assert(presenceSlots[PRESENCE_SLOT("Busy")] == PRESENCE_BUSY, "presence hash");
+static_assert(presenceSlots[PRESENCE_SLOT("BusyIdle")] == PRESENCE_BUSYIDLE, "presence hash");
+static_assert(presenceSlots[PRESENCE_SLOT("DoNotDisturb")] == PRESENCE_DONOTDISTURB, "presence hash");
+static_assert(presenceSlots[PRESENCE_SLOT("InACall")] == PRESENCE_INACALL, "presence hash");
+static_assert(presenceSlots[PRESENCE_SLOT("InAConferenceCall")] == PRESENCE_INACONFERENCECALL, "presence hash");
+static_assert(presenceSlots[PRESENCE_SLOT("Inactive")] == PRESENCE_INACTIVE, "presence hash");
+static_assert(presenceSlots[PRESENCE_SLOT("InAMeeting")] == PRESENCE_INAMEETING, "presence hash");
+static_assert(presenceSlots[PRESENCE_SLOT("Offline")] == PRESENCE_OFFLINE, "presence hash");
+static_assert(presenceSlots[PRESENCE_SLOT("OffWork")] == PRESENCE_OFFWORK, "presence hash");
+static_assert(presenceSlots[PRESENCE_SLOT("OutOfOffice")] == PRESENCE_OUTOFOFFICE, "presence hash");
+static_assert(presenceSlots[PRESENCE_SLOT("PresenceUnknown")] == PRESENCE_PRESENCEUNKNOWN, "presence hash");
+static_assert(presenceSlots[PRESENCE_SLOT("Presenting")] == PRESENCE_PRESENTING, "presence hash");
+static_assert(presenceSlots[PRESENCE_SLOT("UrgentInterruptionsOnly")] == PRESENCE_URGENTINTERRUPTIONSONLY, "presence hash");
+
+// Map a presence string from Graph to its PRESENCE_* value
+uint8_t getPresenceId(const char* name) {
+	if (name == NULL) {
+		return PRESENCE_NONE;
+	}
+	size_t len = strlen(name);
+	if (len < 3) {
+		return PRESENCE_NONE;
+	}
+	uint8_t id = presenceSlots[presenceHash(name, len)];
+	if (id == PRESENCE_NONE || strcmp(name, presenceNames[id]) != 0) {
+		return PRESENCE_NONE;
+	}
+	return id;
+}
+
+// Response of me/presence: only availability, activity and the error code are kept
+#define PRESENCE_FILTER_CAPACITY 64
+#define PRESENCE_RESPONSE_CAPACITY (JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(1) + 2 * PRESENCE_NAME_LEN + 64)
+
+void setPresenceFilter(JsonDocument& filter) {
+	filter["availability"] = true;
+	filter["activity"] = true;
+	filter["error"]["code"] = true;
+}
@@ -0,0 +1,106 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * LED command queue
+ * Single-producer / single-consumer lock-free ring (spsc_ring.h). loop() (the only producer)
+ * queues changes to the strip, neopixelTask (the only consumer) applies them
+ * between two frames, so WS2812FX is only ever touched by one core. Every push
+ * notifies neopixelTask, so it does not need to poll the queue.
+ */
+#include "spsc_ring.h"
+
+#define LEDCMD_SETSEGMENT 1
+#define LEDCMD_SETLENGTH 2
+#define LEDCMD_RESETSEGMENTS 3
+#define LEDCMD_MARK 4				// Latency probe, see queueMark()
+#define LEDCMD_QUEUE_SIZE 16		// Must be a power of two
+#define LEDCMD_PUSH_TIMEOUT 50		// Max. time to wait for a free slot (ms)
+
+struct LedCommand {
+	uint8_t type;
+	uint8_t segment;
+	uint8_t mode;
+	bool reverse;
+	uint16_t start;
+	uint16_t stop;		// Also used as length for LEDCMD_SETLENGTH
+	uint16_t speed;
+	uint32_t color;
+};
+
+SpscRing<LedCommand, LEDCMD_QUEUE_SIZE> ledCommands;
+unsigned long ledMarkMicros = 0;			// Start time of the last applied mark, only used by the consumer
+
+
+// Producer side, returns false if the queue stayed full
+boolean pushLedCommand(const LedCommand& cmd) {
+	unsigned long start = millis();
+	while (!ledCommands.push(cmd)) {
+		if (millis() - start > LEDCMD_PUSH_TIMEOUT) {
+			DBG_PRINTLN(F("pushLedCommand() - Queue full, command dropped"));
+			return false;
+		}
+		delay(1);
+	}
+
+	// Wake neopixelTask, it may be sleeping until the next frame or parked on a static mode
+	if (TaskNeopixel != NULL) {
+		xTaskNotifyGive(TaskNeopixel);
+	}
+	return true;
+}
+
+// Apply all queued commands, must only be called from neopixelTask
+void applyLedCommands() {
+	LedCommand cmd;
+	while (ledCommands.pop(cmd)) {
+		switch (cmd.type) {
+			case LEDCMD_SETSEGMENT:
+				ws2812fx.setSegment(cmd.segment, cmd.start, cmd.stop, cmd.mode, cmd.color, cmd.speed, cmd.reverse);
+				break;
+			case LEDCMD_SETLENGTH:
+				ws2812fx.setLength(cmd.stop);
+				break;
+			case LEDCMD_RESETSEGMENTS:
+				// LEDs between the new segments are not rendered anymore, turn them off
+				ws2812fx.resetSegments();
+				ws2812fx.clear();
+				break;
+			case LEDCMD_MARK:
+				ledMarkMicros = cmd.color;
+				break;
+		}
+	}
+}
+
+// Helpers for the producer
+boolean queueSegment(uint8_t segment, uint16_t start, uint16_t stop, uint8_t mode, uint32_t color, uint16_t speed, bool reverse) {
+	LedCommand cmd = { LEDCMD_SETSEGMENT, segment, mode, reverse, start, stop, speed, color };
+	return pushLedCommand(cmd);
+}
+
+boolean queueLength(uint16_t length) {
+	LedCommand cmd = { LEDCMD_SETLENGTH, 0, 0, false, 0, length, 0, 0 };
+	return pushLedCommand(cmd);
+}
+
+boolean queueResetSegments() {
+	LedCommand cmd = { LEDCMD_RESETSEGMENTS, 0, 0, false, 0, 0, 0, 0 };
+	return pushLedCommand(cmd);
+}
+
+// The commands before the mark are applied and rendered in the same pass of neopixelTask,
+// so the pass that applies it knows when they are visible, whether the frame changed or not
+boolean queueMark(unsigned long startMicros) {
+	LedCommand cmd = { LEDCMD_MARK, 0, 0, false, 0, 0, 0, (uint32_t)startMicros };
+	return pushLedCommand(cmd);
+}
@@ -21,6 +21,7 @@
 #include "FS.h"
 #include "SPIFFS.h"
 #include "ESP32_RMT_Driver.h"
+#include "rom/crc.h"
 
 
 // Global settings
@@ -31,7 +32,14 @@
 #define DEFAULT_POLLING_PRESENCE_INTERVAL "30"	// Default interval to poll for presence info (seconds)
 #define DEFAULT_ERROR_RETRY_INTERVAL 30			// Default interval to try again after errors
 #define TOKEN_REFRESH_TIMEOUT 60	 			// Number of seconds until expiration before token gets refreshed
-#define CONTEXT_FILE "/context.json"			// Filename of the context file
+#define CONTEXT_FILE "/context.bin"			// Filename of the context file
+#define CONTEXT_TMP_FILE "/context.tmp"			// Context is written here first, then renamed
+#define CONTEXT_LEGACY_FILE "/context.json"		// Context file of versions <= 0.18.3, migrated on boot
+#define LAST_PRESENCE_FILE "/last_presence.bin"	// Last own presence, shown at boot until the first poll
+#define PRESENCE_SAVE_INTERVAL 60				// Min. time between two writes of the last presence file (s)
+#define NTP_SERVER "pool.ntp.org"				// Wall clock for the absolute token expiry
+#define CLOCK_SYNC_TIMEOUT 2000					// Max. time to wait for SNTP after WiFi connected (ms)
+#define CLOCK_VALID_AFTER 1600000000			// Clock counts as synced after this time (UTC)
 #define VERSION "0.18.3"						// Version of the software
 
 #define DBG_PRINT(x) Serial.print(x)
@@ -89,7 +97,8 @@ const char thingName[] = "ESPTeamsPresence";
 const char wifiInitialApPassword[] = "presence";
 
 DNSServer dnsServer;
-WebServer server(80);
+#define WEB_PORT 80
+WebServer server(WEB_PORT);
 
 IotWebConf iotWebConf(thingName, &dnsServer, &server, wifiInitialApPassword);
 
@@ -100,35 +109,82 @@ char paramClientIdValue[STRING_LEN];
 char paramTenantValue[STRING_LEN];
 char paramPollIntervalValue[INTEGER_LEN];
 char paramNumLedsValue[INTEGER_LEN];
+char paramPowerSaveValue[INTEGER_LEN];
+char paramCalendarValue[INTEGER_LEN];
+char paramPushTokenValue[STRING_LEN];
+char paramRelayValue[INTEGER_LEN];
+char paramRelaySecretValue[STRING_LEN];
 IotWebConfSeparator separator = IotWebConfSeparator();
 IotWebConfParameter paramClientId = IotWebConfParameter("Client-ID (Generic ID: 3837bbf0-30fb-47ad-bce8-f460ba9880c3)", "clientId", paramClientIdValue, STRING_LEN, "text", "e.g. 3837bbf0-30fb-47ad-bce8-f460ba9880c3", "3837bbf0-30fb-47ad-bce8-f460ba9880c3");
 IotWebConfParameter paramTenant = IotWebConfParameter("Tenant hostname / ID", "tenantId", paramTenantValue, STRING_LEN, "text", "e.g. contoso.onmicrosoft.com");
 IotWebConfParameter paramPollInterval = IotWebConfParameter("Presence polling interval (sec) (default: 30)", "pollInterval", paramPollIntervalValue, INTEGER_LEN, "number", "10..300", DEFAULT_POLLING_PRESENCE_INTERVAL, "min='10' max='300' step='5'");
 IotWebConfParameter paramNumLeds = IotWebConfParameter("Number of LEDs (default: 16)", "numLeds", paramNumLedsValue, INTEGER_LEN, "number", "1..500", "16", "min='1' max='500' step='1'");
+IotWebConfParameter paramPowerSave = IotWebConfParameter("Power saving (0: off, 1: on) (default: 0)", "powerSave", paramPowerSaveValue, INTEGER_LEN, "number", "0..1", "0", "min='0' max='1' step='1'");
+IotWebConfParameter paramPushToken = IotWebConfParameter("Push token (empty: push disabled)", "pushToken", paramPushTokenValue, STRING_LEN, "password", "Shared secret of the local agent");
+IotWebConfParameter paramRelay = IotWebConfParameter("LAN relay mode (0: off, 1: on) (default: 0)", "relay", paramRelayValue, INTEGER_LEN, "number", "0..1", "0", "min='0' max='1' step='1'");
+IotWebConfParameter paramRelaySecret = IotWebConfParameter("Relay secret (required for relay mode, min. 8 characters)", "relaySecret", paramRelaySecretValue, STRING_LEN, "password", "Same on all devices of the relay");
+IotWebConfParameter paramCalendar = IotWebConfParameter("Calendar-aware polling (0: off, 1: on) (default: 0)", "calendar", paramCalendarValue, INTEGER_LEN, "number", "0..1", "0", "min='0' max='1' step='1'");
 byte lastIotWebConfState;
 
-// HTTP client
-WiFiClientSecure client;
-
 // WS2812FX
 WS2812FX ws2812fx = WS2812FX(NUMLEDS, DATAPIN, NEO_GRB + NEO_KHZ800);
 int numberLeds;
+uint32_t lastFrameHash = 0;
+uint32_t framesSent = 0;
+uint32_t framesSkipped = 0;
+uint32_t ledWakeups = 0;
+#define LED_STATS_MODES 80					// Size of the per mode statistics, larger than the number of WS2812FX modes
+uint8_t ledFpsByMode[LED_STATS_MODES];		// Last measured frames per second of every mode
 
 // OTA update
 HTTPUpdateServer httpUpdater;
 
 // Global variables
-String user_code = "";
-String device_code = "";
+// Tokens and codes live in fixed buffers, so refreshing them does not fragment the heap
+#define ACCESS_TOKEN_LEN 4096
+#define REFRESH_TOKEN_LEN 3072
+#define ID_TOKEN_LEN 2048
+#define DEVICE_CODE_LEN 512
+#define USER_CODE_LEN 32
+#define TOKEN_URL_LEN (STRING_LEN + 64)
+#define TOKEN_PAYLOAD_LEN (REFRESH_TOKEN_LEN + STRING_LEN + 128)
+#define TOKEN_RESPONSE_CAPACITY (JSON_OBJECT_SIZE(7) + 10000)
+
+#define VERIFICATION_URI_LEN 64
+#define DEVICELOGIN_MESSAGE_LEN 256
+
+// Device login, the code is requested by the network task and polled by the web UI
+#define DEVICELOGIN_IDLE 0
+#define DEVICELOGIN_QUEUED 1		// Requested, starts as soon as no other network job runs
+#define DEVICELOGIN_RUNNING 2		// Device code request running
+#define DEVICELOGIN_FAILED 3		// Device code request failed
+
+char user_code[USER_CODE_LEN] = "";
+char device_code[DEVICE_CODE_LEN] = "";
+char verification_uri[VERIFICATION_URI_LEN] = "";
+char deviceLoginMessage[DEVICELOGIN_MESSAGE_LEN] = "";
+uint8_t deviceLoginStatus = DEVICELOGIN_IDLE;
 uint8_t interval = 5;
 
-String access_token = "";
-String refresh_token = "";
-String id_token = "";
+char access_token[ACCESS_TOKEN_LEN] = "";
+char refresh_token[REFRESH_TOKEN_LEN] = "";
+char id_token[ID_TOKEN_LEN] = "";
 unsigned int expires = 0;
+int64_t expiresAt = 0;						// Absolute expiry (UTC), 0 if the clock was not synced when the token was issued
+
+// Presence, as reported by Graph in availability and activity
+#include "graph_presence.h"
+#include "presence.h"
+
+char availability[PRESENCE_NAME_LEN] = "";
+char activity[PRESENCE_NAME_LEN] = "";
+uint8_t availabilityId = PRESENCE_NONE;
+uint8_t activityId = PRESENCE_NONE;
+unsigned long bootFirstColorMillis = 0;		// Time from boot until the first presence color (cached or live)
+unsigned long bootFirstLiveColorMillis = 0;	// Time from boot until the first presence from Graph
+boolean showingCachedPresence = false;		// Presence from the context file is shown, hide WiFi status until it is replaced
 
-String availability = "";
-String activity = "";
+#include "user_presence.h"
 
 // Statemachine
 #define SMODEINITIAL 0               // Initial
@@ -140,95 +196,456 @@ String activity = "";
 #define SMODEPOLLPRESENCE 21         // Poll for presence
 #define SMODEREFRESHTOKEN 22         // Access token needs refresh
 #define SMODEPRESENCEREQUESTERROR 23 // Access token needs refresh
+#define SMODEANY 0xFF                // Transition applies in every state
 uint8_t state = SMODEINITIAL;
 uint8_t laststate = SMODEINITIAL;
-static unsigned long tsPolling = 0;
 uint8_t retries = 0;
 
 // Multicore
 TaskHandle_t TaskNeopixel; 
+TaskHandle_t TaskNetwork;
+
+// Network task: Graph / OAuth requests run in their own task, loop() only queues jobs and handles the results.
+// The network task doesn't change shared state: what it needs is copied into the job, what it
+// parsed comes back with the result and is applied by the loop task (handleNetResult()).
+// Tokens, the device code and the calendar are too big for the event queue, they stay in buffers
+// of the network task (tokenResponseDoc, fetchedCalendarEvents) until the result is handled.
+#define NETJOB_POLLFORTOKEN 1
+#define NETJOB_POLLPRESENCE 2
+#define NETJOB_REFRESHTOKEN 3
+#define NETJOB_ELECTION 4
+#define NETJOB_DEVICECODE 5
+#define NETWORK_TASK_STACK 10240
+#define NETJOB_BUSY_RETRY 250		// Delay before starting a job again if another one is still running (ms)
+struct NetJob {
+	uint8_t job;
+	uint8_t fromState;		// State the job was started in
+	boolean ownPresence;	// Own presence is shown, me/presence is polled
+	uint8_t usersVersion;	// presenceUsersVersion of the ids below
+	uint8_t numUsers;
+	char userIds[MAX_PRESENCE_USERS][USER_ID_LEN];	// The user table may change while the job runs
+};
+struct NetResult {
+	uint8_t job;
+	uint8_t fromState;
+	uint8_t nextState;		// State to switch to when the job is done
+	int httpStatus;			// HTTP status of the (last) request, 0 if there was no response
+	uint32_t retryAfter;	// Retry-After of the response (s), 0 if not given
+	boolean ownPresence;	// availability / activity were polled
+	char availability[PRESENCE_NAME_LEN];
+	char activity[PRESENCE_NAME_LEN];
+	uint8_t usersVersion;	// Copied from the job
+	uint8_t numUsers;		// Users polled, 0 if none
+	uint8_t userAvailabilityIds[MAX_PRESENCE_USERS];	// USER_PRESENCE_MISSING if not in the response
+	uint8_t userActivityIds[MAX_PRESENCE_USERS];
+	uint8_t calendarStatus;	// CALENDAR_FETCH_*
+	boolean relayLeader;	// Election result
+};
+QueueHandle_t netJobQueue;
+SemaphoreHandle_t netMutex;		// Serializes use of the connection pool: requests and closing of idle connections (onReapDue())
+boolean netJobRunning = false;
+
+#include "led_commands.h"
+#include "segments.h"
+#include "events.h"
+#include "power.h"
+#include "push.h"
+#include "relay.h"
+#include "socket_wake.h"
+#include "calendar.h"
+#include "poll_scheduler.h"
 
 
 /**
  * Helper
  */
+// Copy a token into its buffer, returns false if it does not fit
+boolean setToken(char* dest, size_t size, const char* value) {
+	if (value == NULL) {
+		value = "";
+	}
+	if (strlcpy(dest, value, size) >= size) {
+		Serial.printf("setToken() - Token with %d chars does not fit into %d bytes.\n", strlen(value), size);
+		dest[0] = '\0';
+		return false;
+	}
+	return true;
+}
+
 // Calculate token lifetime
 int getTokenLifetime() {
 	return (expires - millis()) / 1000;
 }
 
-// Save context information to file in SPIFFS
+boolean isClockSynced() {
+	return time(NULL) > CLOCK_VALID_AFTER;
+}
+
+// Buffers of the token requests, only used by the network task
+char tokenUrl[TOKEN_URL_LEN];
+char tokenPayload[TOKEN_PAYLOAD_LEN];
+StaticJsonDocument<TOKEN_RESPONSE_CAPACITY> tokenResponseDoc;
+
+// URL of an OAuth endpoint of the configured tenant
+const char* getOAuthUrl(char* buf, size_t size, const char* endpoint) {
+	snprintf(buf, size, "https://login.microsoftonline.com/%s/oauth2/v2.0/%s", paramTenantValue, endpoint);
+	return buf;
+}
+
+// Remember when a new token expires, relative for runtime and absolute for the next boot
+void setTokenExpiry(unsigned int expiresIn) {
+	expires = millis() + (expiresIn * 1000);
+	expiresAt = isClockSynced() ? time(NULL) + expiresIn : 0;
+}
+
+// Loop task: take over the tokens of the last token response, missing fields keep their value.
+// Returns false if a token does not fit into its buffer.
+boolean applyTokenResponse() {
+	JsonDocument& responseDoc = tokenResponseDoc;
+	boolean stored = true;
+	if (!responseDoc["access_token"].isNull()) {
+		stored = setToken(access_token, sizeof(access_token), responseDoc["access_token"]) && stored;
+	}
+	if (!responseDoc["refresh_token"].isNull()) {
+		stored = setToken(refresh_token, sizeof(refresh_token), responseDoc["refresh_token"]) && stored;
+	}
+	if (!responseDoc["id_token"].isNull()) {
+		stored = setToken(id_token, sizeof(id_token), responseDoc["id_token"]) && stored;
+	}
+	if (!responseDoc["expires_in"].isNull()) {
+		setTokenExpiry(responseDoc["expires_in"].as<unsigned int>());
+	}
+	return stored;
+}
+
+/**
+ * Context file
+ * Binary format: magic, number of fields, every field as 16 bit length + bytes, CRC32 over
+ * everything before it. Written to a temp file that is renamed, so a power loss during the
+ * write leaves the last complete file.
+ * Fields: access, refresh and id token, absolute token expiry. Files of older versions also
+ * have the last availability and activity, they are taken over once (see last presence file).
+ */
+#define CONTEXT_MAGIC 0x43505445UL				// "ETPC"
+#define CONTEXT_FIELDS 4
+#define CONTEXT_MIN_FIELDS 3					// Only the tokens are required
+
+struct ContextField {
+	const uint8_t* data;
+	uint16_t len;
+};
+
+uint32_t contextCrc = 0;						// CRC of the last saved / loaded content
+boolean contextSavePending = false;				// Tokens changed, written by onSaveDue()
+
+// Current context as list of fields
+void getContextFields(ContextField fields[CONTEXT_FIELDS]) {
+	fields[0] = { (const uint8_t*)access_token, (uint16_t)strlen(access_token) };
+	fields[1] = { (const uint8_t*)refresh_token, (uint16_t)strlen(refresh_token) };
+	fields[2] = { (const uint8_t*)id_token, (uint16_t)strlen(id_token) };
+	fields[3] = { (const uint8_t*)&expiresAt, sizeof(expiresAt) };
+}
+
+// Write a block and update the running CRC
+boolean writeContextBlock(File& file, const void* data, size_t len, uint32_t& crc) {
+	crc = crc32_le(crc, (const uint8_t*)data, len);
+	return file.write((const uint8_t*)data, len) == len;
+}
+
+// CRC of the content as it would be written
+uint32_t getContextCrc(const ContextField fields[CONTEXT_FIELDS]) {
+	uint32_t magic = CONTEXT_MAGIC;
+	uint8_t count = CONTEXT_FIELDS;
+	uint32_t crc = crc32_le(0, (const uint8_t*)&magic, sizeof(magic));
+	crc = crc32_le(crc, &count, sizeof(count));
+	for (int i = 0; i < CONTEXT_FIELDS; i++) {
+		crc = crc32_le(crc, (const uint8_t*)&fields[i].len, sizeof(fields[i].len));
+		crc = crc32_le(crc, fields[i].data, fields[i].len);
+	}
+	return crc;
+}
+
+// Save context information to file in SPIFFS, skipped if nothing changed
 void saveContext() {
-	const size_t capacity = JSON_OBJECT_SIZE(3) + 5000;
-	DynamicJsonDocument contextDoc(capacity);
-	contextDoc["access_token"] = access_token.c_str();
-	contextDoc["refresh_token"] = refresh_token.c_str();
-	contextDoc["id_token"] = id_token.c_str();
+	ContextField fields[CONTEXT_FIELDS];
+	getContextFields(fields);
+	uint32_t newCrc = getContextCrc(fields);
+	if (newCrc == contextCrc && SPIFFS.exists(CONTEXT_FILE)) {
+		DBG_PRINTLN(F("saveContext() - Unchanged, skipped"));
+		return;
+	}
 
-	File contextFile = SPIFFS.open(CONTEXT_FILE, FILE_WRITE);
-	size_t bytesWritten = serializeJsonPretty(contextDoc, contextFile);
+	File contextFile = SPIFFS.open(CONTEXT_TMP_FILE, FILE_WRITE);
+	uint32_t crc = 0;
+	uint32_t magic = CONTEXT_MAGIC;
+	uint8_t count = CONTEXT_FIELDS;
+	boolean ok = contextFile && writeContextBlock(contextFile, &magic, sizeof(magic), crc) && writeContextBlock(contextFile, &count, sizeof(count), crc);
+	for (int i = 0; i < CONTEXT_FIELDS && ok; i++) {
+		ok = writeContextBlock(contextFile, &fields[i].len, sizeof(fields[i].len), crc) && writeContextBlock(contextFile, fields[i].data, fields[i].len, crc);
+	}
+	ok = ok && contextFile.write((const uint8_t*)&crc, sizeof(crc)) == sizeof(crc);
+	size_t bytesWritten = contextFile.size();
 	contextFile.close();
+
+	if (!ok) {
+		DBG_PRINTLN(F("saveContext() - Write failed"));
+		SPIFFS.remove(CONTEXT_TMP_FILE);
+		return;
+	}
+	SPIFFS.remove(CONTEXT_FILE);
+	SPIFFS.rename(CONTEXT_TMP_FILE, CONTEXT_FILE);
+	contextCrc = newCrc;
 	DBG_PRINT(F("saveContext() - Success: "));
 	DBG_PRINTLN(bytesWritten);
-	// DBG_PRINTLN(contextDoc.as<String>());
 }
 
-boolean loadContext() {
-	File file = SPIFFS.open(CONTEXT_FILE);
-	boolean success = false;
+// Take over one field of the context file, data is zero terminated. Fields 4 and 5 are only in older files.
+void setContextField(int index, const char* data, uint16_t len) {
+	switch (index) {
+		case 0: setToken(access_token, sizeof(access_token), data); break;
+		case 1: setToken(refresh_token, sizeof(refresh_token), data); break;
+		case 2: setToken(id_token, sizeof(id_token), data); break;
+		case 3:
+			if (len == sizeof(expiresAt)) {
+				memcpy(&expiresAt, data, sizeof(expiresAt));
+			}
+			break;
+		case 4: strlcpy(availability, data, sizeof(availability)); break;
+		case 5: strlcpy(activity, data, sizeof(activity)); break;
+	}
+}
 
+// Read and check a context file, returns false if it is missing or corrupt
+boolean readContextFile(const char* path) {
+	File file = SPIFFS.open(path);
 	if (!file) {
-		DBG_PRINTLN(F("loadContext() - No file found"));
-	} else {
-		size_t size = file.size();
-		if (size == 0) {
-			DBG_PRINTLN(F("loadContext() - File empty"));
-		} else {
-			const int capacity = JSON_OBJECT_SIZE(3) + 10000;
-			DynamicJsonDocument contextDoc(capacity);
-			DeserializationError err = deserializeJson(contextDoc, file);
-
-			if (err) {
-				DBG_PRINT(F("loadContext() - deserializeJson() failed with code: "));
-				DBG_PRINTLN(err.c_str());
-			} else {
-				int numSettings = 0;
-				if (!contextDoc["access_token"].isNull()) {
-					access_token = contextDoc["access_token"].as<String>();
-					numSettings++;
-				}
-				if (!contextDoc["refresh_token"].isNull()) {
-					refresh_token = contextDoc["refresh_token"].as<String>();
-					numSettings++;
-				}
-				if (!contextDoc["id_token"].isNull()){
-					id_token = contextDoc["id_token"].as<String>();
-					numSettings++;
-				}
-				if (numSettings == 3) {
-					success = true;
-					DBG_PRINTLN(F("loadContext() - Success"));
-					if (strlen(paramClientIdValue) > 0 && strlen(paramTenantValue) > 0) {
-						DBG_PRINTLN(F("loadContext() - Next: Refresh token."));
-						state = SMODEREFRESHTOKEN;
-					} else {
-						DBG_PRINTLN(F("loadContext() - No client id or tenant setting found."));
-					}
-				} else {
-					Serial.printf("loadContext() - ERROR Number of valid settings in file: %d, should be 3.\n", numSettings);
-				}
-				// DBG_PRINTLN(contextDoc.as<String>());
-			}
+		return false;
+	}
+	size_t size = file.size();
+	uint8_t* buf = (size > sizeof(uint32_t) * 2) ? (uint8_t*)malloc(size) : NULL;
+	boolean valid = buf != NULL && file.read(buf, size) == size;
+	file.close();
+
+	// Check magic and CRC
+	uint32_t magic, crc;
+	if (valid) {
+		memcpy(&magic, buf, sizeof(magic));
+		memcpy(&crc, buf + size - sizeof(crc), sizeof(crc));
+		valid = magic == CONTEXT_MAGIC && crc == crc32_le(0, buf, size - sizeof(crc));
+	}
+
+	// Fields, unknown fields of newer versions are ignored
+	size_t pos = sizeof(magic);
+	uint8_t count = valid ? buf[pos++] : 0;
+	valid = valid && count >= CONTEXT_MIN_FIELDS;
+	for (int i = 0; i < count && valid; i++) {
+		uint16_t len = 0;
+		valid = pos + sizeof(len) <= size - sizeof(crc);
+		if (valid) {
+			memcpy(&len, buf + pos, sizeof(len));
+			pos += sizeof(len);
+			valid = pos + len <= size - sizeof(crc);
+		}
+		if (valid) {
+			// Terminate the field in place, the byte behind it is restored afterwards
+			char next = buf[pos + len];
+			buf[pos + len] = '\0';
+			setContextField(i, (const char*)(buf + pos), len);
+			buf[pos + len] = next;
+			pos += len;
 		}
-		file.close();
 	}
 
+	free(buf);
+	if (valid) {
+		contextCrc = (count == CONTEXT_FIELDS) ? crc : 0;
+	} else {
+		Serial.printf("loadContext() - %s is corrupt, ignored.\n", path);
+		access_token[0] = refresh_token[0] = id_token[0] = '\0';
+		expiresAt = 0;
+		availability[0] = activity[0] = '\0';
+	}
+	return valid;
+}
+
+// Context file of older versions (JSON), converted once
+boolean loadLegacyContext() {
+	File file = SPIFFS.open(CONTEXT_LEGACY_FILE);
+	if (!file) {
+		return false;
+	}
+	const int capacity = JSON_OBJECT_SIZE(3) + 10000;
+	DynamicJsonDocument contextDoc(capacity);
+	DeserializationError err = deserializeJson(contextDoc, file);
+	file.close();
+	if (err || contextDoc["access_token"].isNull() || contextDoc["refresh_token"].isNull() || contextDoc["id_token"].isNull()) {
+		DBG_PRINTLN(F("loadContext() - Legacy file invalid"));
+		return false;
+	}
+	setToken(access_token, sizeof(access_token), contextDoc["access_token"]);
+	setToken(refresh_token, sizeof(refresh_token), contextDoc["refresh_token"]);
+	setToken(id_token, sizeof(id_token), contextDoc["id_token"]);
+
+	DBG_PRINTLN(F("loadContext() - Legacy file migrated"));
+	saveContext();
+	SPIFFS.remove(CONTEXT_LEGACY_FILE);
+	return true;
+}
+
+/**
+ * Last presence file
+ * The last own presence is kept apart from the tokens, so a presence change rewrites a few
+ * bytes instead of the whole context. A fixed record with CRC, a torn write is ignored at boot.
+ * Written by onSaveDue() (TIMER_SAVE), only if it changed and at most every PRESENCE_SAVE_INTERVAL.
+ */
+#define LAST_PRESENCE_MAGIC 0x53505445UL			// "ETPS"
+
+struct PresenceRecord {
+	uint32_t magic;
+	char availability[PRESENCE_NAME_LEN];
+	char activity[PRESENCE_NAME_LEN];
+	uint32_t crc;								// CRC32 over everything before it
+};
+
+uint32_t presenceCrc = 0;						// CRC of the last saved / loaded record
+unsigned long presenceSavedMillis = 0;			// Time of the last write, 0 if not written yet
+
+// Current presence as record
+void getPresenceRecord(PresenceRecord& record) {
+	memset(&record, 0, sizeof(record));
+	record.magic = LAST_PRESENCE_MAGIC;
+	strlcpy(record.availability, availability, sizeof(record.availability));
+	strlcpy(record.activity, activity, sizeof(record.activity));
+	record.crc = crc32_le(0, (const uint8_t*)&record, offsetof(PresenceRecord, crc));
+}
+
+boolean isPresenceSaved() {
+	PresenceRecord record;
+	getPresenceRecord(record);
+	return record.crc == presenceCrc;
+}
+
+// Write the last presence file, skipped if nothing changed
+void savePresence() {
+	PresenceRecord record;
+	getPresenceRecord(record);
+	if (record.crc == presenceCrc) {
+		return;
+	}
+	File file = SPIFFS.open(LAST_PRESENCE_FILE, FILE_WRITE);
+	boolean ok = file && file.write((const uint8_t*)&record, sizeof(record)) == sizeof(record);
+	file.close();
+	if (!ok) {
+		DBG_PRINTLN(F("savePresence() - Write failed"));
+		return;
+	}
+	presenceCrc = record.crc;
+	presenceSavedMillis = millis();
+	DBG_PRINTLN(F("savePresence() - Success"));
+}
+
+// Read the last presence file, keeps the current presence if it is missing or corrupt
+boolean loadPresence() {
+	File file = SPIFFS.open(LAST_PRESENCE_FILE);
+	if (!file) {
+		return false;
+	}
+	PresenceRecord record;
+	boolean valid = file.read((uint8_t*)&record, sizeof(record)) == sizeof(record);
+	file.close();
+	valid = valid && record.magic == LAST_PRESENCE_MAGIC && record.crc == crc32_le(0, (const uint8_t*)&record, offsetof(PresenceRecord, crc));
+	if (!valid) {
+		Serial.printf("loadPresence() - %s is corrupt, ignored.\n", LAST_PRESENCE_FILE);
+		return false;
+	}
+	record.availability[sizeof(record.availability) - 1] = '\0';
+	record.activity[sizeof(record.activity) - 1] = '\0';
+	strlcpy(availability, record.availability, sizeof(availability));
+	strlcpy(activity, record.activity, sizeof(activity));
+	presenceCrc = record.crc;
+	return true;
+}
+
+// Time until the presence may be written again (ms)
+unsigned long getPresenceSaveDelay() {
+	unsigned long elapsed = millis() - presenceSavedMillis;
+	return (presenceSavedMillis == 0 || elapsed >= PRESENCE_SAVE_INTERVAL * 1000UL) ? 0 : PRESENCE_SAVE_INTERVAL * 1000UL - elapsed;
+}
+
+// Called after the presence was applied, changes within the interval are written together
+void schedulePresenceSave() {
+	if (!isTimerArmed(TIMER_SAVE) && !isPresenceSaved()) {
+		armTimer(TIMER_SAVE, getPresenceSaveDelay());
+	}
+}
+
+// Tokens changed, written with the next loop() pass
+void scheduleContextSave() {
+	contextSavePending = true;
+	armTimer(TIMER_SAVE, 0);
+}
+
+// Load tokens and the last presence, called once at boot
+boolean loadContext() {
+	// A missing file after a power loss between remove and rename leaves the complete temp file
+	boolean success = readContextFile(CONTEXT_FILE);
+	if (!success && readContextFile(CONTEXT_TMP_FILE)) {
+		SPIFFS.remove(CONTEXT_FILE);
+		SPIFFS.rename(CONTEXT_TMP_FILE, CONTEXT_FILE);
+		success = true;
+	}
+	if (!success) {
+		success = loadLegacyContext();
+	}
+
+	if (!success) {
+		DBG_PRINTLN(F("loadContext() - No file found"));
+	} else {
+		loadPresence();
+		availabilityId = getPresenceId(availability);
+		activityId = getPresenceId(activity);
+		Serial.printf("loadContext() - Success, last presence: %s, %s\n", availability, activity);
+	}
 	return success;
 }
 
+// Continue with the loaded tokens after WiFi connected: poll right away if the access token
+// is still valid, refresh it otherwise. Returns the next state.
+uint8_t resumeContext() {
+	if (refresh_token[0] == '\0') {
+		return SMODEWIFICONNECTED;
+	}
+	if (strlen(paramClientIdValue) == 0 || strlen(paramTenantValue) == 0) {
+		DBG_PRINTLN(F("resumeContext() - No client id or tenant setting found."));
+		return SMODEWIFICONNECTED;
+	}
+
+	// Wait for the wall clock, SNTP usually answers within a few 100 ms
+	struct tm timeinfo;
+	if (expiresAt > 0 && !isClockSynced()) {
+		getLocalTime(&timeinfo, CLOCK_SYNC_TIMEOUT);
+	}
+	long lifetime = (expiresAt > 0 && isClockSynced()) ? (long)(expiresAt - time(NULL)) : 0;
+	if (access_token[0] != '\0' && lifetime > TOKEN_REFRESH_TIMEOUT) {
+		Serial.printf("resumeContext() - Access token still valid for %ld s, polling presence.\n", lifetime);
+		expires = millis() + lifetime * 1000;
+		armTimer(TIMER_STATE, 0);
+		return SMODEPOLLPRESENCE;
+	}
+	DBG_PRINTLN(F("resumeContext() - Next: Refresh token."));
+	return SMODEREFRESHTOKEN;
+}
+
 // Remove context information file in SPIFFS
 void removeContext() {
 	SPIFFS.remove(CONTEXT_FILE);
+	SPIFFS.remove(CONTEXT_TMP_FILE);
+	SPIFFS.remove(CONTEXT_LEGACY_FILE);
+	SPIFFS.remove(LAST_PRESENCE_FILE);
+	contextCrc = 0;
+	contextSavePending = false;
+	presenceCrc = 0;
+	expiresAt = 0;
 	DBG_PRINTLN(F("removeContext() - Success"));
 }
 
@@ -249,83 +666,103 @@ void startMDNS() {
 }
 
 
-#include "request_handler.h"
-#include "spiffs_webserver.h"
-
-
 // Neopixel control
+// Set the animation of a configured segment, segment 0 covers the whole strip if no segments are configured
 void setAnimation(uint8_t segment, uint8_t mode = FX_MODE_STATIC, uint32_t color = RED, uint16_t speed = 3000, bool reverse = false) {
-	uint16_t startLed, endLed = 0;
+	uint16_t startLed = 0;
+	uint16_t endLed = getLastLed();
 
-	// Support only one segment for the moment
-	if (segment == 0) {
-		startLed = 0;
-		endLed = numberLeds;
+	if (segment < numSegments) {
+		startLed = segments[segment].start;
+		endLed = segments[segment].stop;
+		reverse = (reverse != segments[segment].reverse);
 	}
 	Serial.printf("setAnimation: %d, %d-%d, Mode: %d, Color: %d, Speed: %d\n", segment, startLed, endLed, mode, color, speed);
-	ws2812fx.setSegment(segment, startLed, endLed, mode, color, speed, reverse);
+	queueSegment(segment, startLed, endLed, mode, color, speed, reverse);
 }
 
-void setPresenceAnimation() {
-	// Activity: Available, Away, BeRightBack, Busy, DoNotDisturb, InACall, InAConferenceCall, Inactive, InAMeeting, Offline, OffWork, OutOfOffice, PresenceUnknown, Presenting, UrgentInterruptionsOnly
-
-	if (activity.equals("Available")) {
-		setAnimation(0, FX_MODE_STATIC, GREEN);
-	}
-	if (activity.equals("Away")) {
-		setAnimation(0, FX_MODE_STATIC, YELLOW);
-	}
-	if (activity.equals("BeRightBack")) {
-		setAnimation(0, FX_MODE_STATIC, ORANGE);
-	}
-	if (activity.equals("Busy")) {
-		setAnimation(0, FX_MODE_STATIC, PURPLE);
-	}
-	if (activity.equals("DoNotDisturb") || activity.equals("UrgentInterruptionsOnly")) {
-		setAnimation(0, FX_MODE_STATIC, PINK);
+// Show the device status with one animation over the whole strip
+void setStatusAnimation(uint8_t mode, uint32_t color) {
+	if (stripLayout != LAYOUT_STATUS) {
+		queueResetSegments();
+		stripLayout = LAYOUT_STATUS;
 	}
-	if (activity.equals("InACall")) {
-		setAnimation(0, FX_MODE_BREATH, RED);
-	}
-	if (activity.equals("InAConferenceCall")) {
-		setAnimation(0, FX_MODE_BREATH, RED, 9000);
-	}
-	if (activity.equals("Inactive")) {
-		setAnimation(0, FX_MODE_BREATH, WHITE);
+	Serial.printf("setStatusAnimation: Mode: %d, Color: %d\n", mode, color);
+	queueSegment(0, 0, getLastLed(), mode, color, 3000, false);
+}
+
+// Show the presence on every segment, according to the source of the segment
+void setPresenceAnimation() {
+	if (bootFirstColorMillis == 0) {
+		bootFirstColorMillis = millis();
+		Serial.printf("Boot to first presence color: %lu ms\n", bootFirstColorMillis);
 	}
-	if (activity.equals("InAMeeting")) {
-		setAnimation(0, FX_MODE_SCAN, RED);
-	}	
-	if (activity.equals("Offline") || activity.equals("OffWork") || activity.equals("OutOfOffice") || activity.equals("PresenceUnknown")) {
-		setAnimation(0, FX_MODE_STATIC, BLACK);
+
+	// Switch from the status animation to the configured segments. Segments without a known
+	// presence keep their animation, after a reset they have none and are turned off. The reset
+	// also clears the strip, so LEDs between segments don't keep the status animation.
+	boolean rebuilt = (stripLayout != LAYOUT_PRESENCE);
+	if (rebuilt) {
+		queueResetSegments();
+		stripLayout = LAYOUT_PRESENCE;
 	}
-	if (activity.equals("Presenting")) {
-		setAnimation(0, FX_MODE_COLOR_WIPE, RED);
+
+	uint8_t count = (numSegments > 0) ? numSegments : 1;
+	for (uint8_t i = 0; i < count; i++) {
+		const PresenceEffect& effect = presenceEffects[getSegmentPresenceId(i)];
+		if (effect.mode != PRESENCE_EFFECT_NONE) {
+			setAnimation(i, effect.mode, effect.color, effect.speed);
+		} else if (rebuilt) {
+			setAnimation(i, FX_MODE_STATIC, BLACK);
+		}
 	}
 }
 
 
+#include "tls_client.h"
+#include "connection_pool.h"
+#include "web_assets.h"
+#include "root_page.h"
+#include "request_handler.h"
+#include "spiffs_webserver.h"
+
+
 /**
  * Application logic
  */
 
 // Handler: Wifi connected
 void onWifiConnected() {
-	state = SMODEWIFICONNECTED;
+	postEvent(EVENT_WIFI_CONNECTED);
 }
 
-// Poll for access token
-void pollForToken() {
-	String payload = "client_id=" + String(paramClientIdValue) + "&grant_type=urn:ietf:params:oauth:grant-type:device_code&device_code=" + device_code;
+// Request a device code for the login, returns the next state. The code is taken over when the result is handled.
+uint8_t requestDeviceCode(const NetJob& job) {
+	// Presence of other users needs Presence.Read.All, the calendar Calendars.Read. Only asked for if used.
+	snprintf(tokenPayload, sizeof(tokenPayload), "client_id=%s&scope=offline_access%%20openid%%20Presence.Read%s%s", paramClientIdValue, (job.numUsers > 0) ? USER_PRESENCE_SCOPE : "", (atoi(paramCalendarValue) == 1) ? CALENDAR_SCOPE : "");
+	DBG_PRINTLN(F("requestDeviceCode()"));
+
+	JsonDocument& responseDoc = tokenResponseDoc;
+	boolean res = requestJsonApi(responseDoc, getOAuthUrl(tokenUrl, sizeof(tokenUrl), "devicecode"), tokenPayload, TOKEN_RESPONSE_CAPACITY);
+	if (res && responseDoc.containsKey("device_code") && responseDoc.containsKey("user_code") && responseDoc.containsKey("interval") && responseDoc.containsKey("verification_uri") && responseDoc.containsKey("message")) {
+		return SMODEDEVICELOGINSTARTED;
+	}
+	DBG_PRINTLN(F("requestDeviceCode() - Unknown response"));
+	return SMODEDEVICELOGINFAILED;
+}
+
+// Poll for access token, returns the next state
+uint8_t pollForToken() {
+	snprintf(tokenPayload, sizeof(tokenPayload), "client_id=%s&grant_type=urn:ietf:params:oauth:grant-type:device_code&device_code=%s", paramClientIdValue, device_code);
 	Serial.printf("pollForToken()\n");
 
-	// const size_t capacity = JSON_ARRAY_SIZE(1) + JSON_OBJECT_SIZE(7) + 530; // Case 1: HTTP 400 error (not yet ready)
-	const size_t capacity = JSON_OBJECT_SIZE(7) + 10000; // Case 2: Successful (bigger size of both variants, so take that one as capacity)
-	DynamicJsonDocument responseDoc(capacity);
-	boolean res = requestJsonApi(responseDoc, "https://login.microsoftonline.com/" + String(paramTenantValue) + "/oauth2/v2.0/token", payload, capacity);
+	// Capacity fits the successful response, the bigger one of error (not yet ready) and success
+	JsonDocument& responseDoc = tokenResponseDoc;
+	boolean res = requestJsonApi(responseDoc, getOAuthUrl(tokenUrl, sizeof(tokenUrl), "token"), tokenPayload, TOKEN_RESPONSE_CAPACITY);
 
+	uint8_t nextState = SMODEDEVICELOGINSTARTED;
 	if (!res) {
-		state = SMODEDEVICELOGINFAILED;
+		nextState = SMODEDEVICELOGINFAILED;
 	} else if (responseDoc.containsKey("error")) {
 		const char* _error = responseDoc["error"];
 		const char* _error_description = responseDoc["error_description"];
@@ -334,199 +771,685 @@ void pollForToken() {
 			Serial.printf("pollForToken() - Wating for authorization by user: %s\n\n", _error_description);
 		} else {
 			Serial.printf("pollForToken() - Unexpected error: %s, %s\n\n", _error, _error_description);
-			state = SMODEDEVICELOGINFAILED;
+			nextState = SMODEDEVICELOGINFAILED;
 		}
 	} else {
 		if (responseDoc.containsKey("access_token") && responseDoc.containsKey("refresh_token") && responseDoc.containsKey("id_token")) {
-			// Save tokens and expiration
-			access_token = responseDoc["access_token"].as<String>();
-			refresh_token = responseDoc["refresh_token"].as<String>();
-			id_token = responseDoc["id_token"].as<String>();
-			unsigned int _expires_in = responseDoc["expires_in"].as<unsigned int>();
-			expires = millis() + (_expires_in * 1000); // Calculate timestamp when token expires
-
-			// Set state
-			state = SMODEAUTHREADY;
+			// Tokens are taken over when the result is handled
+			nextState = SMODEAUTHREADY;
 		} else {
 			Serial.printf("pollForToken() - Unknown response: %s\n", responseDoc.as<const char*>());
 		}
 	}
+	return nextState;
+}
+
+// Get presence information, returns the next state
+// Next state for an error response of Graph
+uint8_t getGraphErrorState(JsonDocument& responseDoc, const char* func) {
+	const char* _error_code = responseDoc["error"]["code"] | "";
+	if (strcmp(_error_code, "InvalidAuthenticationToken") == 0) {
+		Serial.printf("%s - Refresh needed\n", func);
+		return SMODEREFRESHTOKEN;
+	}
+	Serial.printf("%s - Error: %s\n", func, _error_code);
+	return SMODEPRESENCEREQUESTERROR;
 }
 
-// Get presence information
-void pollPresence() {
+// Poll own presence, returns the next state
+uint8_t pollOwnPresence(NetResult& result) {
 	// See: https://github.com/microsoftgraph/microsoft-graph-docs/blob/ananya/api-reference/beta/resources/presence.md
-	const size_t capacity = 1024;
-	DynamicJsonDocument responseDoc(capacity);
-	boolean res = requestJsonApi(responseDoc, "https://graph.microsoft.com/v1.0/me/presence", "", capacity, "GET", true);
+	// Only keep the fields needed, the documents live on the stack
+	StaticJsonDocument<PRESENCE_FILTER_CAPACITY> filter;
+	setPresenceFilter(filter);
+	StaticJsonDocument<PRESENCE_RESPONSE_CAPACITY> responseDoc;
+	HttpResponseHeaders headers;
+	boolean res = requestJsonApi(responseDoc, "https://graph.microsoft.com/v1.0/me/presence", NULL, PRESENCE_RESPONSE_CAPACITY, "GET", true, &filter, &headers);
+	result.httpStatus = headers.status;
+	result.retryAfter = headers.retryAfter;
 
 	if (!res) {
-		state = SMODEPRESENCEREQUESTERROR;
-		retries++;
+		return SMODEPRESENCEREQUESTERROR;
 	} else if (responseDoc.containsKey("error")) {
-		const char* _error_code = responseDoc["error"]["code"];
-		if (strcmp(_error_code, "InvalidAuthenticationToken")) {
-			DBG_PRINTLN(F("pollPresence() - Refresh needed"));
-			tsPolling = millis();
-			state = SMODEREFRESHTOKEN;
-		} else {
-			Serial.printf("pollPresence() - Error: %s\n", _error_code);
-			state = SMODEPRESENCEREQUESTERROR;
-			retries++;
+		return getGraphErrorState(responseDoc, "pollOwnPresence()");
+	}
+
+	// Presence is taken over when the result is handled
+	strlcpy(result.availability, responseDoc["availability"] | "", sizeof(result.availability));
+	strlcpy(result.activity, responseDoc["activity"] | "", sizeof(result.activity));
+	result.ownPresence = true;
+	return SMODEPOLLPRESENCE;
+}
+
+// Poll the presence of all other users with one request, returns the next state
+uint8_t pollUserPresences(const NetJob& job, NetResult& result) {
+	// See: https://learn.microsoft.com/en-us/graph/api/cloudcommunications-getpresencesbyuserid
+	static char payload[USER_PRESENCE_PAYLOAD_LEN];
+	StaticJsonDocument<USER_PRESENCE_FILTER_CAPACITY> filter;
+	setUserPresenceFilter(filter);
+	StaticJsonDocument<USER_PRESENCE_RESPONSE_CAPACITY> responseDoc;
+	HttpResponseHeaders headers;
+	boolean res = requestJsonApi(responseDoc, USER_PRESENCE_URL, getUserPresencePayload(payload, sizeof(payload), job.userIds, job.numUsers), USER_PRESENCE_RESPONSE_CAPACITY, "POST", true, &filter, &headers);
+	result.httpStatus = headers.status;
+	result.retryAfter = headers.retryAfter;
+
+	if (!res) {
+		if (headers.status == 403) {
+			DBG_PRINTLN(F("pollUserPresences() - Forbidden, start device login again to grant Presence.Read.All"));
 		}
-	} else {
-		// Store presence info
-		availability = responseDoc["availability"].as<String>();
-		activity = responseDoc["activity"].as<String>();
-		retries = 0;
+		return SMODEPRESENCEREQUESTERROR;
+	} else if (responseDoc.containsKey("error")) {
+		return getGraphErrorState(responseDoc, "pollUserPresences()");
+	}
 
-		setPresenceAnimation();
+	parseUserPresences(responseDoc["value"].as<JsonArrayConst>(), job.userIds, job.numUsers, result.userAvailabilityIds, result.userActivityIds);
+	result.numUsers = job.numUsers;
+	return SMODEPOLLPRESENCE;
+}
+
+// Fetch the events of the next hours into fetchedCalendarEvents, returns a CALENDAR_FETCH_* status.
+// Errors only turn the calendar-aware scheduling off.
+uint8_t fetchCalendar() {
+	// See: https://learn.microsoft.com/en-us/graph/api/user-list-calendarview
+	// Only the network task fetches, the document is kept off its stack
+	static char url[CALENDAR_URL_LEN];
+	char start[24];
+	char end[24];
+	time_t now = time(NULL);
+	formatCalendarTime(start, sizeof(start), now);
+	formatCalendarTime(end, sizeof(end), now + CALENDAR_WINDOW * 3600);
+	snprintf(url, sizeof(url), "https://graph.microsoft.com/v1.0/me/calendarView?startDateTime=%s&endDateTime=%s&$select=start,end,showAs&$orderby=start/dateTime&$top=%d", start, end, MAX_CALENDAR_EVENTS);
+
+	StaticJsonDocument<128> filter;
+	filter["value"][0]["start"]["dateTime"] = true;
+	filter["value"][0]["end"]["dateTime"] = true;
+	filter["value"][0]["showAs"] = true;
+	filter["error"]["code"] = true;
+
+	const size_t capacity = JSON_OBJECT_SIZE(2) + JSON_ARRAY_SIZE(MAX_CALENDAR_EVENTS) + MAX_CALENDAR_EVENTS * (JSON_OBJECT_SIZE(3) + 2 * JSON_OBJECT_SIZE(1) + 80) + 64;
+	static StaticJsonDocument<capacity> responseDoc;
+	HttpResponseHeaders headers;
+	boolean res = requestJsonApi(responseDoc, url, NULL, capacity, "GET", true, &filter, &headers);
+
+	if (!res || responseDoc.containsKey("error")) {
+		Serial.printf("fetchCalendar() - Error: %d %s\n", headers.status, responseDoc["error"]["code"] | "");
+		if (headers.status == 403) {
+			DBG_PRINTLN(F("fetchCalendar() - Forbidden, start device login again to grant Calendars.Read"));
+			return CALENDAR_FETCH_DENIED;
+		}
+		return CALENDAR_FETCH_FAILED;
+	}
+
+	// Free events don't change the presence
+	numFetchedCalendarEvents = 0;
+	for (JsonObject event : responseDoc["value"].as<JsonArray>()) {
+		const char* showAs = event["showAs"] | "";
+		if (strcmp(showAs, "free") == 0 || numFetchedCalendarEvents >= MAX_CALENDAR_EVENTS) {
+			continue;
+		}
+		CalendarEvent& e = fetchedCalendarEvents[numFetchedCalendarEvents];
+		e.start = parseCalendarTime(event["start"]["dateTime"] | "");
+		e.end = parseCalendarTime(event["end"]["dateTime"] | "");
+		e.oof = (strcmp(showAs, "oof") == 0);
+		if (e.start > 0 && e.end >= e.start) {
+			numFetchedCalendarEvents++;
+		}
 	}
+	Serial.printf("fetchCalendar() - %d events in the next %d hours\n", numFetchedCalendarEvents, CALENDAR_WINDOW);
+	return CALENDAR_FETCH_OK;
 }
 
-// Refresh the access token
-boolean refreshToken() {
-	boolean success = false;
+// Poll own presence and the one of other users, one request each if needed
+uint8_t pollPresence(const NetJob& job, NetResult& result) {
+	if (atoi(paramCalendarValue) == 1 && isClockSynced() && isCalendarDue()) {
+		result.calendarStatus = fetchCalendar();
+	}
+
+	uint8_t nextState = SMODEPOLLPRESENCE;
+	if (job.ownPresence) {
+		nextState = pollOwnPresence(result);
+	}
+	if (nextState == SMODEPOLLPRESENCE && job.numUsers > 0) {
+		nextState = pollUserPresences(job, result);
+	}
+	return nextState;
+}
+
+// Refresh the access token, returns the next state
+uint8_t refreshToken() {
 	// See: https://docs.microsoft.com/de-de/azure/active-directory/develop/v1-protocols-oauth-code#refreshing-the-access-tokens
-	String payload = "client_id=" + String(paramClientIdValue) + "&grant_type=refresh_token&refresh_token=" + refresh_token;
+	snprintf(tokenPayload, sizeof(tokenPayload), "client_id=%s&grant_type=refresh_token&refresh_token=%s", paramClientIdValue, refresh_token);
 	DBG_PRINTLN(F("refreshToken()"));
 
-	const size_t capacity = JSON_OBJECT_SIZE(7) + 10000;
-	DynamicJsonDocument responseDoc(capacity);
-	boolean res = requestJsonApi(responseDoc, "https://login.microsoftonline.com/" + String(paramTenantValue) + "/oauth2/v2.0/token", payload, capacity);
+	JsonDocument& responseDoc = tokenResponseDoc;
+	boolean res = requestJsonApi(responseDoc, getOAuthUrl(tokenUrl, sizeof(tokenUrl), "token"), tokenPayload, TOKEN_RESPONSE_CAPACITY);
 
-	// Replace tokens and expiration
+	// Tokens and expiration are replaced when the result is handled
 	if (res && responseDoc.containsKey("access_token") && responseDoc.containsKey("refresh_token")) {
-		if (!responseDoc["access_token"].isNull()) {
-			access_token = responseDoc["access_token"].as<String>();
-			success = true;
-		}
-		if (!responseDoc["refresh_token"].isNull()) {
-			refresh_token = responseDoc["refresh_token"].as<String>();
-			success = true;
-		}
-		if (!responseDoc["id_token"].isNull()) {
-			id_token = responseDoc["id_token"].as<String>();
+		DBG_PRINTLN(F("refreshToken() - Success"));
+		return SMODEPOLLPRESENCE;
+	}
+
+	DBG_PRINTLN(F("refreshToken() - Error:"));
+	serializeJson(responseDoc, Serial);
+	Serial.println();
+	return SMODEREFRESHTOKEN;
+}
+
+
+/**
+ * Network task
+ */
+void networkTask(void * parameter) {
+	NetJob job;
+	for (;;) {
+		if (xQueueReceive(netJobQueue, &job, portMAX_DELAY) != pdTRUE) {
+			continue;
 		}
-		if (!responseDoc["expires_in"].isNull()) {
-			int _expires_in = responseDoc["expires_in"].as<unsigned int>();
-			expires = millis() + (_expires_in * 1000); // Calculate timestamp when token expires
+		unsigned long start = micros();
+		beginNetworkActivity();
+		NetResult result = { job.job, job.fromState, job.fromState, 0, 0, false };
+		result.usersVersion = job.usersVersion;
+		switch (job.job) {
+			case NETJOB_POLLFORTOKEN:
+				result.nextState = pollForToken();
+				break;
+			case NETJOB_POLLPRESENCE:
+				result.nextState = pollPresence(job, result);
+				break;
+			case NETJOB_REFRESHTOKEN:
+				result.nextState = refreshToken();
+				break;
+			case NETJOB_ELECTION:
+				result.relayLeader = runRelayElection();
+				break;
+			case NETJOB_DEVICECODE:
+				result.nextState = requestDeviceCode(job);
+				break;
 		}
+		endNetworkActivity();
+		addBusyTime(POWER_SRC_NETWORK, micros() - start);
+		postNetResult(result);
+	}
+}
 
-		DBG_PRINTLN(F("refreshToken() - Success"));
-		state = SMODEPOLLPRESENCE;
-	} else {
-		DBG_PRINTLN(F("refreshToken() - Error:"));
-		Serial.println(responseDoc.as<String>());
-		// Set retry after timeout
-		tsPolling = millis() + (DEFAULT_ERROR_RETRY_INTERVAL * 1000);
+// Queue a job for the network task, only one job runs at a time
+boolean startNetJob(uint8_t job) {
+	if (netJobRunning) {
+		return false;
 	}
-	return success;
+	NetJob netJob = { job, state, needsOwnPresence(), presenceUsersVersion, numPresenceUsers };
+	for (uint8_t i = 0; i < numPresenceUsers; i++) {
+		strlcpy(netJob.userIds[i], presenceUsers[i].id, USER_ID_LEN);
+	}
+	if (xQueueSend(netJobQueue, &netJob, 0) != pdTRUE) {
+		return false;
+	}
+	netJobRunning = true;
+	return true;
 }
 
-// Implementation of a statemachine to handle the different application states
-void statemachine() {
+// Take over the polled presence, returns true if any of it changed
+boolean applyPresenceResult(const NetResult& result) {
+	boolean changed = false;
+	if (result.ownPresence && isPushActive()) {
+		// A local agent pushes the presence, Graph is only polled as watchdog
+		DBG_PRINTLN(F("Presence is pushed, ignoring Graph"));
+	} else if (result.ownPresence) {
+		uint8_t newAvailabilityId = getPresenceId(result.availability);
+		uint8_t newActivityId = getPresenceId(result.activity);
+		changed = (newAvailabilityId != availabilityId || newActivityId != activityId);
+		strlcpy(availability, result.availability, sizeof(availability));
+		strlcpy(activity, result.activity, sizeof(activity));
+		availabilityId = newAvailabilityId;
+		activityId = newActivityId;
+	}
 
-	// Statemachine: Check states of iotWebConf to detect AP mode and WiFi Connection attepmt
-	byte iotWebConfState = iotWebConf.getState();
-	if (iotWebConfState != lastIotWebConfState) {
-		if (iotWebConfState == IOTWEBCONF_STATE_NOT_CONFIGURED || iotWebConfState == IOTWEBCONF_STATE_AP_MODE) {
-			DBG_PRINTLN(F("Detected AP mode"));
-			setAnimation(0, FX_MODE_THEATER_CHASE, WHITE);
+	// Segments were reloaded while the job ran, the polled users may not match the table anymore
+	if (result.usersVersion != presenceUsersVersion) {
+		return changed;
+	}
+	// Users missing in the response keep their last state
+	for (uint8_t i = 0; i < result.numUsers && i < numPresenceUsers; i++) {
+		UserPresence& user = presenceUsers[i];
+		if (result.userAvailabilityIds[i] == USER_PRESENCE_MISSING) {
+			continue;
 		}
-		if (iotWebConfState == IOTWEBCONF_STATE_CONNECTING) {
-			DBG_PRINTLN(F("WiFi connecting"));
-			state = SMODEWIFICONNECTING;
+		if (result.userAvailabilityIds[i] != user.availabilityId || result.userActivityIds[i] != user.activityId) {
+			user.availabilityId = result.userAvailabilityIds[i];
+			user.activityId = result.userActivityIds[i];
+			changed = true;
 		}
 	}
-	lastIotWebConfState = iotWebConfState;
+	return changed;
+}
 
-	// Statemachine: Wifi connection start
-	if (state == SMODEWIFICONNECTING && laststate != SMODEWIFICONNECTING) {
-		setAnimation(0, FX_MODE_THEATER_CHASE, BLUE);
+// Take over the device code, returns the next state
+uint8_t handleDeviceCodeResult(const NetResult& result) {
+	JsonDocument& responseDoc = tokenResponseDoc;
+	if (result.nextState != SMODEDEVICELOGINSTARTED
+			|| !setToken(device_code, sizeof(device_code), responseDoc["device_code"])
+			|| !setToken(user_code, sizeof(user_code), responseDoc["user_code"])) {
+		deviceLoginStatus = DEVICELOGIN_FAILED;
+		return state;
 	}
+	strlcpy(verification_uri, responseDoc["verification_uri"] | "", sizeof(verification_uri));
+	strlcpy(deviceLoginMessage, responseDoc["message"] | "", sizeof(deviceLoginMessage));
+	interval = responseDoc["interval"].as<unsigned int>();
+	deviceLoginStatus = DEVICELOGIN_IDLE;
+
+	// Poll for the token every interval
+	armTimer(TIMER_STATE, interval * 1000);
+	return SMODEDEVICELOGINSTARTED;
+}
 
-	// Statemachine: After wifi is connected
-	if (state == SMODEWIFICONNECTED && laststate != SMODEWIFICONNECTED)
-	{
-		setAnimation(0, FX_MODE_THEATER_CHASE, GREEN);
-		startMDNS();
-		loadContext();
-		// WiFi client
-		DBG_PRINTLN(F("Wifi connected, waiting for requests ..."));
+// Apply the result of a finished network job, returns the next state
+uint8_t handleNetResult(const NetResult& result) {
+	netJobRunning = false;
+
+	// Results that don't depend on the state
+	if (result.job == NETJOB_DEVICECODE) {
+		return handleDeviceCodeResult(result);
+	}
+	if (result.job == NETJOB_ELECTION) {
+		relayLeader = result.relayLeader;
+		return state;
 	}
 
-	// Statemachine: Devicelogin started
-	if (state == SMODEDEVICELOGINSTARTED) {
-		if (laststate != SMODEDEVICELOGINSTARTED) {
-			setAnimation(0, FX_MODE_THEATER_CHASE, PURPLE);
+	// State was changed in the meantime (e.g. device login was started), result is outdated
+	if (state != result.fromState) {
+		Serial.printf("Dropping result of network job %d, state changed.\n", result.job);
+		return state;
+	}
+
+	if (result.job == NETJOB_POLLFORTOKEN && result.nextState == SMODEAUTHREADY && !applyTokenResponse()) {
+		return SMODEDEVICELOGINFAILED;
+	}
+	if (result.job == NETJOB_POLLPRESENCE) {
+		applyCalendarFetch(result.calendarStatus);
+		if (result.nextState == SMODEPOLLPRESENCE) {
+			retries = 0;
+			showingCachedPresence = false;
+			boolean changed = applyPresenceResult(result);
+			schedulePollSuccess(changed);
+			setPresenceAnimation();
+			sendRelayFrame(needsOwnPresence());
+			Serial.printf("--> Availability: %s, Activity: %s\n\n", availability, activity);
+			if (bootFirstLiveColorMillis == 0) {
+				bootFirstLiveColorMillis = millis();
+				Serial.printf("Boot to first live presence: %lu ms\n", bootFirstLiveColorMillis);
+			}
+			// Cache the presence for the next boot, written later by onSaveDue()
+			schedulePresenceSave();
+		} else if (result.nextState != SMODEREFRESHTOKEN) {
+			// Throttling is not a reason to refresh the token
+			if (result.httpStatus != HTTP_CODE_TOO_MANY_REQUESTS) {
+				retries++;
+			}
+			schedulePollError(result.retryAfter);
 		}
-		if (millis() >= tsPolling) {
-			pollForToken();
-			tsPolling = millis() + (interval * 1000);
+	}
+	if (result.job == NETJOB_REFRESHTOKEN) {
+		if (result.nextState == SMODEPOLLPRESENCE) {
+			applyTokenResponse();
+			scheduleContextSave();
+			armTimer(TIMER_STATE, 0);
+		} else {
+			// Set retry after timeout
+			armTimer(TIMER_STATE, DEFAULT_ERROR_RETRY_INTERVAL * 1000);
 		}
 	}
+	return result.nextState;
+}
+
+// Refresh the token TOKEN_REFRESH_TIMEOUT seconds before it expires
+void armTokenTimer() {
+	long remaining = (long)(expires - millis()) - TOKEN_REFRESH_TIMEOUT * 1000L;
+	armTimer(TIMER_TOKEN, max(remaining, 0L));
+}
+
+// Start a network job when the timer of the state is due, try again shortly if another job is running
+void startTimedNetJob(uint8_t job, unsigned long nextDelay) {
+	armTimer(TIMER_STATE, startNetJob(job) ? nextDelay : NETJOB_BUSY_RETRY);
+}
 
-	// Statemachine: Devicelogin failed
-	if (state == SMODEDEVICELOGINFAILED) {
-		DBG_PRINTLN(F("Device login failed"));
-		state = SMODEWIFICONNECTED;	// Return back to initial mode
+
+/**
+ * Statemachine
+ * Transitions: (state, event) -> action, the action returns the next state.
+ * Entry actions run once when a state is entered, they may continue to another state.
+ */
+struct Transition {
+	uint8_t state;
+	uint8_t event;
+	uint8_t (*action)(const StateEvent& e);
+};
+
+struct StateEntry {
+	uint8_t state;
+	uint8_t (*onEnter)();
+};
+
+// Transition actions
+uint8_t onWifiConnectingEvent(const StateEvent& e) {
+	DBG_PRINTLN(F("WiFi connecting"));
+	return SMODEWIFICONNECTING;
+}
+
+uint8_t onWifiConnectedEvent(const StateEvent& e) {
+	return SMODEWIFICONNECTED;
+}
+
+uint8_t onApModeEvent(const StateEvent& e) {
+	DBG_PRINTLN(F("Detected AP mode"));
+	setStatusAnimation(FX_MODE_THEATER_CHASE, WHITE);
+	return state;
+}
+
+// The device code is requested as soon as no other job runs
+void startPendingDeviceLogin() {
+	if (deviceLoginStatus == DEVICELOGIN_QUEUED && startNetJob(NETJOB_DEVICECODE)) {
+		deviceLoginStatus = DEVICELOGIN_RUNNING;
 	}
+}
 
-	// Statemachine: Auth is ready, start polling for presence immediately
-	if (state == SMODEAUTHREADY) {
-		saveContext();
-		state = SMODEPOLLPRESENCE;
-		tsPolling = millis();
+uint8_t onDeviceLoginEvent(const StateEvent& e) {
+	startPendingDeviceLogin();
+	return state;
+}
+
+uint8_t onNetDoneEvent(const StateEvent& e) {
+	uint8_t next = handleNetResult(e.result);
+	startPendingDeviceLogin();
+	if (!isTimerArmed(TIMER_REAP)) {
+		armTimer(TIMER_REAP, POOL_IDLE_TIMEOUT);
 	}
+	return next;
+}
 
-	// Statemachine: Poll for presence information, even if there was a error before (handled below)
-	if (state == SMODEPOLLPRESENCE) {
-		if (millis() >= tsPolling) {
-			DBG_PRINTLN(F("Polling presence info ..."));
-			pollPresence();
-			tsPolling = millis() + (atoi(paramPollIntervalValue) * 1000);
-			Serial.printf("--> Availability: %s, Activity: %s\n\n", availability.c_str(), activity.c_str());
-		}
+// Close idle pooled connections, try again shortly while a request runs
+uint8_t onReapDue(const StateEvent& e) {
+	if (xSemaphoreTake(netMutex, 0) != pdTRUE) {
+		armTimer(TIMER_REAP, NETJOB_BUSY_RETRY);
+		return state;
+	}
+	unsigned long next = reapIdleConnections();
+	xSemaphoreGive(netMutex);
+	if (next > 0) {
+		armTimer(TIMER_REAP, next);
+	}
+	return state;
+}
 
-		if (getTokenLifetime() < TOKEN_REFRESH_TIMEOUT) {
-			Serial.printf("Token needs refresh, valid for %d s.\n", getTokenLifetime());
-			state = SMODEREFRESHTOKEN;
-		}
+// Apply a pushed presence right away, in any state
+uint8_t onPushEvent(const StateEvent& e) {
+	if (!pushPending) {
+		return state;
 	}
+	pushPending = false;
+	uint8_t newAvailabilityId = getPresenceId(pendingPush.availability);
+	uint8_t newActivityId = getPresenceId(pendingPush.activity);
+	boolean changed = (newAvailabilityId != availabilityId || newActivityId != activityId);
+	strlcpy(availability, pendingPush.availability, sizeof(availability));
+	strlcpy(activity, pendingPush.activity, sizeof(activity));
+	availabilityId = newAvailabilityId;
+	activityId = newActivityId;
+	showingCachedPresence = false;
+	setPresenceAnimation();
+	if (changed) {
+		// Latency is taken by neopixelTask once the new animation is shown
+		queueMark(pendingPush.receivedMicros);
+	}
+	sendRelayFrame(true);
+	schedulePresenceSave();
+
+	if (pendingPush.sentAt > 0 && isClockSynced()) {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		pushNetworkLatencyMillis = (long)((int64_t)now.tv_sec * 1000 + now.tv_usec / 1000 - pendingPush.sentAt);
+	}
+	Serial.printf("--> Pushed availability: %s, activity: %s\n", availability, activity);
+	return state;
+}
 
-	// Statemachine: Refresh token
-	if (state == SMODEREFRESHTOKEN) {
-		if (laststate != SMODEREFRESHTOKEN) {
-			setAnimation(0, FX_MODE_THEATER_CHASE, RED);
+// Apply a frame of the relay leader, the device follows it only if the frame covers all it shows
+uint8_t onRelayEvent(const StateEvent& e) {
+	if (!relayPending) {
+		return state;
+	}
+	relayPending = false;
+	const RelayUpdate& update = pendingRelay;
+	boolean covered = !needsOwnPresence() || (update.flags & RELAY_FLAG_OWN);
+	if ((update.flags & RELAY_FLAG_OWN) && !isPushActive()) {
+		availabilityId = update.availabilityId;
+		activityId = update.activityId;
+		strlcpy(availability, presenceNames[availabilityId], sizeof(availability));
+		strlcpy(activity, presenceNames[activityId], sizeof(activity));
+	}
+	for (uint8_t i = 0; i < numPresenceUsers; i++) {
+		uint32_t hash = getRelayUserHash(presenceUsers[i].id);
+		uint8_t j = 0;
+		while (j < update.numUsers && update.userHashes[j] != hash) {
+			j++;
 		}
-		if (millis() >= tsPolling) {
-			boolean success = refreshToken();
-			if (success) {
-				saveContext();
-			}
+		if (j == update.numUsers) {
+			covered = false;
+			continue;
 		}
+		presenceUsers[i].availabilityId = update.userAvailabilityIds[j];
+		presenceUsers[i].activityId = update.userActivityIds[j];
 	}
+	if (covered) {
+		lastRelayFrameMillis = millis();
+	}
+	showingCachedPresence = false;
+	setPresenceAnimation();
+	schedulePresenceSave();
+	return state;
+}
 
-	// Statemachine: Polling presence failed
-	if (state == SMODEPRESENCEREQUESTERROR) {
-		if (laststate != SMODEPRESENCEREQUESTERROR) {
-			retries = 0;
-		}
-		
-		Serial.printf("Polling presence failed, retry #%d.\n", retries);
-		if (retries >= 5) {
-			// Try token refresh
-			state = SMODEREFRESHTOKEN;
+uint8_t onElectionDue(const StateEvent& e) {
+	armTimer(TIMER_RELAY, startNetJob(NETJOB_ELECTION) ? RELAY_ELECTION_INTERVAL * 1000UL : NETJOB_BUSY_RETRY);
+	return state;
+}
+
+// Deferred file writes, keeps SPIFFS out of the handling of poll results
+uint8_t onSaveDue(const StateEvent& e) {
+	if (contextSavePending) {
+		contextSavePending = false;
+		saveContext();
+	}
+	if (!isPresenceSaved()) {
+		unsigned long wait = getPresenceSaveDelay();
+		if (wait > 0) {
+			armTimer(TIMER_SAVE, wait);
 		} else {
-			state = SMODEPOLLPRESENCE;
+			savePresence();
 		}
 	}
+	return state;
+}
+
+uint8_t onLoginPollDue(const StateEvent& e) {
+	startTimedNetJob(NETJOB_POLLFORTOKEN, interval * 1000);
+	return state;
+}
+
+uint8_t onPresencePollDue(const StateEvent& e) {
+	// The relay leader polls for us, check again after the interval
+	if (isRelayFollowing()) {
+		schedulePoll(atoi(paramPollIntervalValue) * 1000, POLL_REASON_RELAY);
+		return state;
+	}
+	// Fallback if the result gets lost, the scheduler sets the real time when the result is handled
+	DBG_PRINTLN(F("Polling presence info ..."));
+	startTimedNetJob(NETJOB_POLLPRESENCE, atoi(paramPollIntervalValue) * 1000);
+	return state;
+}
+
+uint8_t onTokenDue(const StateEvent& e) {
+	// Relay followers refresh too, so they can take over when the leader goes quiet
+	// Let a running poll finish, its result would be dropped otherwise
+	if (netJobRunning) {
+		armTimer(TIMER_TOKEN, NETJOB_BUSY_RETRY);
+		return state;
+	}
+	Serial.printf("Token needs refresh, valid for %d s.\n", getTokenLifetime());
+	return SMODEREFRESHTOKEN;
+}
+
+uint8_t onRefreshDue(const StateEvent& e) {
+	startTimedNetJob(NETJOB_REFRESHTOKEN, DEFAULT_ERROR_RETRY_INTERVAL * 1000);
+	return state;
+}
+
+const Transition transitions[] = {
+	{ SMODEANY, EVENT_WIFI_CONNECTING, onWifiConnectingEvent },
+	{ SMODEANY, EVENT_WIFI_CONNECTED, onWifiConnectedEvent },
+	{ SMODEANY, EVENT_AP_MODE, onApModeEvent },
+	{ SMODEANY, EVENT_DEVICELOGIN, onDeviceLoginEvent },
+	{ SMODEANY, EVENT_NET_DONE, onNetDoneEvent },
+	{ SMODEANY, EVENT_PUSH, onPushEvent },
+	{ SMODEANY, EVENT_RELAY, onRelayEvent },
+	{ SMODEANY, EVENT_ELECTION, onElectionDue },
+	{ SMODEANY, EVENT_SAVE, onSaveDue },
+	{ SMODEANY, EVENT_REAP, onReapDue },
+	{ SMODEDEVICELOGINSTARTED, EVENT_TIMER, onLoginPollDue },
+	{ SMODEPOLLPRESENCE, EVENT_TIMER, onPresencePollDue },
+	{ SMODEPOLLPRESENCE, EVENT_TOKEN_DUE, onTokenDue },
+	{ SMODEREFRESHTOKEN, EVENT_TIMER, onRefreshDue },
+};
+
+// Entry actions
+uint8_t enterWifiConnecting() {
+	if (!showingCachedPresence) {
+		setStatusAnimation(FX_MODE_THEATER_CHASE, BLUE);
+	}
+	return SMODEWIFICONNECTING;
+}
+
+uint8_t enterWifiConnected() {
+	if (!showingCachedPresence) {
+		setStatusAnimation(FX_MODE_THEATER_CHASE, GREEN);
+	}
+	startMDNS();
+	startPushUdp();
+	startRelay();
+	if (relayStarted) {
+		armTimer(TIMER_RELAY, 0);
+	}
+	configTime(0, 0, NTP_SERVER);
+	DBG_PRINTLN(F("Wifi connected, waiting for requests ..."));
+	return resumeContext();
+}
 
-	// Update laststate
-	if (laststate != state) {
+uint8_t enterDeviceLoginStarted() {
+	setStatusAnimation(FX_MODE_THEATER_CHASE, PURPLE);
+	return SMODEDEVICELOGINSTARTED;
+}
+
+uint8_t enterDeviceLoginFailed() {
+	DBG_PRINTLN(F("Device login failed"));
+	return SMODEWIFICONNECTED;	// Return back to initial mode
+}
+
+// Auth is ready, start polling for presence immediately
+uint8_t enterAuthReady() {
+	saveContext();
+	calendarDenied = false;		// Scopes may have changed
+	armTimer(TIMER_STATE, 0);
+	return SMODEPOLLPRESENCE;
+}
+
+uint8_t enterPollPresence() {
+	if (getTokenLifetime() < TOKEN_REFRESH_TIMEOUT) {
+		Serial.printf("Token needs refresh, valid for %d s.\n", getTokenLifetime());
+		return SMODEREFRESHTOKEN;
+	}
+	armTokenTimer();
+	return SMODEPOLLPRESENCE;
+}
+
+uint8_t enterRefreshToken() {
+	setStatusAnimation(FX_MODE_THEATER_CHASE, RED);
+	cancelTimer(TIMER_TOKEN);
+	armTimer(TIMER_STATE, 0);
+	return SMODEREFRESHTOKEN;
+}
+
+// Polling presence failed, the next poll was scheduled with backoff when the result was handled
+uint8_t enterPresenceRequestError() {
+	Serial.printf("Polling presence failed, retry #%d.\n", retries);
+	if (retries >= 5) {
+		// Try token refresh
+		retries = 0;
+		return SMODEREFRESHTOKEN;
+	}
+	return SMODEPOLLPRESENCE;
+}
+
+const StateEntry stateEntries[] = {
+	{ SMODEWIFICONNECTING, enterWifiConnecting },
+	{ SMODEWIFICONNECTED, enterWifiConnected },
+	{ SMODEDEVICELOGINSTARTED, enterDeviceLoginStarted },
+	{ SMODEDEVICELOGINFAILED, enterDeviceLoginFailed },
+	{ SMODEAUTHREADY, enterAuthReady },
+	{ SMODEPOLLPRESENCE, enterPollPresence },
+	{ SMODEREFRESHTOKEN, enterRefreshToken },
+	{ SMODEPRESENCEREQUESTERROR, enterPresenceRequestError },
+};
+
+// Switch to a state and run its entry action, and the ones of the states it continues to
+void setState(uint8_t next) {
+	while (next != state) {
 		laststate = state;
+		state = next;
 		DBG_PRINTLN(F("======================================================================"));
+		for (const StateEntry& entry : stateEntries) {
+			if (entry.state == state) {
+				next = entry.onEnter();
+				break;
+			}
+		}
+	}
+}
+
+void dispatchEvent(const StateEvent& e) {
+	for (const Transition& t : transitions) {
+		if ((t.state == state || t.state == SMODEANY) && t.event == e.event) {
+			setState(t.action(e));
+			return;
+		}
+	}
+}
+
+// Turn changes of the iotWebConf state into events
+void checkIotWebConfState() {
+	byte iotWebConfState = iotWebConf.getState();
+	if (iotWebConfState != lastIotWebConfState) {
+		if (iotWebConfState == IOTWEBCONF_STATE_NOT_CONFIGURED || iotWebConfState == IOTWEBCONF_STATE_AP_MODE) {
+			postEvent(EVENT_AP_MODE);
+		}
+		if (iotWebConfState == IOTWEBCONF_STATE_CONNECTING) {
+			postEvent(EVENT_WIFI_CONNECTING);
+		}
+	}
+	lastIotWebConfState = iotWebConfState;
+}
+
+// Handle events, waits until the next timer is due or an event arrives (at most getLoopMaxWait())
+unsigned long loopWaitMicros = 0;
+void statemachine() {
+	checkIotWebConfState();
+	runTimers();
+
+	StateEvent e;
+	unsigned long waitStart = micros();
+	boolean received = (xQueueReceive(eventQueue, &e, pdMS_TO_TICKS(getNextTimerDelay(getLoopMaxWait()))) == pdTRUE);
+	loopWaitMicros = micros() - waitStart;
+	while (received) {
+		dispatchEvent(e);
+		received = (xQueueReceive(eventQueue, &e, 0) == pdTRUE);
 	}
 }
 
@@ -534,11 +1457,77 @@ void statemachine() {
 /**
  * Multicore
  */
+// Time until the next frame of an animated segment is due, portMAX_DELAY if all segments are static
+TickType_t getNextFrameDelay() {
+	unsigned long now = millis();
+	long wait = -1;
+	uint8_t numSegments = ws2812fx.getNumSegments();
+	for (uint8_t i = 0; i < numSegments; i++) {
+		if (ws2812fx.getMode(i) == FX_MODE_STATIC) {
+			continue;
+		}
+		WS2812FX::segment_runtime* runtime = ws2812fx.getSegmentRuntime(i);
+		if (runtime == NULL) {
+			continue;
+		}
+		// WS2812FX renders a segment once millis() is past next_time
+		long due = (long)(runtime->next_time - now) + 1;
+		if (due < 0) {
+			due = 0;
+		}
+		if (wait < 0 || due < wait) {
+			wait = due;
+		}
+	}
+	return (wait < 0) ? portMAX_DELAY : pdMS_TO_TICKS(wait);
+}
+
+// Sleep until the next frame deadline, changes in the LED command queue wake the task early
 void neopixelTask(void * parameter) {
+	unsigned long statsStart = millis();
+	uint32_t statsFrames = 0;
 	for (;;) {
+		unsigned long start = micros();
+		applyLedCommands();
 		ws2812fx.service();
-		vTaskDelay(10);
+		ledWakeups++;
+		if (ledMarkMicros != 0) {
+			pushLedLatencyMicros = micros() - ledMarkMicros;
+			ledMarkMicros = 0;
+		}
+
+		TickType_t wait = getNextFrameDelay();
+		setLedsAnimating(wait != portMAX_DELAY);
+
+		// Frame rate of the current mode, measured over at least one second or until the task parks
+		unsigned long elapsed = millis() - statsStart;
+		if (elapsed >= 1000 || (wait == portMAX_DELAY && elapsed > 0)) {
+			uint32_t frames = framesSent + framesSkipped;
+			uint8_t mode = ws2812fx.getMode(0);
+			if (mode < LED_STATS_MODES) {
+				ledFpsByMode[mode] = (uint8_t)min((uint32_t)255, (uint32_t)((frames - statsFrames) * 1000 / elapsed));
+			}
+			statsFrames = frames;
+			statsStart = millis();
+		}
+
+		addBusyTime(POWER_SRC_LEDS, micros() - start);
+		ulTaskNotifyTake(pdTRUE, wait);
+
+		if (wait == portMAX_DELAY) {
+			statsStart = millis();
+			statsFrames = framesSent + framesSkipped;
+		}
+	}
+}
+
+// FNV-1a hash of the pixel buffer, used to detect unchanged frames
+uint32_t getFrameHash(const uint8_t* pixels, uint16_t numBytes) {
+	uint32_t hash = 2166136261UL;
+	for (uint16_t i = 0; i < numBytes; i++) {
+		hash = (hash ^ pixels[i]) * 16777619UL;
 	}
+	return hash ^ numBytes;
 }
 
 void customShow(void) {
@@ -546,6 +1535,15 @@ void customShow(void) {
 	// numBytes is one more then the size of the ws2812fx's *pixels array.
 	// the extra byte is used by the driver to insert the LED reset pulse at the end.
 	uint16_t numBytes = ws2812fx.getNumBytes() + 1;
+
+	// Skip frames that are identical to the last one sent, the LEDs keep their color
+	uint32_t hash = getFrameHash(pixels, numBytes - 1);
+	if (hash == lastFrameHash && framesSent > 0) {
+		framesSkipped++;
+		return;
+	}
+	lastFrameHash = hash;
+	framesSent++;
 	rmt_write_sample(RMT_CHANNEL_0, pixels, numBytes, false); // channel 0
 }
 
@@ -567,7 +1565,7 @@ void setup()
 	ws2812fx.init();
 	rmt_tx_int(RMT_CHANNEL_0, ws2812fx.getPin());
 	ws2812fx.start();
-	setAnimation(0, FX_MODE_STATIC, WHITE);
+	setStatusAnimation(FX_MODE_STATIC, WHITE);
 
 	// iotWebConf - Initializing the configuration.
 	#ifdef LED_BUILTIN
@@ -579,6 +1577,11 @@ void setup()
 	iotWebConf.addParameter(&paramTenant);
 	iotWebConf.addParameter(&paramPollInterval);
 	iotWebConf.addParameter(&paramNumLeds);
+	iotWebConf.addParameter(&paramPowerSave);
+	iotWebConf.addParameter(&paramCalendar);
+	iotWebConf.addParameter(&paramPushToken);
+	iotWebConf.addParameter(&paramRelay);
+	iotWebConf.addParameter(&paramRelaySecret);
 	// iotWebConf.setFormValidator(&formValidator);
 	// iotWebConf.getApTimeoutParameter()->visible = true;
 	// iotWebConf.getApTimeoutParameter()->defaultValue = "10";
@@ -588,34 +1591,60 @@ void setup()
 	iotWebConf.skipApStartup();
 	iotWebConf.init();
 
+	// Modem sleep is applied once WiFi starts
+	initPowerManagement();
+	applyPowerMode(atoi(paramPowerSaveValue) == 1);
+
 	// WS2812FX
 	numberLeds = atoi(paramNumLedsValue);
 	if (numberLeds < 1) {
 		DBG_PRINTLN(F("Number of LEDs not given, using 16."));
 		numberLeds = NUMLEDS;
 	}
-	ws2812fx.setLength(numberLeds);
+	queueLength(numberLeds);
 	ws2812fx.setCustomShow(customShow);
 
+	// HTTPS connections to login and graph
+	initConnectionPool();
+
+	// Network requests run in their own task, so loop() keeps serving the web UI
+	netJobQueue = xQueueCreate(1, sizeof(NetJob));
+	eventQueue = xQueueCreate(EVENT_QUEUE_SIZE, sizeof(StateEvent));
+	netMutex = xSemaphoreCreateMutex();
+	xTaskCreatePinnedToCore(
+		networkTask,
+		"Network",
+		NETWORK_TASK_STACK,
+		NULL,
+		1,
+		&TaskNetwork,
+		1);
+
+	// Web requests and UDP packets wake loop() right away, not only when its wait ends
+	startSocketWake();
+
 	// HTTP server - Set up required URL handlers on the web server.
 	server.on("/", HTTP_GET, handleRoot);
 	server.on("/config", HTTP_GET, [] { iotWebConf.handleConfig(); });
 	server.on("/config", HTTP_POST, [] { iotWebConf.handleConfig(); });
 	server.on("/upload", HTTP_GET, [] { handleMinimalUpload(); });
 	server.on("/api/startDevicelogin", HTTP_GET, [] { handleStartDevicelogin(); });
+	server.on("/api/devicelogin", HTTP_GET, [] { handleGetDeviceLogin(); });
 	server.on("/api/settings", HTTP_GET, [] { handleGetSettings(); });
+	server.on("/api/segments", HTTP_GET, [] { handleGetSegments(); });
 	server.on("/api/clearSettings", HTTP_GET, [] { handleClearSettings(); });
+	server.on("/api/presence", HTTP_POST, handlePushRequest);
 	server.on("/fs/delete", HTTP_DELETE, handleFileDelete);
 	server.on("/fs/list", HTTP_GET, handleFileList);
-	server.on("/fs/upload", HTTP_POST, []() {
-		server.send(200, "text/plain", "");
-	}, handleFileUpload);
+	server.on("/fs/upload", HTTP_POST, handleFileUploadDone, handleFileUpload);
+
+	const char* collectHeaders[] = { "If-None-Match", "Authorization" };
+	server.collectHeaders(collectHeaders, 2);
 
 	// server.onNotFound([](){ iotWebConf.handleNotFound(); });
 	server.onNotFound([]() {
-		iotWebConf.handleNotFound();
 		if (!handleFileRead(server.uri())) {
-			server.send(404, "text/plain", "FileNotFound");
+			iotWebConf.handleNotFound();
 		}
 	});
 
@@ -627,6 +1656,10 @@ void setup()
 		DBG_PRINTLN("SPIFFS Mount Failed");
         return;
     }
+	buildFileIndex();
+	loadTlsSessions();
+	loadSegments();
+	loadPresenceEffects();
 
 	// Pin neopixel logic to core 0
 	xTaskCreatePinnedToCore(
@@ -637,12 +1670,24 @@ void setup()
 		1,
 		&TaskNeopixel,
 		0);
+
+	// Show the last known presence until WiFi is up and the first poll is done
+	if (loadContext() && (availabilityId != PRESENCE_NONE || activityId != PRESENCE_NONE)) {
+		showingCachedPresence = true;
+		setPresenceAnimation();
+	}
 }
 
 void loop()
 {
+	unsigned long start = micros();
+
 	// iotWebConf - doLoop should be called as frequently as possible.
 	iotWebConf.doLoop();
+	handlePushPackets();
+	handleRelayPackets();
+	markSocketsServed();
 
 	statemachine();
+	addBusyTime(POWER_SRC_LOOP, micros() - start - loopWaitMicros);
 }
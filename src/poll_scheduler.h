@@ -0,0 +1,100 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * Presence poll scheduler
+ * Decides when the next presence poll is due (TIMER_STATE in SMODEPOLLPRESENCE):
+ * - Regular interval from the settings, with up to 10% jitter so devices of one tenant drift apart
+ * - A few faster polls right after the presence changed, changes often come in a row
+ * - Exponential backoff with decorrelated jitter after errors, Retry-After of the server wins
+ * - Extra polls around meeting boundaries, fewer in free stretches (calendar.h, if enabled)
+ * - Only a slow watchdog poll while a local agent pushes the presence (push.h)
+ * - No polls while the relay leader sends the presence (relay.h), checked every interval
+ */
+#define POLL_REASON_INTERVAL 0
+#define POLL_REASON_CHANGE 1
+#define POLL_REASON_BACKOFF 2
+#define POLL_REASON_RETRYAFTER 3
+#define POLL_REASON_CALENDAR 4
+#define POLL_REASON_IDLE 5
+#define POLL_REASON_PUSH 6
+#define POLL_REASON_RELAY 7
+#define POLL_REASON_COUNT 8
+
+#define POLL_FAST_INTERVAL 10		// Interval after a presence change (s)
+#define POLL_FAST_COUNT 3			// Number of fast polls after a presence change
+#define POLL_BACKOFF_BASE 5			// First delay after an error (s)
+#define POLL_BACKOFF_MAX 300		// Max. delay after errors (s)
+#define POLL_RETRYAFTER_MAX 3600	// Ignore longer Retry-After values (s)
+
+const char* const pollReasonNames[POLL_REASON_COUNT] = { "interval", "change", "backoff", "retry_after", "calendar", "idle", "push", "relay" };
+
+uint8_t pollReason = POLL_REASON_INTERVAL;
+uint32_t pollBackoff = 0;			// Last backoff delay (s), 0 if the last poll was successful
+uint8_t pollFastRemaining = 0;
+
+
+// Random value in [min, max]
+uint32_t getPollJitter(uint32_t min, uint32_t max) {
+	return (max > min) ? min + esp_random() % (max - min + 1) : min;
+}
+
+void schedulePoll(uint32_t delayMillis, uint8_t reason) {
+	armTimer(TIMER_STATE, delayMillis);
+	pollReason = reason;
+	Serial.printf("Next presence poll in %u ms (%s)\n", delayMillis, pollReasonNames[reason]);
+}
+
+// Regular interval, or the fast cadence if the presence just changed, adjusted to the calendar
+void schedulePollSuccess(boolean changed) {
+	pollBackoff = 0;
+	if (isPushActive()) {
+		pollFastRemaining = 0;
+		schedulePoll(PUSH_WATCHDOG_INTERVAL * 1000UL, POLL_REASON_PUSH);
+		return;
+	}
+	if (changed) {
+		pollFastRemaining = POLL_FAST_COUNT;
+	}
+	uint32_t baseInterval = max(atoi(paramPollIntervalValue), 1) * 1000;
+	if (pollFastRemaining > 0 && POLL_FAST_INTERVAL * 1000 < baseInterval) {
+		pollFastRemaining--;
+		schedulePoll(POLL_FAST_INTERVAL * 1000, POLL_REASON_CHANGE);
+		return;
+	}
+
+	uint32_t pollDelay = baseInterval + getPollJitter(0, baseInterval / 10);
+	boolean stretched = false;
+	uint32_t calendarDelay = getCalendarPollDelay(pollDelay, stretched);
+	if (calendarDelay > 0) {
+		schedulePoll(calendarDelay, stretched ? POLL_REASON_IDLE : POLL_REASON_CALENDAR);
+	} else {
+		schedulePoll(pollDelay, POLL_REASON_INTERVAL);
+	}
+}
+
+// Decorrelated jitter: next = random(base, last * 3), capped. Retry-After (s) overrides it.
+void schedulePollError(uint32_t retryAfter) {
+	pollFastRemaining = 0;
+	if (retryAfter > 0 && retryAfter <= POLL_RETRYAFTER_MAX) {
+		pollBackoff = retryAfter;
+		schedulePoll(retryAfter * 1000 + getPollJitter(0, 1000), POLL_REASON_RETRYAFTER);
+		return;
+	}
+	pollBackoff = min((uint32_t)POLL_BACKOFF_MAX, getPollJitter(POLL_BACKOFF_BASE, max(pollBackoff, (uint32_t)POLL_BACKOFF_BASE) * 3));
+	schedulePoll(pollBackoff * 1000, POLL_REASON_BACKOFF);
+}
+
+// Seconds until the next poll, negative if it is overdue
+long getNextPollSeconds() {
+	return getTimerRemaining(TIMER_STATE) / 1000;
+}
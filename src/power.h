@@ -0,0 +1,152 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * Power management
+ * With power saving enabled the device idles between two deadlines:
+ * - CPU at POWER_CPU_FREQ_IDLE, full speed only while a network job runs (TLS handshakes)
+ * - WiFi max. modem sleep instead of the framework default (min. modem sleep, wakes for every DTIM beacon)
+ * - Automatic light sleep while all LED segments show a static frame, only if the
+ *   framework was built with CONFIG_PM_ENABLE and tickless idle. The prebuilt Arduino-ESP32
+ *   of PlatformIO is not, there the CPU is scaled with setCpuFrequencyMhz() and no light sleep happens.
+ * Wakeups come from the statemachine timers (poll scheduler), the sockets of the web server,
+ * the config portal, push and relay (socket_wake.h) and the LED command queue. loop() itself
+ * only wakes every POWER_LOOP_MAX_WAIT for iotWebConf. The busy time of the tasks is measured
+ * for the duty cycle.
+ */
+#include "esp_pm.h"
+
+#define POWER_CPU_FREQ_IDLE 80		// MHz, lowest frequency that keeps APB (RMT, UART) at 80 MHz
+#define POWER_CPU_FREQ_BUSY 240		// MHz
+#define POWER_LOOP_MAX_WAIT 100		// Max. time loop() waits for an event with power saving (ms), web requests don't wait for it
+
+#define POWER_SRC_LOOP 0
+#define POWER_SRC_NETWORK 1
+#define POWER_SRC_LEDS 2
+#define POWER_SRC_COUNT 3
+
+#if CONFIG_PM_ENABLE && CONFIG_FREERTOS_USE_TICKLESS_IDLE
+#define POWER_LIGHT_SLEEP 1
+#else
+#define POWER_LIGHT_SLEEP 0
+#endif
+
+const char* const powerSourceNames[POWER_SRC_COUNT] = { "loop", "network", "leds" };
+
+boolean powerSave = false;
+volatile uint32_t powerBusyMicros[POWER_SRC_COUNT];		// Each written by one task only
+
+#if CONFIG_PM_ENABLE
+esp_pm_lock_handle_t pmCpuLock = NULL;		// Full speed while a network job runs
+esp_pm_lock_handle_t pmAwakeLock = NULL;	// No light sleep while LEDs are animated
+boolean pmConfigured = false;
+#endif
+boolean ledsAnimating = false;
+boolean networkBoost = false;		// Set while beginNetworkActivity() raised the frequency
+
+
+void addBusyTime(uint8_t source, unsigned long micros) {
+	powerBusyMicros[source] += micros;
+}
+
+// Must run before the network and neopixel tasks are started
+void initPowerManagement() {
+#if CONFIG_PM_ENABLE
+	esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "net", &pmCpuLock);
+	esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "leds", &pmAwakeLock);
+#endif
+}
+
+// Apply the power saving setting. The WiFi sleep type is only set if the setting changed (it is
+// taken over when WiFi starts), so with power saving off the framework default stays.
+void applyPowerMode(boolean enabled) {
+	if (enabled != powerSave) {
+		WiFi.setSleep(enabled ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM);
+	}
+	powerSave = enabled;
+
+#if CONFIG_PM_ENABLE
+	esp_pm_config_esp32_t pmConfig = {
+		.max_freq_mhz = POWER_CPU_FREQ_BUSY,
+		.min_freq_mhz = enabled ? POWER_CPU_FREQ_IDLE : POWER_CPU_FREQ_BUSY,
+		.light_sleep_enable = enabled && POWER_LIGHT_SLEEP
+	};
+	pmConfigured = (esp_pm_configure(&pmConfig) == ESP_OK);
+	if (pmConfigured) {
+		Serial.printf("Power management: %s, light sleep: %d\n", enabled ? "on" : "off", pmConfig.light_sleep_enable);
+		return;
+	}
+#endif
+
+	// Without esp_pm scale the CPU directly
+	setCpuFrequencyMhz(enabled ? POWER_CPU_FREQ_IDLE : POWER_CPU_FREQ_BUSY);
+	Serial.printf("Power saving: %s, CPU %u MHz\n", enabled ? "on" : "off", getCpuFrequencyMhz());
+}
+
+// Network task, around each job
+void beginNetworkActivity() {
+	networkBoost = powerSave;
+	if (!networkBoost) {
+		return;
+	}
+#if CONFIG_PM_ENABLE
+	if (pmConfigured) {
+		esp_pm_lock_acquire(pmCpuLock);
+		return;
+	}
+#endif
+	setCpuFrequencyMhz(POWER_CPU_FREQ_BUSY);
+}
+
+void endNetworkActivity() {
+	if (!networkBoost) {
+		return;
+	}
+	networkBoost = false;
+#if CONFIG_PM_ENABLE
+	if (pmConfigured) {
+		esp_pm_lock_release(pmCpuLock);
+		return;
+	}
+#endif
+	if (powerSave) {
+		setCpuFrequencyMhz(POWER_CPU_FREQ_IDLE);
+	}
+}
+
+// Neopixel task, light sleep is only allowed while all segments are static
+void setLedsAnimating(boolean animating) {
+	if (animating == ledsAnimating) {
+		return;
+	}
+	ledsAnimating = animating;
+#if CONFIG_PM_ENABLE
+	if (animating) {
+		esp_pm_lock_acquire(pmAwakeLock);
+	} else {
+		esp_pm_lock_release(pmAwakeLock);
+	}
+#endif
+}
+
+// Light sleep is built in and esp_pm took the configuration
+boolean isLightSleepActive() {
+#if CONFIG_PM_ENABLE
+	return powerSave && POWER_LIGHT_SLEEP && pmConfigured;
+#else
+	return false;
+#endif
+}
+
+unsigned long getLoopMaxWait() {
+	return powerSave ? POWER_LOOP_MAX_WAIT : LOOP_MAX_WAIT;
+}
@@ -0,0 +1,110 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * Presence effects
+ * The effect for a PRESENCE_* id (graph_presence.h) is a single lookup in presenceEffects,
+ * overrides are loaded from PRESENCE_FILE.
+ */
+#define PRESENCE_FILE "/presence.json"		// Optional effect overrides, e.g. {"Busy": {"mode": "Breath", "color": "#FF0000", "speed": 2000}}
+
+#define PRESENCE_EFFECT_NONE 0xFF			// Mode value for "keep the current animation"
+
+struct PresenceEffect {
+	uint8_t mode;
+	uint32_t color;
+	uint16_t speed;
+};
+
+// Indexed by PRESENCE_* id
+PresenceEffect presenceEffects[PRESENCE_COUNT] = {
+	{ PRESENCE_EFFECT_NONE, BLACK, 3000 },	// PRESENCE_NONE
+	{ FX_MODE_STATIC, GREEN, 3000 },		// Available
+	{ FX_MODE_STATIC, GREEN, 3000 },		// AvailableIdle
+	{ FX_MODE_STATIC, YELLOW, 3000 },		// Away
+	{ FX_MODE_STATIC, ORANGE, 3000 },		// BeRightBack
+	{ FX_MODE_STATIC, PURPLE, 3000 },		// Busy
+	{ FX_MODE_STATIC, PURPLE, 3000 },		// BusyIdle
+	{ FX_MODE_STATIC, PINK, 3000 },			// DoNotDisturb
+	{ FX_MODE_BREATH, RED, 3000 },			// InACall
+	{ FX_MODE_BREATH, RED, 9000 },			// InAConferenceCall
+	{ FX_MODE_BREATH, WHITE, 3000 },		// Inactive
+	{ FX_MODE_SCAN, RED, 3000 },			// InAMeeting
+	{ FX_MODE_STATIC, BLACK, 3000 },		// Offline
+	{ FX_MODE_STATIC, BLACK, 3000 },		// OffWork
+	{ FX_MODE_STATIC, BLACK, 3000 },		// OutOfOffice
+	{ FX_MODE_STATIC, BLACK, 3000 },		// PresenceUnknown
+	{ FX_MODE_COLOR_WIPE, RED, 3000 },		// Presenting
+	{ FX_MODE_STATIC, PINK, 3000 }			// UrgentInterruptionsOnly
+};
+
+// Mode given as WS2812FX mode number or name (case insensitive)
+uint8_t getEffectMode(JsonVariant value, uint8_t fallback) {
+	if (value.is<int>()) {
+		int mode = value.as<int>();
+		return (mode >= 0 && mode < ws2812fx.getModeCount()) ? mode : fallback;
+	}
+	const char* name = value | "";
+	for (uint8_t mode = 0; mode < ws2812fx.getModeCount(); mode++) {
+		if (strcasecmp(name, (const char*)ws2812fx.getModeName(mode)) == 0) {
+			return mode;
+		}
+	}
+	return fallback;
+}
+
+// Color given as number or "#RRGGBB"
+uint32_t getEffectColor(JsonVariant value, uint32_t fallback) {
+	if (value.is<uint32_t>()) {
+		return value.as<uint32_t>();
+	}
+	const char* color = value | "";
+	if (color[0] == '#' && strlen(color) == 7) {
+		return strtoul(color + 1, NULL, 16);
+	}
+	return fallback;
+}
+
+// Load effect overrides from SPIFFS, called once at boot
+boolean loadPresenceEffects() {
+	if (!SPIFFS.exists(PRESENCE_FILE)) {
+		DBG_PRINTLN(F("loadPresenceEffects() - No file found, using defaults"));
+		return false;
+	}
+
+	File file = SPIFFS.open(PRESENCE_FILE);
+	const size_t capacity = JSON_OBJECT_SIZE(PRESENCE_COUNT) + PRESENCE_COUNT * (JSON_OBJECT_SIZE(3) + PRESENCE_NAME_LEN + 32);
+	DynamicJsonDocument doc(capacity);
+	DeserializationError err = deserializeJson(doc, file);
+	file.close();
+	if (err) {
+		DBG_PRINT(F("loadPresenceEffects() - deserializeJson() failed with code: "));
+		DBG_PRINTLN(err.c_str());
+		return false;
+	}
+
+	int numEffects = 0;
+	for (JsonPair pair : doc.as<JsonObject>()) {
+		uint8_t id = getPresenceId(pair.key().c_str());
+		if (id == PRESENCE_NONE) {
+			Serial.printf("loadPresenceEffects() - Unknown presence: %s\n", pair.key().c_str());
+			continue;
+		}
+		JsonObject effect = pair.value().as<JsonObject>();
+		presenceEffects[id].mode = getEffectMode(effect["mode"], presenceEffects[id].mode);
+		presenceEffects[id].color = getEffectColor(effect["color"], presenceEffects[id].color);
+		presenceEffects[id].speed = effect["speed"] | presenceEffects[id].speed;
+		numEffects++;
+	}
+	Serial.printf("loadPresenceEffects() - %d effects loaded.\n", numEffects);
+	return true;
+}
@@ -0,0 +1,143 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * Local presence push
+ * A local agent that knows the Teams state can push the own presence instead of waiting
+ * for the next poll, enabled by setting a push token:
+ * - HTTP: POST /api/presence, header "Authorization: Bearer <token>"
+ *     {"availability": "Busy", "activity": "InACall", "sent_at": 1760000000000}
+ * - UDP: datagram to PUSH_UDP_PORT, same JSON with an additional "token" field
+ * sent_at (optional, ms since epoch) is used to measure the network latency.
+ * If the event queue is full, HTTP pushes are answered with 503 and Retry-After.
+ * The update is applied by the statemachine (EVENT_PUSH). While pushes arrive Graph is
+ * only polled every PUSH_WATCHDOG_INTERVAL and its own presence is ignored.
+ */
+#include <WiFiUdp.h>
+
+#define PUSH_UDP_PORT 5005
+#define PUSH_PACKET_LEN 256
+#define PUSH_MAX_PACKETS 4				// Max. datagrams handled per loop() pass
+#define PUSH_ACTIVE_WINDOW 120			// Pushes count as active this long after the last one (s)
+#define PUSH_WATCHDOG_INTERVAL 300		// Graph poll interval while pushes are active (s)
+#define PUSH_RETRY_AFTER "1"			// Retry-After if the event queue is full (s)
+
+struct PushUpdate {
+	char availability[PRESENCE_NAME_LEN];
+	char activity[PRESENCE_NAME_LEN];
+	int64_t sentAt;						// Sender time (ms since epoch), 0 if not given
+	unsigned long receivedMicros;
+};
+
+PushUpdate pendingPush;
+boolean pushPending = false;
+unsigned long lastPushMillis = 0;
+uint32_t pushCount = 0;
+volatile unsigned long pushLedLatencyMicros = 0;	// Push received until the LEDs showed it, only taken if it changed the presence
+long pushNetworkLatencyMillis = -1;				// Sender to device, needs sent_at and synced clocks
+
+WiFiUDP pushUdp;
+boolean pushUdpStarted = false;
+
+
+boolean isPushEnabled() {
+	return paramPushTokenValue[0] != '\0';
+}
+
+boolean isPushActive() {
+	return lastPushMillis > 0 && millis() - lastPushMillis < PUSH_ACTIVE_WINDOW * 1000UL;
+}
+
+// Compare in constant time, so the token can't be guessed char by char
+boolean isPushTokenValid(const char* token) {
+	size_t len = strlen(paramPushTokenValue);
+	if (len == 0 || strlen(token) != len) {
+		return false;
+	}
+	uint8_t diff = 0;
+	for (size_t i = 0; i < len; i++) {
+		diff |= token[i] ^ paramPushTokenValue[i];
+	}
+	return diff == 0;
+}
+
+// Store the update and hand it to the statemachine, returns a HTTP status code
+int queuePush(JsonDocument& doc, unsigned long receivedMicros) {
+	if (!doc.containsKey("availability") && !doc.containsKey("activity")) {
+		return 400;
+	}
+	strlcpy(pendingPush.availability, doc["availability"] | "", sizeof(pendingPush.availability));
+	strlcpy(pendingPush.activity, doc["activity"] | "", sizeof(pendingPush.activity));
+	pendingPush.sentAt = doc["sent_at"] | (int64_t)0;
+	pendingPush.receivedMicros = receivedMicros;
+	pushPending = true;
+	lastPushMillis = millis();
+	pushCount++;
+	return postEvent(EVENT_PUSH) ? 200 : 503;
+}
+
+// Requests to /api/presence
+void handlePushRequest() {
+	unsigned long receivedMicros = micros();
+	if (!isPushEnabled()) {
+		server.send(404, "application/json", F("{\"error\": \"push disabled\"}"));
+		return;
+	}
+	String auth = server.header("Authorization");
+	if (!auth.startsWith("Bearer ") || !isPushTokenValid(auth.c_str() + 7)) {
+		server.send(401, "application/json", F("{\"error\": \"unauthorized\"}"));
+		return;
+	}
+
+	StaticJsonDocument<192> doc;
+	if (deserializeJson(doc, server.arg("plain"))) {
+		server.send(400, "application/json", F("{\"error\": \"invalid json\"}"));
+		return;
+	}
+	int status = queuePush(doc, receivedMicros);
+	if (status == 503) {
+		server.sendHeader("Retry-After", PUSH_RETRY_AFTER);
+		server.send(status, "application/json", F("{\"error\": \"busy\"}"));
+		return;
+	}
+	server.send(status, "application/json", (status == 200) ? F("{\"error\": false}") : F("{\"error\": \"invalid update\"}"));
+}
+
+// UDP is only started with WiFi and a push token
+void startPushUdp() {
+	if (isPushEnabled() && !pushUdpStarted) {
+		pushUdpStarted = pushUdp.begin(PUSH_UDP_PORT);
+		Serial.printf("Push: listening on UDP port %d: %d\n", PUSH_UDP_PORT, pushUdpStarted);
+	}
+}
+
+// Datagrams without a valid token are dropped silently
+void handlePushPackets() {
+	if (!pushUdpStarted) {
+		return;
+	}
+	char packet[PUSH_PACKET_LEN];
+	for (uint8_t i = 0; i < PUSH_MAX_PACKETS && pushUdp.parsePacket() > 0; i++) {
+		unsigned long receivedMicros = micros();
+		int len = pushUdp.read(packet, sizeof(packet) - 1);
+		if (len <= 0) {
+			continue;
+		}
+		packet[len] = '\0';
+
+		StaticJsonDocument<256> doc;
+		if (deserializeJson(doc, packet) || !isPushTokenValid(doc["token"] | "")) {
+			continue;
+		}
+		queuePush(doc, receivedMicros);
+	}
+}
@@ -0,0 +1,307 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * LAN presence relay
+ * Devices with relay mode enabled advertise RELAY_SERVICE via mDNS, with their id (MAC)
+ * and whether they are logged in. The logged-in device with the lowest id is the leader:
+ * it polls Graph and multicasts a compact frame after every poll, and repeats it as heartbeat
+ * until its next poll is due (plus RELAY_HEARTBEAT_MARGIN). Followers apply the frames and skip
+ * their own polls, until the leader is quiet for RELAY_TIMEOUT. Their token is still refreshed,
+ * so they can take over. All devices are expected to show the same account.
+ * Every leader counts its frames (seq), followers only take frames that are newer than the
+ * last one of that leader. After RELAY_TIMEOUT without frames any seq is taken (leader rebooted).
+ * Every frame is signed with the relay secret, all devices need the same one. Without it the relay
+ * does not start: unsigned frames could be sent by any host on the LAN, and the seq check only
+ * protects against replays if the seq cannot be forged.
+ *
+ * Frame: "TP", version, flags, leader id (6), seq (2), availability, activity, user count,
+ *        per user: id hash (4), availability, activity, then HMAC-SHA256 (8)
+ */
+#include "mbedtls/md.h"
+
+#define RELAY_SERVICE "teamspresence"
+#define RELAY_PORT 5006
+#define RELAY_GROUP IPAddress(239, 255, 84, 80)
+#define RELAY_VERSION 2				// 2: frames are always signed
+#define RELAY_FLAG_OWN 0x01				// Frame contains the own presence of the leader
+#define RELAY_HEADER_LEN 15
+#define RELAY_USER_LEN 6
+#define RELAY_MAC_LEN 8
+#define RELAY_MIN_SECRET_LEN 8			// Min. length of the relay secret
+#define RELAY_FRAME_LEN (RELAY_HEADER_LEN + MAX_PRESENCE_USERS * RELAY_USER_LEN + RELAY_MAC_LEN)
+#define RELAY_HEARTBEAT 10				// Leader repeats the last frame after (s)
+#define RELAY_HEARTBEAT_MARGIN 30		// ... until this long after its next poll was due (s)
+#define RELAY_TIMEOUT 60				// Followers poll themselves if no frame arrived for (s)
+#define RELAY_ELECTION_INTERVAL 120		// Query the peers again after (s)
+#define RELAY_MAX_PEERS 4				// Leaders whose last seq is kept
+
+struct RelayUpdate {
+	uint8_t flags;
+	uint8_t availabilityId;
+	uint8_t activityId;
+	uint8_t numUsers;
+	uint32_t userHashes[MAX_PRESENCE_USERS];
+	uint8_t userAvailabilityIds[MAX_PRESENCE_USERS];
+	uint8_t userActivityIds[MAX_PRESENCE_USERS];
+};
+
+struct RelayPeer {
+	uint64_t id;						// 0 if the slot is free
+	uint16_t seq;						// Last seq taken from this leader
+	unsigned long receivedMillis;
+};
+
+WiFiUDP relayUdp;
+boolean relayStarted = false;
+uint64_t relayId = 0;
+boolean relayLeader = false;				// Result of the last election
+uint64_t relayLeaderId = 0;					// Leader of the last accepted frame
+unsigned long lastRelayFrameMillis = 0;		// Last accepted frame that covered everything shown here
+
+uint8_t relayFrame[RELAY_FRAME_LEN];		// Last frame built by the leader, repeated as heartbeat
+size_t relayFrameLen = 0;
+unsigned long relayHeartbeatUntil = 0;		// Heartbeats are sent until (millis)
+unsigned long lastRelaySentMillis = 0;
+uint16_t relaySeq = 0;
+uint32_t relayFramesSent = 0;
+uint32_t relayFramesReceived = 0;
+uint32_t relayFramesRejected = 0;
+
+RelayPeer relayPeers[RELAY_MAX_PEERS];
+
+RelayUpdate pendingRelay;
+boolean relayPending = false;
+
+
+boolean isRelayEnabled() {
+	return atoi(paramRelayValue) == 1;
+}
+
+boolean isRelayFollowing() {
+	return isRelayEnabled() && !relayLeader && lastRelayFrameMillis > 0 && millis() - lastRelayFrameMillis < RELAY_TIMEOUT * 1000UL;
+}
+
+// FNV-1a of the lower case object id, identifies a user in frames
+uint32_t getRelayUserHash(const char* id) {
+	uint32_t hash = 2166136261UL;
+	for (; *id; id++) {
+		hash = (hash ^ (uint8_t)tolower(*id)) * 16777619UL;
+	}
+	return hash;
+}
+
+boolean hasRelaySecret() {
+	return strlen(paramRelaySecretValue) >= RELAY_MIN_SECRET_LEN;
+}
+
+// Truncated HMAC-SHA256 with the relay secret as key
+void signRelayFrame(const uint8_t* frame, size_t len, uint8_t* mac) {
+	uint8_t digest[32];
+	mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (const uint8_t*)paramRelaySecretValue, strlen(paramRelaySecretValue), frame, len, digest);
+	memcpy(mac, digest, RELAY_MAC_LEN);
+}
+
+void writeRelayId(uint8_t* buf, uint64_t id) {
+	for (uint8_t i = 0; i < 6; i++) {
+		buf[i] = (uint8_t)(id >> (8 * (5 - i)));
+	}
+}
+
+uint64_t readRelayId(const uint8_t* buf) {
+	uint64_t id = 0;
+	for (uint8_t i = 0; i < 6; i++) {
+		id = (id << 8) | buf[i];
+	}
+	return id;
+}
+
+// Advertise the service and join the multicast group, after WiFi connected
+void startRelay() {
+	if (!isRelayEnabled() || relayStarted) {
+		return;
+	}
+	if (!hasRelaySecret()) {
+		Serial.printf("Relay: not started, the relay secret needs at least %d characters\n", RELAY_MIN_SECRET_LEN);
+		return;
+	}
+	relayId = ESP.getEfuseMac() & 0xFFFFFFFFFFFFULL;
+	char id[16];
+	snprintf(id, sizeof(id), "%04x%08x", (uint32_t)(relayId >> 32), (uint32_t)relayId);
+	MDNS.addService(RELAY_SERVICE, "udp", RELAY_PORT);
+	MDNS.addServiceTxt(RELAY_SERVICE, "udp", "id", id);
+	MDNS.addServiceTxt(RELAY_SERVICE, "udp", "ready", "0");
+	relayStarted = relayUdp.beginMulticast(RELAY_GROUP, RELAY_PORT);
+	Serial.printf("Relay: id %s, multicast: %d\n", id, relayStarted);
+}
+
+// Network task: the logged-in peer with the lowest id leads, mDNS queries block for a while.
+// Returns true if this device leads, applied with the job result.
+boolean runRelayElection() {
+	boolean ready = (refresh_token[0] != '\0');
+	MDNS.addServiceTxt(RELAY_SERVICE, "udp", "ready", ready ? "1" : "0");
+
+	uint64_t leader = ready ? relayId : UINT64_MAX;
+	int peers = MDNS.queryService(RELAY_SERVICE, "udp");
+	for (int i = 0; i < peers; i++) {
+		if (MDNS.txt(i, "ready") != "1") {
+			continue;
+		}
+		uint64_t id = strtoull(MDNS.txt(i, "id").c_str(), NULL, 16);
+		if (id != 0 && id < leader) {
+			leader = id;
+		}
+	}
+	Serial.printf("Relay: %d peers, %s\n", max(peers, 0), (leader == relayId) ? "leader" : "follower");
+	return leader == relayId;
+}
+
+// Leader: build a frame from the current presence and send it
+void sendRelayFrame(boolean ownPresence) {
+	if (!relayStarted || !relayLeader) {
+		return;
+	}
+	uint8_t* f = relayFrame;
+	f[0] = 'T';
+	f[1] = 'P';
+	f[2] = RELAY_VERSION;
+	f[3] = ownPresence ? RELAY_FLAG_OWN : 0;
+	writeRelayId(f + 4, relayId);
+	f[12] = availabilityId;
+	f[13] = activityId;
+	f[14] = numPresenceUsers;
+	size_t len = RELAY_HEADER_LEN;
+	for (uint8_t i = 0; i < numPresenceUsers; i++) {
+		uint32_t hash = getRelayUserHash(presenceUsers[i].id);
+		memcpy(f + len, &hash, 4);
+		f[len + 4] = presenceUsers[i].availabilityId;
+		f[len + 5] = presenceUsers[i].activityId;
+		len += RELAY_USER_LEN;
+	}
+	relayFrameLen = len;
+	// Followers keep following until the next poll had time to finish
+	relayHeartbeatUntil = millis() + getTimerRemaining(TIMER_STATE) + RELAY_HEARTBEAT_MARGIN * 1000UL;
+	lastRelaySentMillis = 0;	// Sent by handleRelayPackets() right away
+}
+
+void sendRelayHeartbeat() {
+	relaySeq++;
+	relayFrame[10] = relaySeq >> 8;
+	relayFrame[11] = relaySeq & 0xFF;
+	signRelayFrame(relayFrame, relayFrameLen, relayFrame + relayFrameLen);
+	relayUdp.beginPacket(RELAY_GROUP, RELAY_PORT);
+	relayUdp.write(relayFrame, relayFrameLen + RELAY_MAC_LEN);
+	relayUdp.endPacket();
+	relayFramesSent++;
+	lastRelaySentMillis = millis();
+}
+
+// Replay protection: seq must be newer than the last one of the leader, in serial number
+// arithmetic. Unknown leaders take the slot that was used longest ago.
+boolean checkRelaySeq(uint64_t leader, uint16_t seq) {
+	RelayPeer* slot = &relayPeers[0];
+	for (RelayPeer& peer : relayPeers) {
+		if (peer.id == leader) {
+			if (millis() - peer.receivedMillis < RELAY_TIMEOUT * 1000UL && (int16_t)(seq - peer.seq) <= 0) {
+				return false;
+			}
+			slot = &peer;
+			break;
+		}
+		if (slot->id != 0 && (peer.id == 0 || millis() - peer.receivedMillis > millis() - slot->receivedMillis)) {
+			slot = &peer;
+		}
+	}
+	slot->id = leader;
+	slot->seq = seq;
+	slot->receivedMillis = millis();
+	return true;
+}
+
+// Check and decode a frame, the update is applied by the statemachine (EVENT_RELAY)
+boolean parseRelayFrame(const uint8_t* f, size_t len) {
+	if (len < RELAY_HEADER_LEN + RELAY_MAC_LEN || f[0] != 'T' || f[1] != 'P' || f[2] != RELAY_VERSION) {
+		return false;
+	}
+	size_t dataLen = RELAY_HEADER_LEN + f[14] * RELAY_USER_LEN;
+	if (f[14] > MAX_PRESENCE_USERS || len != dataLen + RELAY_MAC_LEN || f[12] >= PRESENCE_COUNT || f[13] >= PRESENCE_COUNT) {
+		return false;
+	}
+	uint8_t mac[RELAY_MAC_LEN];
+	signRelayFrame(f, dataLen, mac);
+	uint8_t diff = 0;
+	for (uint8_t i = 0; i < RELAY_MAC_LEN; i++) {
+		diff |= mac[i] ^ f[dataLen + i];
+	}
+	if (diff != 0) {
+		return false;
+	}
+
+	uint64_t leader = readRelayId(f + 4);
+	if (!checkRelaySeq(leader, (f[10] << 8) | f[11])) {
+		return false;
+	}
+
+	// Frames of a lower id win, a leader steps down for them
+	if ((relayLeader && leader > relayId) || (isRelayFollowing() && leader > relayLeaderId)) {
+		return true;
+	}
+	relayLeaderId = leader;
+	if (relayLeader && leader < relayId) {
+		Serial.printf("Relay: leader %04x%08x found, stepping down\n", (uint32_t)(leader >> 32), (uint32_t)leader);
+		relayLeader = false;
+	}
+
+	pendingRelay.flags = f[3];
+	pendingRelay.availabilityId = f[12];
+	pendingRelay.activityId = f[13];
+	pendingRelay.numUsers = f[14];
+	for (uint8_t i = 0; i < pendingRelay.numUsers; i++) {
+		const uint8_t* u = f + RELAY_HEADER_LEN + i * RELAY_USER_LEN;
+		memcpy(&pendingRelay.userHashes[i], u, 4);
+		pendingRelay.userAvailabilityIds[i] = (u[4] < PRESENCE_COUNT) ? u[4] : PRESENCE_NONE;
+		pendingRelay.userActivityIds[i] = (u[5] < PRESENCE_COUNT) ? u[5] : PRESENCE_NONE;
+	}
+	relayPending = true;
+	postEvent(EVENT_RELAY);
+	return true;
+}
+
+// Loop task: receive frames, the leader repeats its last frame as heartbeat until its next poll
+void handleRelayPackets() {
+	if (!relayStarted) {
+		return;
+	}
+	uint8_t packet[RELAY_FRAME_LEN];
+	int size;
+	while ((size = relayUdp.parsePacket()) > 0) {
+		int len = relayUdp.read(packet, sizeof(packet));
+		if (size > (int)sizeof(packet) || len != size) {
+			relayFramesRejected++;
+			continue;
+		}
+		// Own frames come back through multicast loopback
+		if (len >= RELAY_HEADER_LEN && readRelayId(packet + 4) == relayId) {
+			continue;
+		}
+		if (parseRelayFrame(packet, len)) {
+			relayFramesReceived++;
+		} else {
+			relayFramesRejected++;
+		}
+	}
+
+	if (relayLeader && relayFrameLen > 0 && (long)(relayHeartbeatUntil - millis()) > 0
+			&& (lastRelaySentMillis == 0 || millis() - lastRelaySentMillis > RELAY_HEARTBEAT * 1000UL)) {
+		sendRelayHeartbeat();
+	}
+}
@@ -13,88 +13,66 @@
 /**
  * API request handler
  */
-boolean requestJsonApi(JsonDocument& doc, String url, String payload = "", size_t capacity = 0, String type = "POST", boolean sendAuth = false) {
-	// WiFiClient
-	WiFiClientSecure *client = new WiFiClientSecure;
+boolean requestJsonApiLocked(JsonDocument& doc, const char* url, const char* payload, const char* type, boolean sendAuth, JsonDocument* filter, HttpResponseHeaders& headers) {
+	// Pooled HTTPS connection for the host
+	const char* path;
+	PooledConnection* conn = getPooledConnection(url, &path);
+	if (conn == NULL) {
+		Serial.printf("[HTTPS] No pooled connection for: %s\n", url);
+		return false;
+	}
 
-	#ifndef DISABLECERTCHECK
-	if (url.indexOf("graph.microsoft.com") > -1) {
-		client->setCACert(rootCACertificateGraph);
-	} else {
-		client->setCACert(rootCACertificateLogin);
+	// Send auth header?
+	const char* bearer = NULL;
+	if (sendAuth) {
+		bearer = access_token;
+		Serial.printf("[HTTPS] Auth token valid for %d s.\n", getTokenLifetime());
 	}
-	#endif
-
-	// HTTPClient
-	HTTPClient https;
-
-	// Prepare empty response
-	const int emptyCapacity = JSON_OBJECT_SIZE(1);
-	DynamicJsonDocument emptyDoc(emptyCapacity);
-
-	// DBG_PRINT("[HTTPS] begin...\n");
-    if (https.begin(*client, url)) {  // HTTPS
-		https.setConnectTimeout(10000);
-		https.setTimeout(10000);
-		https.useHTTP10(true);
-
-		// Send auth header?
-		if (sendAuth) {
-			String header = "Bearer " +  access_token;
-			https.addHeader("Authorization", header);
-			Serial.printf("[HTTPS] Auth token valid for %d s.\n", getTokenLifetime());
-		}
 
-		// Start connection and send HTTP header
-		int httpCode = 0;
-		if (type == "POST") {
-			httpCode = https.POST(payload);
+	// Send request and read response header
+	if (!poolRequest(conn, type, path, strcmp(type, "POST") == 0 ? payload : NULL, bearer, headers)) {
+		DBG_PRINTLN(F("[HTTPS] Request failed"));
+		return false;
+	}
+	Serial.printf("[HTTPS] Method: %s, Response code: %d\n", type, headers.status);
+
+	boolean success = false;
+	HttpBodyStream body(conn->client, headers);
+
+	// File found at server (HTTP 200, 301), or HTTP 400 / 401 with response payload
+	if (headers.status == HTTP_CODE_OK || headers.status == HTTP_CODE_MOVED_PERMANENTLY || headers.status == HTTP_CODE_BAD_REQUEST || headers.status == HTTP_CODE_UNAUTHORIZED) {
+		// Parse JSON data directly from the connection, optionally keep only the fields in filter
+		DeserializationError error = filter ? deserializeJson(doc, body, DeserializationOption::Filter(*filter)) : deserializeJson(doc, body);
+		if (error) {
+			DBG_PRINT(F("deserializeJson() failed: "));
+			DBG_PRINTLN(error.c_str());
 		} else {
-			httpCode = https.GET();
+			success = true;
 		}
-
-		// httpCode will be negative on error
-		if (httpCode > 0) {
-			// HTTP header has been send and Server response header has been handled
-			Serial.printf("[HTTPS] Method: %s, Response code: %d\n", type.c_str(), httpCode);
-
-			// Just for debugging purposes:
-			// if (url.indexOf("presence") > 0) {
-			// 	Serial.println(client->readString());
-			// }
-
-			// File found at server (HTTP 200, 301), or HTTP 400 with response payload
-			if (httpCode == HTTP_CODE_OK || httpCode == HTTP_CODE_MOVED_PERMANENTLY || httpCode == HTTP_CODE_BAD_REQUEST) {
-				// Parse JSON data
-				DeserializationError error = deserializeJson(doc, *client);
-				client->stop();
-				delete client;
-				client = NULL;
-				
-				if (error) {
-					DBG_PRINT(F("deserializeJson() failed: "));
-					DBG_PRINTLN(error.c_str());
-					https.end();
-					return false;
-				} else {
-					https.end();
-					return true;
-				}
-			} else {
-				Serial.printf("[HTTPS] Other HTTP code: %d\nResponse: ", httpCode);
-				DBG_PRINTLN(https.getString());
-				https.end();
-				return false;
-			}
-		} else {
-			Serial.printf("[HTTPS] Request failed: %s\n", https.errorToString(httpCode).c_str());
-			https.end();
-			return false;
+	} else {
+		Serial.printf("[HTTPS] Other HTTP code: %d\nResponse: ", headers.status);
+		int c;
+		for (int i = 0; i < 512 && (c = body.read()) >= 0; i++) {
+			Serial.write(c);
 		}
-    } else {
-    	DBG_PRINTLN(F("[HTTPS] Unable to connect"));
-		return false;
-    }
+		DBG_PRINTLN();
+	}
+
+	poolRelease(conn, body, headers);
+	return success;
+}
+
+// Requests come from the network task and from web handlers, the pool is used by one of them at a time
+// Status and Retry-After of the response are returned in responseHeaders, if given
+boolean requestJsonApi(JsonDocument& doc, const char* url, const char* payload = NULL, size_t capacity = 0, const char* type = "POST", boolean sendAuth = false, JsonDocument* filter = NULL, HttpResponseHeaders* responseHeaders = NULL) {
+	HttpResponseHeaders headers = { 0, -1, false, false, 0 };
+	xSemaphoreTake(netMutex, portMAX_DELAY);
+	boolean success = requestJsonApiLocked(doc, url, payload, type, sendAuth, filter, headers);
+	xSemaphoreGive(netMutex);
+	if (responseHeaders) {
+		*responseHeaders = headers;
+	}
+	return success;
 }
 
 
@@ -102,115 +80,18 @@ boolean requestJsonApi(JsonDocument& doc, String url, String payload = "", size_
  * Handle web requests 
  */
 
-// Requests to /
-void handleRoot() {
-	DBG_PRINTLN("handleRoot()");
-	// -- Let IotWebConf test and handle captive portal requests.
-	if (iotWebConf.handleCaptivePortal()) { return; }
-
-	String s = "<!DOCTYPE html>\n<html lang=\"en\">\n<head><meta name=\"viewport\" content=\"width=device-width, initial-scale=1, user-scalable=no\"/>";
-	s += "<link href=\"https://fonts.googleapis.com/css?family=Press+Start+2P\" rel=\"stylesheet\">";
-	s += "<link href=\"https://unpkg.com/nes.css@2.3.0/css/nes.min.css\" rel=\"stylesheet\" />";
-	s += "<style type=\"text/css\">\n";
-	s += "  body {padding:3.5rem}\n";
-	s += "  .ml-s {margin-left:1.0rem}\n";
-	s += "  .mt-s {margin-top:1.0rem}\n";
-	s += "  .mt {margin-top:3.5rem}\n";
-	s += "  #dialog-devicelogin {max-width:800px}\n";
-	s += "</style>\n";
-	s += "<script>\n";
-	s += "function closeDeviceLoginModal() {\n";
-	s += "  document.getElementById('dialog-devicelogin').close();\n";
-	s += "}\n";
-	s += "function performClearSettings() {\n";
-	s += "  fetch('/api/clearSettings').then(r => r.json()).then(data => {\n";
-	s += "    console.log('clearSettings', data);\n";
-	s += "    document.getElementById('dialog-clearsettings').close();\n";
-	s += "    document.getElementById('dialog-clearsettings-result').showModal();\n";
-	s += "  });\n";
-	s += "}\n";
-	s += "function openDeviceLoginModal() {\n";
-	s += "  fetch('/api/startDevicelogin').then(r => r.json()).then(data => {\n";
-	s += "    console.log('startDevicelogin', data);\n";
-	s += "    if (data && data.user_code) {\n";
-	s += "      document.getElementById('btn_open').href = data.verification_uri;\n";
-	s += "      document.getElementById('lbl_message').innerText = data.message;\n";
-	s += "      document.getElementById('code_field').value = data.user_code;\n";
-	s += "    }\n";
-	s += "    document.getElementById('dialog-devicelogin').showModal();\n";
-	s += "  });\n";
-	s += "}\n";
-	s += "</script>\n";
-	s += "<title>ESP32 teams presence</title></head>\n";
-	s += "<body><h2>ESP32 teams presence - v" + String(VERSION) + "</h2>";
-
-	s += "<section class=\"mt\"><div class=\"nes-balloon from-left\">";
-	if (strlen(paramTenantValue) == 0 || strlen(paramClientIdValue) == 0) {
-		s += "<p class=\"note nes-text is-error\">Some settings are missing. Go to <a href=\"config\">configuration page</a> to complete setup.</p></div>";
-	} else {
-		if (access_token == "") {
-			s += "<p class=\"note nes-text is-error\">No authentication infos found, start device login flow to complete widget setup!</p></div>";
-		} else {
-			s += "<p class=\"note nes-text\">Device setup complete, but you can start the device login flow if you need to re-authenticate.</p></div>";
-		}
-		s += "<div><button type=\"button\" class=\"nes-btn\" onclick=\"openDeviceLoginModal()\">Start device login</button></div>";
-	}
-	s += "<dialog class=\"nes-dialog is-rounded\" id=\"dialog-devicelogin\">\n";
-	s += "<p class=\"title\">Start device login</p>\n";
-	s += "<p id=\"lbl_message\"></p>\n";
-	s += "<input type=\"text\" id=\"code_field\" class=\"nes-input\" disabled>\n";
-	s += "<menu class=\"dialog-menu\">\n";
-	s += "<button id=\"btn_close\" class=\"nes-btn\" onclick=\"closeDeviceLoginModal()\">Close</button>\n";
-	s += "<a class=\"nes-btn is-primary ml-s\" id=\"btn_open\" href=\"https://microsoft.com/devicelogin\" target=\"_blank\">Open device login</a>\n";
-	s += "</menu>\n";
-	s += "</dialog>\n";
-	s += "</section>\n";
-
-	s += "<div class=\"nes-balloon from-left mt\">";
-	s += "Go to <a href=\"config\">configuration page</a> to change settings.";
-	s += "</div>";
-	s += "<section class=\"nes-container with-title\"><h3 class=\"title\">Current settings</h3>";
-	s += "<div class=\"nes-field mt-s\"><label for=\"name_field\">Client-ID</label><input type=\"text\" id=\"name_field\" class=\"nes-input\" disabled value=\"" + String(paramClientIdValue) +  "\"></div>";
-	s += "<div class=\"nes-field mt-s\"><label for=\"name_field\">Tenant hostname / ID</label><input type=\"text\" id=\"name_field\" class=\"nes-input\" disabled value=\"" + String(paramTenantValue) +  "\"></div>";
-	s += "<div class=\"nes-field mt-s\"><label for=\"name_field\">Polling interval (sec)</label><input type=\"text\" id=\"name_field\" class=\"nes-input\" disabled value=\"" + String(paramPollIntervalValue) +  "\"></div>";
-	s += "<div class=\"nes-field mt-s\"><label for=\"name_field\">Number of LEDs</label><input type=\"text\" id=\"name_field\" class=\"nes-input\" disabled value=\"" + String(paramNumLedsValue) +  "\"></div>";
-	s += "</section>";
-
-	s += "<section class=\"nes-container with-title mt\"><h3 class=\"title\">Memory usage</h3>";
-	s += "<div>Sketch: " + String(ESP.getFreeSketchSpace() - ESP.getSketchSize()) + " of " + String(ESP.getFreeSketchSpace()) + " bytes free</div>";
-	s += "<progress class=\"nes-progress\" value=\"" + String(ESP.getSketchSize()) + "\" max=\"" + String(ESP.getFreeSketchSpace()) + "\"></progress>";
-	s += "<div class=\"mt-s\">RAM: " + String(ESP.getFreeHeap()) + " of 327680 bytes free</div>";
-	s += "<progress class=\"nes-progress\" value=\"" + String(327680 - ESP.getFreeHeap()) + "\" max=\"327680\"></progress>";
-	s += "</section>";
-
-	s += "<section class=\"nes-container with-title mt\"><h3 class=\"title\">Danger area</h3>";
-	s += "<dialog class=\"nes-dialog is-rounded\" id=\"dialog-clearsettings\">\n";
-	s += "<p class=\"title\">Really clear all settings?</p>\n";
-	s += "<button class=\"nes-btn\" onclick=\"document.getElementById('dialog-clearsettings').close()\">Close</button>\n";
-	s += "<button class=\"nes-btn is-error\" onclick=\"performClearSettings()\">Clear all settings</button>\n";
-	s += "</dialog>\n";
-	s += "<dialog class=\"nes-dialog is-rounded\" id=\"dialog-clearsettings-result\">\n";
-	s += "<p class=\"title\">All settings were cleared.</p>\n";
-	s += "</dialog>\n";
-	s += "<div><button type=\"button\" class=\"nes-btn is-error\" onclick=\"document.getElementById('dialog-clearsettings').showModal();\">Clear all settings</button></div>";
-	s += "</section>";
-
-	s += "<div class=\"mt\"><i class=\"nes-icon github\"></i> Find the <a href=\"https://github.com/toblum/ESPTeamsPresence\" target=\"_blank\">ESPTeamsPresence</a> project on GitHub.</i></div>";
-
-	s += "</body>\n</html>\n";
-
-	server.send(200, "text/html", s);
-}
-
 void handleGetSettings() {
 	DBG_PRINTLN("handleGetSettings()");
 	
-	const int capacity = JSON_OBJECT_SIZE(13);
+	const int capacity = JSON_OBJECT_SIZE(47) + JSON_OBJECT_SIZE(8) + JSON_OBJECT_SIZE(POWER_SRC_COUNT + 1) + 8 * 32;
 	StaticJsonDocument<capacity> responseDoc;
 	responseDoc["client_id"].set(paramClientIdValue);
 	responseDoc["tenant"].set(paramTenantValue);
 	responseDoc["poll_interval"].set(paramPollIntervalValue);
 	responseDoc["num_leds"].set(paramNumLedsValue);
+	responseDoc["power_save"].set(powerSave);
+	responseDoc["light_sleep"].set(isLightSleepActive());
+	responseDoc["light_sleep_supported"].set(POWER_LIGHT_SLEEP == 1);
 
 	responseDoc["heap"].set(ESP.getFreeHeap());
 	responseDoc["min_heap"].set(ESP.getMinFreeHeap());
@@ -223,6 +104,71 @@ void handleGetSettings() {
 
     responseDoc["sketch_version"].set(VERSION);
 
+	responseDoc["tls_full_handshakes"].set(getFullHandshakes());
+	responseDoc["tls_resumed_handshakes"].set(getResumedHandshakes());
+	responseDoc["tls_last_handshake_ms"].set(connectionPool[POOL_HOST_GRAPH].handshakeMillis);
+	responseDoc["tls_session_persistence"].set(TLS_SESSION_PERSISTENCE == 1);
+
+	responseDoc["next_poll_in_s"].set(getNextPollSeconds());
+	responseDoc["next_poll_reason"].set(pollReasonNames[pollReason]);
+	responseDoc["poll_backoff_s"].set(pollBackoff);
+	responseDoc["push_enabled"].set(isPushEnabled());
+	responseDoc["push_active"].set(isPushActive());
+	responseDoc["push_count"].set(pushCount);
+	responseDoc["push_led_latency_ms"].set(pushLedLatencyMicros / 1000.0);
+	responseDoc["push_network_latency_ms"].set(pushNetworkLatencyMillis);
+	responseDoc["relay_enabled"].set(isRelayEnabled());
+	responseDoc["relay_started"].set(relayStarted);
+	responseDoc["relay_leader"].set(relayLeader);
+	responseDoc["relay_following"].set(isRelayFollowing());
+	responseDoc["relay_frames_sent"].set(relayFramesSent);
+	responseDoc["relay_frames_received"].set(relayFramesReceived);
+	responseDoc["calendar_events"].set(calendarValid ? numCalendarEvents : -1);
+	if (calendarValid) {
+		time_t nextCalendarPoll = getNextCalendarPoll(time(NULL));
+		responseDoc["calendar_next_poll_in_s"].set(nextCalendarPoll > 0 ? (long)(nextCalendarPoll - time(NULL)) : -1);
+	}
+
+	responseDoc["boot_first_color_ms"].set(bootFirstColorMillis);
+	responseDoc["boot_first_live_color_ms"].set(bootFirstLiveColorMillis);
+
+	responseDoc["socket_wakeups"].set(socketWakeups);
+	responseDoc["led_frames_sent"].set(framesSent);
+	responseDoc["led_frames_skipped"].set(framesSkipped);
+
+	// Wakeups of the neopixel task per second since the last call
+	static unsigned long lastStatsMillis = 0;
+	static uint32_t lastStatsWakeups = 0;
+	unsigned long now = millis();
+	if (now > lastStatsMillis) {
+		responseDoc["led_wakeups_per_sec"].set((float)(ledWakeups - lastStatsWakeups) * 1000 / (now - lastStatsMillis));
+	}
+	// Share of time the tasks were busy since the last call (%), total can exceed 100 with two cores
+	static uint32_t lastBusyMicros[POWER_SRC_COUNT];
+	JsonObject duty = responseDoc.createNestedObject("duty_cycle");
+	float dutyTotal = 0;
+	for (uint8_t i = 0; i < POWER_SRC_COUNT; i++) {
+		uint32_t busy = powerBusyMicros[i];
+		if (now > lastStatsMillis) {
+			float share = (float)(busy - lastBusyMicros[i]) / 10 / (now - lastStatsMillis);
+			duty[powerSourceNames[i]] = share;
+			dutyTotal += share;
+		}
+		lastBusyMicros[i] = busy;
+	}
+	duty["total"] = dutyTotal;
+
+	lastStatsMillis = now;
+	lastStatsWakeups = ledWakeups;
+
+	// Effective frame rate per mode that was active
+	JsonObject fps = responseDoc.createNestedObject("led_fps");
+	for (uint8_t mode = 0; mode < LED_STATS_MODES && mode < ws2812fx.getModeCount(); mode++) {
+		if (ledFpsByMode[mode] > 0) {
+			fps[ws2812fx.getModeName(mode)] = ledFpsByMode[mode];
+		}
+	}
+
 	server.send(200, "application/json", responseDoc.as<String>());
 }
 
@@ -279,43 +225,55 @@ boolean formValidator() {
 // Config was saved
 void onConfigSaved() {
 	DBG_PRINTLN(F("Configuration was updated."));
-	ws2812fx.setLength(atoi(paramNumLedsValue));
+	numberLeds = atoi(paramNumLedsValue);
+	queueLength(numberLeds);
+	// Ranges are checked against the number of LEDs
+	boolean showingPresence = (stripLayout == LAYOUT_PRESENCE);
+	loadSegments();
+	applyPowerMode(atoi(paramPowerSaveValue) == 1);
+	// Rebuild the strip right away, not only with the next presence change
+	if (showingPresence) {
+		setPresenceAnimation();
+	}
+}
+
+boolean isDeviceLoginPending() {
+	return deviceLoginStatus == DEVICELOGIN_QUEUED || deviceLoginStatus == DEVICELOGIN_RUNNING;
 }
 
-// Requests to /startDevicelogin
+// Requests to /startDevicelogin, the device code is requested by the network task.
+// The web UI polls /api/devicelogin for it.
 void handleStartDevicelogin() {
 	// Only if not already started
-	if (state != SMODEDEVICELOGINSTARTED) {
-		DBG_PRINTLN(F("handleStartDevicelogin()"));
-
-		// Request devicelogin context
-		const size_t capacity = JSON_OBJECT_SIZE(6) + 540;
-		DynamicJsonDocument doc(capacity);
-		boolean res = requestJsonApi(doc, "https://login.microsoftonline.com/" + String(paramTenantValue) + "/oauth2/v2.0/devicecode", "client_id=" + String(paramClientIdValue) + "&scope=offline_access%20openid%20Presence.Read", capacity);
-
-		if (res && doc.containsKey("device_code") && doc.containsKey("user_code") && doc.containsKey("interval") && doc.containsKey("verification_uri") && doc.containsKey("message")) {
-			// Save device_code, user_code and interval
-			device_code = doc["device_code"].as<String>();
-			user_code = doc["user_code"].as<String>();
-			interval = doc["interval"].as<unsigned int>();
-
-			// Prepare response JSON
-			const size_t responseCapacity = JSON_OBJECT_SIZE(3);
-			DynamicJsonDocument responseDoc(responseCapacity);
-			responseDoc["user_code"] = doc["user_code"].as<const char*>();
-			responseDoc["verification_uri"] = doc["verification_uri"].as<const char*>();
-			responseDoc["message"] = doc["message"].as<const char*>();
-
-			// Set state, update polling timestamp
-			state = SMODEDEVICELOGINSTARTED;
-			tsPolling = millis() + (interval * 1000);
-
-			// Send JSON response
-			server.send(200, "application/json", responseDoc.as<String>());
-		} else {
-			server.send(500, "application/json", F("{\"error\": \"devicelogin_unknown_response\"}"));
-		}
-	} else {
+	if (state == SMODEDEVICELOGINSTARTED || isDeviceLoginPending()) {
 		server.send(409, "application/json", F("{\"error\": \"devicelogin_already_running\"}"));
+		return;
+	}
+	DBG_PRINTLN(F("handleStartDevicelogin()"));
+	deviceLoginStatus = DEVICELOGIN_QUEUED;
+	if (!postEvent(EVENT_DEVICELOGIN)) {
+		deviceLoginStatus = DEVICELOGIN_IDLE;
+		server.send(503, "application/json", F("{\"error\": \"busy\"}"));
+		return;
+	}
+	server.send(202, "application/json", F("{\"status\": \"pending\"}"));
+}
+
+// Requests to /api/devicelogin: state of the device login, with the code once it is there
+void handleGetDeviceLogin() {
+	if (isDeviceLoginPending()) {
+		server.send(200, "application/json", F("{\"status\": \"pending\"}"));
+	} else if (state == SMODEDEVICELOGINSTARTED) {
+		const size_t capacity = JSON_OBJECT_SIZE(4);
+		StaticJsonDocument<capacity> responseDoc;
+		responseDoc["status"] = "started";
+		responseDoc["user_code"] = (const char*)user_code;
+		responseDoc["verification_uri"] = (const char*)verification_uri;
+		responseDoc["message"] = (const char*)deviceLoginMessage;
+		server.send(200, "application/json", responseDoc.as<String>());
+	} else if (deviceLoginStatus == DEVICELOGIN_FAILED) {
+		server.send(500, "application/json", F("{\"status\": \"failed\", \"error\": \"devicelogin_unknown_response\"}"));
+	} else {
+		server.send(200, "application/json", F("{\"status\": \"idle\"}"));
 	}
 }
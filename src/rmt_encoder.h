@@ -0,0 +1,91 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * WS2812 encoder of the RMT driver (ESP32_RMT_Driver.h)
+ * Translates pixel bytes into raw RMT items. Has no IDF dependencies, so the native
+ * tests (test/test_rmt_encoder) can compare it with the per-bit encoder.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#else
+#define IRAM_ATTR
+#define DRAM_ATTR
+#endif
+
+#define APB_CLK_MHZ 80 // default RMT CLK source (80MHz)
+#define RMT_CLK_DIV  2 // RMT CLK divider
+#define RMT_TICK (RMT_CLK_DIV * 1000 / APB_CLK_MHZ) // 25ns
+
+// timing parameters for WS2812B LEDs. you may need to
+// tweek these if you're using a different kind of LED
+#define T1_TICKS      250 / RMT_TICK // 250ns
+#define T2_TICKS      625 / RMT_TICK // 625ns
+#define T3_TICKS      375 / RMT_TICK // 375ns
+#define RESET_TICKS 50000 / RMT_TICK // 50us
+
+// raw values of the RMT items, layout: duration0:15, level0:1, duration1:15, level1:1
+#define RMT_ITEM_VAL(d0, l0, d1, l1) ((uint32_t)(d0) | ((uint32_t)(l0) << 15) | ((uint32_t)(d1) << 16) | ((uint32_t)(l1) << 31))
+#define RMT_BIT0  RMT_ITEM_VAL(T1_TICKS, 1, T2_TICKS + T3_TICKS, 0)     // Logical 0
+#define RMT_BIT1  RMT_ITEM_VAL(T1_TICKS + T2_TICKS, 1, T3_TICKS, 0)     // Logical 1
+#define RMT_RESET RMT_ITEM_VAL(RESET_TICKS/2, 0, RESET_TICKS/2, 0)      // Reset
+#define RMT_BIT(n, mask) (((n) & (mask)) ? RMT_BIT1 : RMT_BIT0)
+#define RMT_NIBBLE(n) { RMT_BIT(n, 8), RMT_BIT(n, 4), RMT_BIT(n, 2), RMT_BIT(n, 1) }
+
+/*
+ * RMT items for every nibble, MSB first. Lives in DRAM so the ISR can use it
+ * while the flash cache is disabled.
+ */
+static const DRAM_ATTR uint32_t rmt_nibble_items[16][4] = {
+    RMT_NIBBLE(0),  RMT_NIBBLE(1),  RMT_NIBBLE(2),  RMT_NIBBLE(3),
+    RMT_NIBBLE(4),  RMT_NIBBLE(5),  RMT_NIBBLE(6),  RMT_NIBBLE(7),
+    RMT_NIBBLE(8),  RMT_NIBBLE(9),  RMT_NIBBLE(10), RMT_NIBBLE(11),
+    RMT_NIBBLE(12), RMT_NIBBLE(13), RMT_NIBBLE(14), RMT_NIBBLE(15)
+};
+
+/*
+ * Translate up to src_size bytes into at most wanted_num items, the last byte becomes the reset pulse.
+ * Every byte is translated with two table lookups of four items each.
+ */
+static inline void IRAM_ATTR rmt_encode_bytes(const uint8_t* psrc, uint32_t* pdest, size_t src_size,
+                         size_t wanted_num, size_t* translated_size, size_t* item_num) {
+    size_t size = 0;
+    size_t num = 0;
+    while (size < src_size && num < wanted_num) {
+      if(size < src_size - 1) { // have more pixel data, so translate into RMT items
+        const uint32_t *hi = rmt_nibble_items[*psrc >> 4];
+        const uint32_t *lo = rmt_nibble_items[*psrc & 0x0F];
+        pdest[0] = hi[0];
+        pdest[1] = hi[1];
+        pdest[2] = hi[2];
+        pdest[3] = hi[3];
+        pdest[4] = lo[0];
+        pdest[5] = lo[1];
+        pdest[6] = lo[2];
+        pdest[7] = lo[3];
+        pdest += 8;
+        num += 8;
+      } else { // no more pixel data, last RMT item is the reset pulse
+        *(pdest++) = RMT_RESET;
+        num++;
+      }
+      size++;
+      psrc++;
+    }
+    *translated_size = size;
+    *item_num = num;
+}
@@ -0,0 +1,126 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * Status page
+ * Static parts of the page at /, stored in flash. handleRoot() sends them in order
+ * and fills in the dynamic fields in between. Styles and scripts are served from
+ * SPIFFS (data/, generated from web/ by scripts/build_web.py).
+ */
+const char ROOT_HEAD[] PROGMEM = R"=====(<!DOCTYPE html>
+<html lang="en">
+<head><meta name="viewport" content="width=device-width, initial-scale=1, user-scalable=no"/><link href=")=====" WEB_ASSET_CSS R"=====(" rel="stylesheet"><script src=")=====" WEB_ASSET_JS R"=====("></script>
+<title>ESP32 teams presence</title></head>
+<body><h2>ESP32 teams presence - v)=====";
+
+const char ROOT_SETUP_START[] PROGMEM = R"=====(</h2><section class="mt"><div class="nes-balloon from-left">)=====";
+
+const char ROOT_SETUP_MISSING[] PROGMEM = R"=====(<p class="note nes-text is-error">Some settings are missing. Go to <a href="config">configuration page</a> to complete setup.</p></div>)=====";
+
+const char ROOT_SETUP_NOAUTH[] PROGMEM = R"=====(<p class="note nes-text is-error">No authentication infos found, start device login flow to complete widget setup!</p></div>)=====";
+
+const char ROOT_SETUP_DONE[] PROGMEM = R"=====(<p class="note nes-text">Device setup complete, but you can start the device login flow if you need to re-authenticate.</p></div>)=====";
+
+const char ROOT_LOGIN_BUTTON[] PROGMEM = R"=====(<div><button type="button" class="nes-btn" onclick="openDeviceLoginModal()">Start device login</button></div>)=====";
+
+const char ROOT_SETTINGS_START[] PROGMEM = R"=====(<dialog class="nes-dialog is-rounded" id="dialog-devicelogin">
+<p class="title">Start device login</p>
+<p id="lbl_message"></p>
+<input type="text" id="code_field" class="nes-input" disabled>
+<menu class="dialog-menu">
+<button id="btn_close" class="nes-btn" onclick="closeDeviceLoginModal()">Close</button>
+<a class="nes-btn is-primary ml-s" id="btn_open" href="https://microsoft.com/devicelogin" target="_blank">Open device login</a>
+</menu>
+</dialog>
+</section>
+<div class="nes-balloon from-left mt">Go to <a href="config">configuration page</a> to change settings.</div><section class="nes-container with-title"><h3 class="title">Current settings</h3>)=====";
+
+// Label, value
+const char ROOT_SETTING_FIELD[] PROGMEM = R"=====(<div class="nes-field mt-s"><label for="name_field">%s</label><input type="text" id="name_field" class="nes-input" disabled value="%s"></div>)=====";
+
+// Free sketch space, sketch space, sketch size, sketch space, free heap, used heap
+const char ROOT_MEMORY[] PROGMEM = R"=====(</section><section class="nes-container with-title mt"><h3 class="title">Memory usage</h3><div>Sketch: %u of %u bytes free</div><progress class="nes-progress" value="%u" max="%u"></progress><div class="mt-s">RAM: %u of 327680 bytes free</div><progress class="nes-progress" value="%u" max="327680"></progress></section>)=====";
+
+const char ROOT_FOOTER[] PROGMEM = R"=====(<section class="nes-container with-title mt"><h3 class="title">Danger area</h3><dialog class="nes-dialog is-rounded" id="dialog-clearsettings">
+<p class="title">Really clear all settings?</p>
+<button class="nes-btn" onclick="document.getElementById('dialog-clearsettings').close()">Close</button>
+<button class="nes-btn is-error" onclick="performClearSettings()">Clear all settings</button>
+</dialog>
+<dialog class="nes-dialog is-rounded" id="dialog-clearsettings-result">
+<p class="title">All settings were cleared.</p>
+</dialog>
+<div><button type="button" class="nes-btn is-error" onclick="document.getElementById('dialog-clearsettings').showModal();">Clear all settings</button></div></section><div class="mt"><i class="nes-icon github"></i> Find the <a href="https://github.com/toblum/ESPTeamsPresence" target="_blank">ESPTeamsPresence</a> project on GitHub.</i></div></body>
+</html>
+)=====";
+
+
+// Requests to /
+#define ROOT_FIELD_LEN 512		// Largest filled template (one settings field or the memory section)
+
+uint32_t rootMinHeap;	// Lowest free heap after any chunk of the page was sent
+
+// Send one static template
+void sendRootText(const char* text) {
+	server.sendContent_P(text);
+	rootMinHeap = min(rootMinHeap, ESP.getFreeHeap());
+}
+
+// Send one template with its fields filled in
+void sendRootFields(const char* fmt, ...) {
+	char buf[ROOT_FIELD_LEN];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf_P(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	server.sendContent(buf);
+	rootMinHeap = min(rootMinHeap, ESP.getFreeHeap());
+}
+
+void handleRoot() {
+	DBG_PRINTLN("handleRoot()");
+	// -- Let IotWebConf test and handle captive portal requests.
+	if (iotWebConf.handleCaptivePortal()) { return; }
+
+	// Stream the page in chunks, only the dynamic fields are formatted in RAM
+	uint32_t startHeap = ESP.getFreeHeap();
+	rootMinHeap = startHeap;
+	server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+	server.send(200, "text/html", "");
+
+	sendRootText(ROOT_HEAD);
+	server.sendContent(VERSION);
+	sendRootText(ROOT_SETUP_START);
+	if (strlen(paramTenantValue) == 0 || strlen(paramClientIdValue) == 0) {
+		sendRootText(ROOT_SETUP_MISSING);
+	} else {
+		sendRootText(access_token[0] == '\0' ? ROOT_SETUP_NOAUTH : ROOT_SETUP_DONE);
+		sendRootText(ROOT_LOGIN_BUTTON);
+	}
+
+	sendRootText(ROOT_SETTINGS_START);
+	sendRootFields(ROOT_SETTING_FIELD, "Client-ID", paramClientIdValue);
+	sendRootFields(ROOT_SETTING_FIELD, "Tenant hostname / ID", paramTenantValue);
+	sendRootFields(ROOT_SETTING_FIELD, "Polling interval (sec)", paramPollIntervalValue);
+	sendRootFields(ROOT_SETTING_FIELD, "Number of LEDs", paramNumLedsValue);
+	sendRootFields(ROOT_SETTING_FIELD, "Power saving", powerSave ? "on" : "off");
+
+	uint32_t sketchSpace = ESP.getFreeSketchSpace();
+	uint32_t sketchSize = ESP.getSketchSize();
+	uint32_t freeHeap = ESP.getFreeHeap();
+	sendRootFields(ROOT_MEMORY, sketchSpace - sketchSize, sketchSpace, sketchSize, sketchSpace, freeHeap, 327680 - freeHeap);
+
+	sendRootText(ROOT_FOOTER);
+	server.sendContent("");
+
+	// Free heap is sampled after every chunk, allocations inside a single sendContent() call are not seen
+	Serial.printf("handleRoot() - Free heap before: %u, lowest between chunks: %u, after: %u bytes\n", startHeap, rootMinHeap, ESP.getFreeHeap());
+}
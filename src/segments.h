@@ -0,0 +1,164 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * LED segments
+ * The strip can be split into segments that show different presence sources side by side.
+ * Configuration in SPIFFS, e.g.:
+ *   [{"start": 0, "stop": 7, "source": "activity"}, {"start": 8, "stop": 15, "reverse": true, "source": "availability"}]
+ * Segments of other users name the user by object id:
+ *   {"start": 0, "stop": 3, "source": "user_activity", "user": "<object id>"}
+ * Segments must be in order and must not overlap, so every LED is rendered at most once per frame.
+ * Without a (valid) file the whole strip shows the activity.
+ */
+#define SEGMENTS_FILE "/segments.json"
+#define MAX_SEGMENTS 8						// WS2812FX supports 8 active segments by default
+#define SEGMENT_SOURCE_ACTIVITY 0
+#define SEGMENT_SOURCE_AVAILABILITY 1
+#define SEGMENT_SOURCE_USER_ACTIVITY 2		// Presence of another user, see user_presence.h
+#define SEGMENT_SOURCE_USER_AVAILABILITY 3
+#define SEGMENT_SOURCE_COUNT 4
+
+#define LAYOUT_STATUS 0						// One segment over the whole strip, shows device status
+#define LAYOUT_PRESENCE 1					// Configured segments, show presence
+#define LAYOUT_CHANGED 2					// Segment configuration changed, strip has to be rebuilt
+
+struct SegmentConfig {
+	uint16_t start;
+	uint16_t stop;
+	bool reverse;
+	uint8_t source;
+	uint8_t user;							// Index in presenceUsers for user sources
+};
+
+const char* const segmentSourceNames[SEGMENT_SOURCE_COUNT] = { "activity", "availability", "user_activity", "user_availability" };
+
+SegmentConfig segments[MAX_SEGMENTS];
+uint8_t numSegments = 0;
+uint8_t stripLayout = LAYOUT_STATUS;
+
+
+// Last LED of the strip, the configured length is not known before iotWebConf is initialized
+uint16_t getLastLed() {
+	return (numberLeds > 0 ? numberLeds : NUMLEDS) - 1;
+}
+
+uint8_t getSegmentSource(const char* name) {
+	for (uint8_t i = 0; i < SEGMENT_SOURCE_COUNT; i++) {
+		if (strcmp(name, segmentSourceNames[i]) == 0) {
+			return i;
+		}
+	}
+	return SEGMENT_SOURCE_ACTIVITY;
+}
+
+// Presence id shown by a segment, without segments the whole strip shows the activity
+uint8_t getSegmentPresenceId(uint8_t i) {
+	if (i >= numSegments) {
+		return activityId;
+	}
+	const SegmentConfig& seg = segments[i];
+	switch (seg.source) {
+		case SEGMENT_SOURCE_AVAILABILITY:
+			return availabilityId;
+		case SEGMENT_SOURCE_USER_ACTIVITY:
+			return presenceUsers[seg.user].activityId;
+		case SEGMENT_SOURCE_USER_AVAILABILITY:
+			return presenceUsers[seg.user].availabilityId;
+	}
+	return activityId;
+}
+
+// The own presence (me/presence) is only polled if a segment shows it
+boolean needsOwnPresence() {
+	for (uint8_t i = 0; i < numSegments; i++) {
+		if (segments[i].source < SEGMENT_SOURCE_USER_ACTIVITY) {
+			return true;
+		}
+	}
+	return numSegments == 0;
+}
+
+// Load the segment configuration, falls back to one segment over the whole strip
+boolean loadSegments() {
+	numSegments = 0;
+	clearPresenceUsers();
+	stripLayout = LAYOUT_CHANGED;
+	if (!SPIFFS.exists(SEGMENTS_FILE)) {
+		DBG_PRINTLN(F("loadSegments() - No file found, using whole strip"));
+		return false;
+	}
+
+	File file = SPIFFS.open(SEGMENTS_FILE);
+	const size_t capacity = JSON_ARRAY_SIZE(MAX_SEGMENTS) + MAX_SEGMENTS * JSON_OBJECT_SIZE(5) + MAX_SEGMENTS * (24 + USER_ID_LEN);
+	StaticJsonDocument<capacity> doc;
+	DeserializationError err = deserializeJson(doc, file);
+	file.close();
+	if (err) {
+		DBG_PRINT(F("loadSegments() - deserializeJson() failed with code: "));
+		DBG_PRINTLN(err.c_str());
+		return false;
+	}
+
+	uint16_t nextFree = 0;
+	for (JsonObject seg : doc.as<JsonArray>()) {
+		if (numSegments >= MAX_SEGMENTS) {
+			Serial.printf("loadSegments() - Only %d segments supported, ignoring the rest.\n", MAX_SEGMENTS);
+			break;
+		}
+		uint16_t start = seg["start"] | nextFree;
+		uint16_t stop = seg["stop"] | getLastLed();
+		if (start < nextFree || start > stop || stop > getLastLed()) {
+			Serial.printf("loadSegments() - Invalid range %d-%d, ignored.\n", start, stop);
+			continue;
+		}
+		uint8_t source = getSegmentSource(seg["source"] | "");
+		int8_t user = 0;
+		if (source >= SEGMENT_SOURCE_USER_ACTIVITY) {
+			user = addPresenceUser(seg["user"] | "");
+			if (user < 0) {
+				Serial.printf("loadSegments() - Invalid user for segment %d-%d, ignored.\n", start, stop);
+				continue;
+			}
+		}
+		segments[numSegments].start = start;
+		segments[numSegments].stop = stop;
+		segments[numSegments].reverse = seg["reverse"] | false;
+		segments[numSegments].source = source;
+		segments[numSegments].user = user;
+		numSegments++;
+		nextFree = stop + 1;
+	}
+
+	Serial.printf("loadSegments() - %d segments, %d other users loaded.\n", numSegments, numPresenceUsers);
+	return numSegments > 0;
+}
+
+void handleGetSegments() {
+	DBG_PRINTLN("handleGetSegments()");
+
+	const size_t capacity = JSON_ARRAY_SIZE(MAX_SEGMENTS) + MAX_SEGMENTS * JSON_OBJECT_SIZE(5);
+	StaticJsonDocument<capacity> responseDoc;
+	JsonArray array = responseDoc.to<JsonArray>();
+	for (uint8_t i = 0; i < numSegments; i++) {
+		JsonObject seg = array.createNestedObject();
+		seg["start"] = segments[i].start;
+		seg["stop"] = segments[i].stop;
+		seg["reverse"] = segments[i].reverse;
+		seg["source"] = segmentSourceNames[segments[i].source];
+		if (segments[i].source >= SEGMENT_SOURCE_USER_ACTIVITY) {
+			seg["user"] = (const char*)presenceUsers[segments[i].user].id;
+		}
+	}
+
+	server.send(200, "application/json", responseDoc.as<String>());
+}
@@ -0,0 +1,104 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * Socket wake-up
+ * loop() blocks on the event queue between two timers, a web request or UDP packet arriving
+ * meanwhile would wait for the end of the wait. This task waits in select() on the sockets
+ * loop() serves: web server (listening and connected), DNS server of the config portal, push and
+ * relay. If one has data it posts EVENT_WAKE, then waits until loop() served them.
+ * The sockets belong to WebServer, DNSServer and WiFiUDP, which don't expose them, so they
+ * are found by type and local port, again every WAKE_RESCAN (WAKE_RESCAN_POWER_SAVE).
+ */
+#include "lwip/sockets.h"
+
+#define WAKE_TASK_STACK 2048
+#define WAKE_RESCAN 1000			// Look for new sockets after (ms)
+#define WAKE_RESCAN_POWER_SAVE 5000	// ... with power saving, sockets of the web server only change with requests
+#define WAKE_DNS_PORT 53			// DNS server of the iotWebConf portal
+
+SemaphoreHandle_t socketsServed = NULL;
+volatile uint32_t socketWakeups = 0;
+
+
+// loop(), after the web server and the UDP handlers ran
+void markSocketsServed() {
+	if (socketsServed != NULL) {
+		xSemaphoreGive(socketsServed);
+	}
+}
+
+boolean isWakeSocket(int type, uint16_t port) {
+	if (type == SOCK_STREAM) {
+		return port == WEB_PORT;
+	}
+	return type == SOCK_DGRAM && (port == WAKE_DNS_PORT || port == PUSH_UDP_PORT || port == RELAY_PORT);
+}
+
+// Returns the highest socket or -1 if none is open
+int collectWakeSockets(fd_set* fds) {
+	FD_ZERO(fds);
+	int maxFd = -1;
+	for (int fd = LWIP_SOCKET_OFFSET; fd < LWIP_SOCKET_OFFSET + CONFIG_LWIP_MAX_SOCKETS; fd++) {
+		struct sockaddr_in addr;
+		socklen_t addrLen = sizeof(addr);
+		int type;
+		socklen_t typeLen = sizeof(type);
+		if (getsockname(fd, (struct sockaddr*)&addr, &addrLen) != 0 || addr.sin_family != AF_INET
+				|| getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &typeLen) != 0) {
+			continue;
+		}
+		if (isWakeSocket(type, ntohs(addr.sin_port))) {
+			FD_SET(fd, fds);
+			maxFd = max(maxFd, fd);
+		}
+	}
+	return maxFd;
+}
+
+void socketWakeTask(void* parameter) {
+	for (;;) {
+		unsigned long rescan = powerSave ? WAKE_RESCAN_POWER_SAVE : WAKE_RESCAN;
+		fd_set fds;
+		int maxFd = collectWakeSockets(&fds);
+		if (maxFd < 0) {
+			vTaskDelay(pdMS_TO_TICKS(rescan));
+			continue;
+		}
+		struct timeval timeout = { (long)(rescan / 1000), (long)(rescan % 1000) * 1000 };
+		int ready = select(maxFd + 1, &fds, NULL, NULL, &timeout);
+		if (ready < 0) {
+			// A socket was closed since the scan
+			vTaskDelay(1);
+			continue;
+		}
+		if (ready == 0) {
+			continue;
+		}
+		xSemaphoreTake(socketsServed, 0);
+		socketWakeups++;
+		postEvent(EVENT_WAKE);
+		xSemaphoreTake(socketsServed, pdMS_TO_TICKS(rescan));
+	}
+}
+
+void startSocketWake() {
+	socketsServed = xSemaphoreCreateBinary();
+	xTaskCreatePinnedToCore(
+		socketWakeTask,
+		"Wake",
+		WAKE_TASK_STACK,
+		NULL,
+		1,
+		NULL,
+		1);
+}
@@ -12,15 +12,113 @@
 
 /**
  * SPIFFS webserver
+ * Files are looked up in an index that is built once after SPIFFS is mounted and
+ * updated by upload and delete, so serving a file opens it exactly once.
+ * Internal files (tokens, TLS sessions, temp files) are never indexed, so they are not
+ * served, listed or deleted and the code writing them does not have to update the index.
  */
-bool exists(String path) {
-	bool yes = false;
+#include <map>
+#include "mbedtls/md.h"
+#include "upload_buffer.h"
+
+#define FILE_HASH_BLOCK 256							// Read size when hashing a file for its ETag
+#define CACHE_CONTROL_HASHED "public, max-age=31536000, immutable"
+#define CACHE_CONTROL_DEFAULT "no-cache"			// Browser has to revalidate with If-None-Match
+#define UPLOAD_PAGE_SIZE 256						// SPIFFS page size
+#define UPLOAD_BUFFER_SIZE (8 * UPLOAD_PAGE_SIZE)	// Uploads are written in blocks of whole pages
+#define UPLOAD_TMP_FILE "/upload.tmp"
+
+struct FileMeta {
+	size_t size;
+	uint32_t hash;		// FNV-1a of the content, 0 until the file was first requested
+};
+
+std::map<String, FileMeta> fileIndex;
+
+// Written by the firmware itself, contain secrets or are incomplete
+const char* const internalFiles[] = {
+	CONTEXT_FILE, CONTEXT_TMP_FILE, CONTEXT_LEGACY_FILE, LAST_PRESENCE_FILE, TLS_SESSION_FILE_LOGIN, TLS_SESSION_FILE_GRAPH, UPLOAD_TMP_FILE
+};
+
+
+// Full path of a file, SPIFFS returns names with or without leading slash depending on the core version
+String getIndexPath(const char* name) {
+	return (name[0] == '/') ? String(name) : "/" + String(name);
+}
+
+bool isInternalFile(const String& path) {
+	for (const char* name : internalFiles) {
+		if (path == name) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void updateFileIndex(const String& path) {
+	if (isInternalFile(path)) {
+		return;
+	}
 	File file = SPIFFS.open(path, "r");
-	if (!file.isDirectory()) {
-		yes = true;
+	if (!file || file.isDirectory()) {
+		fileIndex.erase(path);
+	} else {
+		fileIndex[path] = { file.size(), 0 };
 	}
 	file.close();
-	return yes;
+}
+
+// Build the index, called after SPIFFS was mounted
+void buildFileIndex() {
+	fileIndex.clear();
+	File root = SPIFFS.open("/");
+	File file = root.openNextFile();
+	while (file) {
+		String path = getIndexPath(file.name());
+		if (!file.isDirectory() && !isInternalFile(path)) {
+			fileIndex[path] = { file.size(), 0 };
+		}
+		file.close();
+		file = root.openNextFile();
+	}
+	Serial.printf("buildFileIndex() - %d files indexed.\n", fileIndex.size());
+}
+
+// Content hash for the ETag, computed on first use
+uint32_t getFileHash(const String& path, FileMeta& meta) {
+	if (meta.hash != 0) {
+		return meta.hash;
+	}
+	File file = SPIFFS.open(path, "r");
+	uint8_t buf[FILE_HASH_BLOCK];
+	uint32_t hash = 2166136261UL;
+	int len;
+	while ((len = file.read(buf, sizeof(buf))) > 0) {
+		for (int i = 0; i < len; i++) {
+			hash = (hash ^ buf[i]) * 16777619UL;
+		}
+	}
+	file.close();
+	meta.hash = (hash != 0) ? hash : 1;
+	return meta.hash;
+}
+
+// Assets with a content hash in the name (e.g. app.3f2a91c0.js) never change
+bool isHashedAsset(const String& path) {
+	int extDot = path.lastIndexOf('.');
+	if (path.endsWith(".gz")) {
+		extDot = path.lastIndexOf('.', extDot - 1);
+	}
+	int hashDot = path.lastIndexOf('.', extDot - 1);
+	if (extDot < 0 || hashDot < 0 || extDot - hashDot != 9) {
+		return false;
+	}
+	for (int i = hashDot + 1; i < extDot; i++) {
+		if (!isxdigit(path[i])) {
+			return false;
+		}
+	}
+	return true;
 }
 
 void handleMinimalUpload() {
@@ -43,33 +141,137 @@ void handleMinimalUpload() {
 			</html>"));
 }
 
+// Upload state, kept across the callbacks of one upload
+struct UploadState {
+	File file;
+	String path;
+	UploadBuffer<UPLOAD_BUFFER_SIZE> buffer;
+	size_t total;
+	unsigned long start;
+	unsigned long duration;
+	mbedtls_md_context_t sha;
+	String expectedSha;
+	const char* error;
+};
+
+UploadState uploadState;
+
+// Write a block of buffered pages to the temp file
+bool writeUploadBlock(const uint8_t* data, size_t len) {
+	return uploadState.file.write(data, len) == len;
+}
+
+// After an error the buffer drops the rest of the upload
+void checkUploadWrite() {
+	if (uploadState.buffer.hasFailed() && !uploadState.error) {
+		uploadState.error = "Write failed, file system full?";
+	}
+}
+
+// Write the buffered pages to the temp file
+void flushUpload() {
+	uploadState.buffer.flush(writeUploadBlock);
+	checkUploadWrite();
+}
+
+// Verify and move the temp file to its final name
+void finishUpload() {
+	flushUpload();
+	uploadState.file.close();
+
+	uint8_t digest[32];
+	mbedtls_md_finish(&uploadState.sha, digest);
+	mbedtls_md_free(&uploadState.sha);
+	if (!uploadState.error && uploadState.expectedSha.length() > 0) {
+		char hex[65];
+		for (int i = 0; i < 32; i++) {
+			sprintf(hex + i * 2, "%02x", digest[i]);
+		}
+		if (!uploadState.expectedSha.equalsIgnoreCase(hex)) {
+			uploadState.error = "SHA-256 mismatch";
+		}
+	}
+
+	if (uploadState.error) {
+		SPIFFS.remove(UPLOAD_TMP_FILE);
+		return;
+	}
+	SPIFFS.remove(uploadState.path);
+	if (!SPIFFS.rename(UPLOAD_TMP_FILE, uploadState.path)) {
+		uploadState.error = "Rename failed";
+		SPIFFS.remove(UPLOAD_TMP_FILE);
+	}
+	updateFileIndex(uploadState.path);
+}
+
+// Upload data is written to a temp file in SPIFFS-page sized blocks, optionally checked
+// against the SHA-256 given as query argument (/fs/upload?sha256=...) and renamed at the end
 void handleFileUpload() {
-	File fsUploadFile;
 	HTTPUpload &upload = server.upload();
 	if (upload.status == UPLOAD_FILE_START) 	{
-		String filename = upload.filename;
-		if (!filename.startsWith("/"))
-		{
-			filename = "/" + filename;
-		}
+		uploadState.path = upload.filename.startsWith("/") ? upload.filename : "/" + upload.filename;
+		uploadState.expectedSha = server.arg("sha256");
+		uploadState.buffer.reset();
+		uploadState.total = 0;
+		uploadState.duration = 0;
+		uploadState.start = millis();
+		uploadState.error = NULL;
+		mbedtls_md_init(&uploadState.sha);
+		mbedtls_md_setup(&uploadState.sha, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+		mbedtls_md_starts(&uploadState.sha);
 		DBG_PRINT("handleFileUpload Name: ");
-		DBG_PRINTLN(filename);
-		fsUploadFile = SPIFFS.open(filename, "w");
-		filename = String();
-	} else if (upload.status == UPLOAD_FILE_WRITE) {
-		//DBG_OUTPUT_PORT.print("handleFileUpload Data: "); DBG_OUTPUT_PORT.println(upload.currentSize);
-		if (fsUploadFile) {
-			fsUploadFile.write(upload.buf, upload.currentSize);
+		DBG_PRINTLN(uploadState.path);
+		if (isInternalFile(uploadState.path)) {
+			uploadState.error = "Reserved file name";
+		} else {
+			uploadState.file = SPIFFS.open(UPLOAD_TMP_FILE, "w");
+			if (!uploadState.file) {
+				uploadState.error = "Could not create file";
+			}
 		}
-	} else if (upload.status == UPLOAD_FILE_END) {
-		if (fsUploadFile) {
-			fsUploadFile.close();
+		if (uploadState.error) {
+			uploadState.buffer.fail();
 		}
+	} else if (upload.status == UPLOAD_FILE_WRITE) {
+		mbedtls_md_update(&uploadState.sha, upload.buf, upload.currentSize);
+		uploadState.total += upload.currentSize;
+		uploadState.buffer.append(upload.buf, upload.currentSize, writeUploadBlock);
+		checkUploadWrite();
+	} else if (upload.status == UPLOAD_FILE_END) {
+		finishUpload();
+		uploadState.duration = millis() - uploadState.start;
 		DBG_PRINT("handleFileUpload Size: ");
 		DBG_PRINTLN(upload.totalSize);
+	} else if (upload.status == UPLOAD_FILE_ABORTED) {
+		uploadState.file.close();
+		mbedtls_md_free(&uploadState.sha);
+		SPIFFS.remove(UPLOAD_TMP_FILE);
+		uploadState.error = "Upload aborted";
 	}
 }
 
+// Response after the upload, with the throughput
+void handleFileUploadDone() {
+	const size_t capacity = JSON_OBJECT_SIZE(5);
+	StaticJsonDocument<capacity> responseDoc;
+	responseDoc["path"] = uploadState.path.c_str();
+	responseDoc["size"] = uploadState.total;
+	responseDoc["duration_ms"] = uploadState.duration;
+	if (uploadState.duration > 0) {
+		responseDoc["bytes_per_sec"] = uploadState.total * 1000 / uploadState.duration;
+	}
+	if (uploadState.error) {
+		responseDoc["error"] = uploadState.error;
+	}
+	server.send(uploadState.error ? 500 : 200, "application/json", responseDoc.as<String>());
+
+	// A request without file part must not report the last upload again
+	uploadState.path = "";
+	uploadState.total = 0;
+	uploadState.duration = 0;
+	uploadState.error = "No file uploaded";
+}
+
 void handleFileDelete() {
 	if (server.args() == 0)	{
 		return server.send(500, "text/plain", "BAD ARGS");
@@ -79,14 +281,21 @@ void handleFileDelete() {
 	if (path == "/") {
 		return server.send(500, "text/plain", "BAD PATH");
 	}
-	if (!exists(path)) {
+	// Internal files are not indexed, so they can not be deleted from here
+	auto entry = fileIndex.find(path);
+	if (entry == fileIndex.end()) {
 		return server.send(404, "text/plain", "FileNotFound");
 	}
 	SPIFFS.remove(path);
+	fileIndex.erase(entry);
 	server.send(200, "text/plain", "");
 	path = String();
 }
 
+#define FILELIST_CHUNK 512		// Size of one chunk of the directory listing
+#define FILELIST_ENTRY 96		// Max. size of one entry, SPIFFS names are limited to 32 chars
+
+// Directory listing, streamed in chunks. Optional paging with offset and limit.
 void handleFileList() {
 	if (!server.hasArg("dir")) {
 		server.send(500, "text/plain", "BAD ARGS");
@@ -95,26 +304,46 @@ void handleFileList() {
 
 	String path = server.arg("dir");
 	DBG_PRINTLN("handleFileList: " + path);
+	long offset = server.hasArg("offset") ? server.arg("offset").toInt() : 0;
+	long limit = server.hasArg("limit") ? server.arg("limit").toInt() : -1;
 
 	File root = SPIFFS.open(path);
 	path = String();
-	String output = "[";
+	server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+	server.send(200, "text/json", "");
+
+	char chunk[FILELIST_CHUNK];
+	size_t len = 0;
+	chunk[len++] = '[';
 	if (root.isDirectory()) {
+		long index = 0;
+		long count = 0;
 		File file = root.openNextFile();
-		while (file) {
-			if (output != "[") {
-				output += ',';
+		while (file && (limit < 0 || count < limit)) {
+			// Internal files are not listed, like they are not served
+			if (!isInternalFile(getIndexPath(file.name())) && index++ >= offset) {
+				// Flush the chunk if the next entry and the closing bracket might not fit
+				if (len + FILELIST_ENTRY + 2 > sizeof(chunk)) {
+					chunk[len] = '\0';
+					server.sendContent(chunk);
+					len = 0;
+				}
+				const char* name = file.name();
+				if (name[0] == '/') {
+					name++;
+				}
+				len += snprintf(chunk + len, sizeof(chunk) - len, "%s{\"type\":\"%s\",\"name\":\"%s\",\"size\":%u}",
+					count > 0 ? "," : "", file.isDirectory() ? "dir" : "file", name, file.size());
+				count++;
 			}
-			output += "{\"type\":\"";
-			output += (file.isDirectory()) ? "dir" : "file";
-			output += "\",\"name\":\"";
-			output += String(file.name()).substring(1);
-			output += "\"}";
+			file.close();
 			file = root.openNextFile();
 		}
 	}
-	output += "]";
-	server.send(200, "text/json", output);
+	chunk[len++] = ']';
+	chunk[len] = '\0';
+	server.sendContent(chunk);
+	server.sendContent("");
 }
 
 String getContentType(String filename) {
@@ -154,15 +383,25 @@ bool handleFileRead(String path) {
 		path += "index.htm";
 	}
 	String contentType = getContentType(path);
-	String pathWithGz = path + ".gz";
-	if (exists(pathWithGz) || exists(path))	{
-		if (exists(pathWithGz))	{
-			path += ".gz";
-		}
-		File file = SPIFFS.open(path, "r");
-		server.streamFile(file, contentType);
-		file.close();
+	auto entry = fileIndex.find(path + ".gz");
+	if (entry == fileIndex.end()) {
+		entry = fileIndex.find(path);
+	}
+	if (entry == fileIndex.end()) {
+		return false;
+	}
+
+	char etag[12];
+	snprintf(etag, sizeof(etag), "\"%08x\"", getFileHash(entry->first, entry->second));
+	server.sendHeader("ETag", etag);
+	server.sendHeader("Cache-Control", isHashedAsset(entry->first) ? CACHE_CONTROL_HASHED : CACHE_CONTROL_DEFAULT);
+	if (server.header("If-None-Match") == etag) {
+		server.send(304);
 		return true;
 	}
-	return false;
-}
\ No newline at end of file
+
+	File file = SPIFFS.open(entry->first, "r");
+	server.streamFile(file, contentType);
+	file.close();
+	return true;
+}
@@ -0,0 +1,60 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * Single-producer / single-consumer lock-free ring
+ * One task pushes, one other task pops, neither blocks. Head and tail only grow and wrap
+ * at 2^32, the slot is taken from the low bits, so Size must be a power of two.
+ * Has no Arduino dependencies, it is also built by the native tests (test/test_spsc_ring).
+ */
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+template <typename T, uint32_t Size>
+class SpscRing {
+	static_assert(Size > 0 && (Size & (Size - 1)) == 0, "Size must be a power of two");
+
+public:
+	// Producer side, returns false if the ring is full
+	bool push(const T& item) {
+		uint32_t head = _head.load(std::memory_order_relaxed);
+		if (head - _tail.load(std::memory_order_acquire) >= Size) {
+			return false;
+		}
+		_items[head & (Size - 1)] = item;
+		_head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side, returns false if the ring is empty
+	bool pop(T& item) {
+		uint32_t tail = _tail.load(std::memory_order_relaxed);
+		if (tail == _head.load(std::memory_order_acquire)) {
+			return false;
+		}
+		item = _items[tail & (Size - 1)];
+		_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Snapshot, only exact on the consumer side
+	uint32_t size() const {
+		return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);
+	}
+
+private:
+	T _items[Size];
+	std::atomic<uint32_t> _head{0};	// Next slot to write, only changed by the producer
+	std::atomic<uint32_t> _tail{0};	// Next slot to read, only changed by the consumer
+};
@@ -0,0 +1,81 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * One-shot timers of the statemachine
+ * The time comes from a clock hook (millis() on the device, a virtual clock in the native
+ * tests, see test/test_timers). Times are 32 bit ms like millis() on the ESP32, deadlines
+ * are compared by difference, so they work across the wrap after 49 days.
+ */
+#pragma once
+
+#include <stdint.h>
+
+typedef unsigned long (*TimerClock)();
+
+template <uint8_t Count>
+class TimerSet {
+public:
+	explicit TimerSet(TimerClock clock) : _clock(clock) {}
+
+	// (Re)start a timer, it fires once
+	void arm(uint8_t timer, unsigned long delayMillis) {
+		_deadline[timer] = (uint32_t)(_clock() + delayMillis);
+		_armed[timer] = true;
+	}
+
+	void cancel(uint8_t timer) {
+		_armed[timer] = false;
+	}
+
+	bool isArmed(uint8_t timer) const {
+		return _armed[timer];
+	}
+
+	// Remaining time of a timer (ms), negative if overdue, 0 if not armed
+	long remaining(uint8_t timer) const {
+		return _armed[timer] ? (long)(int32_t)(_deadline[timer] - (uint32_t)_clock()) : 0;
+	}
+
+	// Time until the next timer is due, capped at maxWait
+	unsigned long nextDelay(unsigned long maxWait) const {
+		unsigned long wait = maxWait;
+		for (uint8_t i = 0; i < Count; i++) {
+			if (!_armed[i]) {
+				continue;
+			}
+			long left = remaining(i);
+			if (left <= 0) {
+				return 0;
+			}
+			if ((unsigned long)left < wait) {
+				wait = left;
+			}
+		}
+		return wait;
+	}
+
+	// Calls fire(timer) for every expired timer, a timer stays armed if fire() returns false
+	template <typename F>
+	void fireExpired(F fire) {
+		for (uint8_t i = 0; i < Count; i++) {
+			if (_armed[i] && remaining(i) <= 0 && fire(i)) {
+				_armed[i] = false;
+			}
+		}
+	}
+
+private:
+	TimerClock _clock;
+	uint32_t _deadline[Count] = {};
+	bool _armed[Count] = {};
+};
@@ -0,0 +1,351 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * TLS client with session resumption
+ * WiFiClientSecure parses the CA certificate for every connection and has no
+ * way to resume a TLS session. This client uses mbedTLS directly: the CA chain
+ * and the TLS config are set up once and shared, the last session of every
+ * client is offered on reconnect so the server can do an abbreviated handshake.
+ */
+#include "mbedtls/ssl.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/version.h"
+
+// Session (de)serialization is available since mbedTLS 2.19, the platform is pinned in platformio.ini
+// to a release that has it. Reported as tls_session_persistence in /api/settings.
+#if MBEDTLS_VERSION_NUMBER >= 0x02130000
+#define TLS_SESSION_PERSISTENCE 1
+#else
+#define TLS_SESSION_PERSISTENCE 0
+#warning "mbedTLS < 2.19, TLS sessions are not kept across reboots"
+#endif
+
+#define TLS_HANDSHAKE_TIMEOUT 10000	// Timeout of the TLS handshake (ms)
+#define TLS_WRITE_TIMEOUT 10000		// Timeout while the socket takes no data (ms)
+
+mbedtls_entropy_context tlsEntropy;
+mbedtls_ctr_drbg_context tlsDrbg;
+mbedtls_x509_crt tlsCaChain;
+mbedtls_ssl_config tlsConfig;
+
+
+// Set up the shared TLS config, parse the CA certificate once
+boolean initTls(const char* caCert) {
+	mbedtls_entropy_init(&tlsEntropy);
+	mbedtls_ctr_drbg_init(&tlsDrbg);
+	mbedtls_x509_crt_init(&tlsCaChain);
+	mbedtls_ssl_config_init(&tlsConfig);
+
+	const char* pers = "ESPTeamsPresence";
+	int ret = mbedtls_ctr_drbg_seed(&tlsDrbg, mbedtls_entropy_func, &tlsEntropy, (const unsigned char*)pers, strlen(pers));
+	if (ret == 0) {
+		ret = mbedtls_ssl_config_defaults(&tlsConfig, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+	}
+	if (ret != 0) {
+		Serial.printf("initTls() - Error: -0x%x\n", -ret);
+		return false;
+	}
+	mbedtls_ssl_conf_rng(&tlsConfig, mbedtls_ctr_drbg_random, &tlsDrbg);
+	#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+	mbedtls_ssl_conf_session_tickets(&tlsConfig, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+	#endif
+
+	if (caCert == NULL) {
+		mbedtls_ssl_conf_authmode(&tlsConfig, MBEDTLS_SSL_VERIFY_NONE);
+	} else {
+		ret = mbedtls_x509_crt_parse(&tlsCaChain, (const unsigned char*)caCert, strlen(caCert) + 1);
+		if (ret != 0) {
+			Serial.printf("initTls() - Parsing CA certificate failed: -0x%x\n", -ret);
+			return false;
+		}
+		mbedtls_ssl_conf_authmode(&tlsConfig, MBEDTLS_SSL_VERIFY_REQUIRED);
+		mbedtls_ssl_conf_ca_chain(&tlsConfig, &tlsCaChain, NULL);
+	}
+	return true;
+}
+
+// mbedTLS I/O callbacks on top of the plain TCP client
+static int tlsSend(void* ctx, const unsigned char* buf, size_t len) {
+	WiFiClient* tcp = (WiFiClient*)ctx;
+	if (!tcp->connected()) {
+		return MBEDTLS_ERR_NET_CONN_RESET;
+	}
+	size_t written = tcp->write(buf, len);
+	if (written == 0) {
+		return MBEDTLS_ERR_SSL_WANT_WRITE;
+	}
+	return written;
+}
+
+static int tlsRecv(void* ctx, unsigned char* buf, size_t len) {
+	WiFiClient* tcp = (WiFiClient*)ctx;
+	if (tcp->available() <= 0) {
+		return tcp->connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_CONN_RESET;
+	}
+	int ret = tcp->read(buf, len);
+	return ret > 0 ? ret : MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+
+class TlsClient : public Client {
+public:
+	TlsClient() : _connected(false), _hasSession(false), _sessionChanged(false), _resumed(false), _peek(-1) {
+		mbedtls_ssl_init(&_ssl);
+		mbedtls_ssl_session_init(&_session);
+	}
+
+	int connect(IPAddress ip, uint16_t port) {
+		return connect(ip.toString().c_str(), port);
+	}
+
+	int connect(const char* host, uint16_t port) {
+		stop();
+		if (!_tcp.connect(host, port)) {
+			return 0;
+		}
+
+		if (mbedtls_ssl_setup(&_ssl, &tlsConfig) != 0 || mbedtls_ssl_set_hostname(&_ssl, host) != 0) {
+			closeSocket();
+			return 0;
+		}
+		if (_hasSession) {
+			mbedtls_ssl_set_session(&_ssl, &_session);
+		}
+		mbedtls_ssl_set_bio(&_ssl, &_tcp, tlsSend, tlsRecv, NULL);
+
+		// Step through the handshake, a full handshake is the one where the server sends its certificate
+		boolean full = false;
+		unsigned long start = millis();
+		while (_ssl.state != MBEDTLS_SSL_HANDSHAKE_OVER) {
+			int ret = mbedtls_ssl_handshake_step(&_ssl);
+			if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+				if (millis() - start > TLS_HANDSHAKE_TIMEOUT) {
+					DBG_PRINTLN(F("[TLS] Handshake timeout"));
+					closeSocket();
+					return 0;
+				}
+				delay(1);
+				continue;
+			}
+			if (ret != 0) {
+				Serial.printf("[TLS] Handshake failed: -0x%x\n", -ret);
+				// A stale session must not break the next attempt
+				forgetSession();
+				closeSocket();
+				return 0;
+			}
+			if (_ssl.state == MBEDTLS_SSL_SERVER_CERTIFICATE) {
+				full = true;
+			}
+		}
+		_connected = true;
+		_resumed = !full;
+
+		// Keep the session for the next connection, it has to be saved again if it is new or the
+		// server renewed the ticket during the abbreviated handshake
+		mbedtls_ssl_session session;
+		mbedtls_ssl_session_init(&session);
+		if (mbedtls_ssl_get_session(&_ssl, &session) == 0) {
+			_sessionChanged = _sessionChanged || full || !_hasSession || !isSameSession(session, _session);
+			mbedtls_ssl_session_free(&_session);
+			_session = session;
+			_hasSession = true;
+		} else {
+			mbedtls_ssl_session_free(&session);
+			forgetSession();
+		}
+		return 1;
+	}
+
+	size_t write(uint8_t c) {
+		return write(&c, 1);
+	}
+
+	size_t write(const uint8_t* buf, size_t size) {
+		if (!_connected) {
+			return 0;
+		}
+		size_t written = 0;
+		unsigned long start = millis();
+		while (written < size) {
+			int ret = mbedtls_ssl_write(&_ssl, buf + written, size - written);
+			if (ret > 0) {
+				written += ret;
+				start = millis();
+			} else if ((ret != MBEDTLS_ERR_SSL_WANT_WRITE && ret != MBEDTLS_ERR_SSL_WANT_READ) || millis() - start > TLS_WRITE_TIMEOUT) {
+				stop();
+				break;
+			} else {
+				delay(1);
+			}
+		}
+		return written;
+	}
+
+	int available() {
+		if (!_connected) {
+			return 0;
+		}
+		int peeked = (_peek >= 0) ? 1 : 0;
+		int avail = mbedtls_ssl_get_bytes_avail(&_ssl);
+		if (avail == 0) {
+			// Process pending records without blocking
+			int ret = mbedtls_ssl_read(&_ssl, NULL, 0);
+			if (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+				if (!peeked) {
+					stop();
+				}
+				return peeked;
+			}
+			avail = mbedtls_ssl_get_bytes_avail(&_ssl);
+		}
+		return avail + peeked;
+	}
+
+	int read() {
+		uint8_t c;
+		return (read(&c, 1) > 0) ? c : -1;
+	}
+
+	int read(uint8_t* buf, size_t size) {
+		if (size == 0) {
+			return 0;
+		}
+		int offset = 0;
+		if (_peek >= 0) {
+			buf[0] = (uint8_t)_peek;
+			_peek = -1;
+			offset = 1;
+			if (size == 1 || !_connected || mbedtls_ssl_get_bytes_avail(&_ssl) == 0) {
+				return offset;
+			}
+		}
+		if (!_connected) {
+			return -1;
+		}
+		int ret = mbedtls_ssl_read(&_ssl, buf + offset, size - offset);
+		if (ret > 0) {
+			return ret + offset;
+		}
+		if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+			// Close notify or error
+			stop();
+		}
+		return offset > 0 ? offset : -1;
+	}
+
+	int peek() {
+		if (_peek < 0) {
+			uint8_t c;
+			if (read(&c, 1) > 0) {
+				_peek = c;
+			}
+		}
+		return _peek;
+	}
+
+	void flush() {}
+
+	void stop() {
+		if (_connected) {
+			mbedtls_ssl_close_notify(&_ssl);
+		}
+		closeSocket();
+	}
+
+	uint8_t connected() {
+		if (!_connected) {
+			return 0;
+		}
+		return _tcp.connected() || _peek >= 0 || mbedtls_ssl_get_bytes_avail(&_ssl) > 0;
+	}
+
+	operator bool() {
+		return connected();
+	}
+
+	// Last handshake was an abbreviated one
+	boolean resumed() {
+		return _resumed;
+	}
+
+	// A new session was negotiated or the ticket was renewed since the last call
+	boolean sessionChanged() {
+		boolean changed = _sessionChanged;
+		_sessionChanged = false;
+		return changed;
+	}
+
+	void forgetSession() {
+		mbedtls_ssl_session_free(&_session);
+		mbedtls_ssl_session_init(&_session);
+		_hasSession = false;
+	}
+
+	#if TLS_SESSION_PERSISTENCE
+	// Serialize the session, returns the number of bytes needed / written
+	size_t saveSession(uint8_t* buf, size_t len) {
+		size_t olen = 0;
+		if (!_hasSession) {
+			return 0;
+		}
+		int ret = mbedtls_ssl_session_save(&_session, buf, len, &olen);
+		if (ret != 0 && ret != MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL) {
+			return 0;
+		}
+		return olen;
+	}
+
+	boolean loadSession(const uint8_t* buf, size_t len) {
+		forgetSession();
+		_hasSession = (mbedtls_ssl_session_load(&_session, buf, len) == 0);
+		if (!_hasSession) {
+			forgetSession();
+		}
+		return _hasSession;
+	}
+	#endif
+
+private:
+	// Same ticket, or same session id without tickets. With a ticket the client picks a random
+	// session id for every handshake, so the id says nothing.
+	static boolean isSameSession(const mbedtls_ssl_session& a, const mbedtls_ssl_session& b) {
+		#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_CLI_C)
+		if (a.ticket_len > 0 || b.ticket_len > 0) {
+			return a.ticket_len == b.ticket_len && memcmp(a.ticket, b.ticket, a.ticket_len) == 0;
+		}
+		#endif
+		return a.id_len == b.id_len && memcmp(a.id, b.id, a.id_len) == 0;
+	}
+
+	// Drop the connection without notifying the server, frees the TLS buffers
+	void closeSocket() {
+		mbedtls_ssl_free(&_ssl);
+		mbedtls_ssl_init(&_ssl);
+		_tcp.stop();
+		_connected = false;
+		_peek = -1;
+	}
+
+	WiFiClient _tcp;
+	mbedtls_ssl_context _ssl;
+	mbedtls_ssl_session _session;
+	boolean _connected;
+	boolean _hasSession;
+	boolean _sessionChanged;
+	boolean _resumed;
+	int _peek;
+};
@@ -0,0 +1,76 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * Upload buffer
+ * Collects upload data into blocks of Size bytes (whole SPIFFS pages) and hands full blocks
+ * to a write function. Once the upload failed, further data is dropped, but still consumed,
+ * so the web server can read the request to its end.
+ * Has no Arduino dependencies, it is also built by the native tests (test/test_upload_buffer).
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+template <size_t Size>
+class UploadBuffer {
+public:
+	void reset() {
+		_buffered = 0;
+		_failed = false;
+	}
+
+	// Drop buffered and further data, e.g. if the target file could not be created
+	void fail() {
+		_buffered = 0;
+		_failed = true;
+	}
+
+	bool hasFailed() const {
+		return _failed;
+	}
+
+	size_t buffered() const {
+		return _buffered;
+	}
+
+	// Append data, full blocks go to write(const uint8_t* data, size_t len), which returns false on error
+	template <typename Write>
+	void append(const uint8_t* data, size_t len, Write write) {
+		while (len > 0 && !_failed) {
+			size_t n = (Size - _buffered < len) ? Size - _buffered : len;
+			memcpy(_buffer + _buffered, data, n);
+			_buffered += n;
+			data += n;
+			len -= n;
+			if (_buffered == Size) {
+				flush(write);
+			}
+		}
+	}
+
+	// Write the rest, called at the end of the upload
+	template <typename Write>
+	void flush(Write write) {
+		if (_buffered > 0 && !_failed && !write(_buffer, _buffered)) {
+			_failed = true;
+		}
+		_buffered = 0;
+	}
+
+private:
+	uint8_t _buffer[Size];
+	size_t _buffered = 0;
+	bool _failed = false;
+};
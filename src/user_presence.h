@@ -0,0 +1,105 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * Presence of other users
+ * Segments with the source "user_activity" / "user_availability" show the presence of the
+ * user given in their "user" field (Azure AD object id). All users are polled with one
+ * request to communications/getPresencesByUserId, this needs the Presence.Read.All scope.
+ * Needs only ArduinoJson and graph_presence.h, the native tests use it (test/test_user_presence).
+ */
+#define MAX_PRESENCE_USERS 8				// At most one user per segment
+#define USER_ID_LEN 40						// Object id (GUID, 36 chars)
+#define USER_PRESENCE_URL "https://graph.microsoft.com/v1.0/communications/getPresencesByUserId"
+#define USER_PRESENCE_PAYLOAD_LEN (16 + MAX_PRESENCE_USERS * (USER_ID_LEN + 3))
+#define USER_PRESENCE_SCOPE "%20Presence.Read.All"
+#define USER_PRESENCE_MISSING 0xFF			// User is not in the response, keeps the last state
+#define USER_PRESENCE_FILTER_CAPACITY 128
+#define USER_PRESENCE_RESPONSE_CAPACITY (JSON_OBJECT_SIZE(1) + JSON_ARRAY_SIZE(MAX_PRESENCE_USERS) + MAX_PRESENCE_USERS * (JSON_OBJECT_SIZE(3) + USER_ID_LEN + 2 * PRESENCE_NAME_LEN) + 64)
+
+struct UserPresence {
+	char id[USER_ID_LEN];
+	uint8_t availabilityId;
+	uint8_t activityId;
+};
+
+UserPresence presenceUsers[MAX_PRESENCE_USERS];
+uint8_t numPresenceUsers = 0;
+uint8_t presenceUsersVersion = 0;			// Changed with every clear, results for an older table are dropped
+
+
+void clearPresenceUsers() {
+	numPresenceUsers = 0;
+	presenceUsersVersion++;
+}
+
+int8_t findPresenceUser(const char* id) {
+	for (uint8_t i = 0; i < numPresenceUsers; i++) {
+		if (strcasecmp(presenceUsers[i].id, id) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Index of the user in the table, the user is added if needed. -1 if the table is full or the id invalid.
+int8_t addPresenceUser(const char* id) {
+	size_t len = strlen(id);
+	if (len == 0 || len >= USER_ID_LEN || strpbrk(id, "\"\\") != NULL) {
+		return -1;
+	}
+	int8_t index = findPresenceUser(id);
+	if (index >= 0 || numPresenceUsers >= MAX_PRESENCE_USERS) {
+		return index;
+	}
+	UserPresence& user = presenceUsers[numPresenceUsers];
+	strlcpy(user.id, id, sizeof(user.id));
+	user.availabilityId = PRESENCE_NONE;
+	user.activityId = PRESENCE_NONE;
+	return numPresenceUsers++;
+}
+
+// Request body: {"ids":["id1","id2"]}
+const char* getUserPresencePayload(char* buf, size_t size, const char ids[][USER_ID_LEN], uint8_t count) {
+	size_t len = strlcpy(buf, "{\"ids\":[", size);
+	for (uint8_t i = 0; i < count && len < size; i++) {
+		len += snprintf(buf + len, size - len, "%s\"%s\"", (i > 0) ? "," : "", ids[i]);
+	}
+	if (len < size) {
+		strlcpy(buf + len, "]}", size - len);
+	}
+	return buf;
+}
+
+// Only id, availability and activity of every entry and the error code are kept
+void setUserPresenceFilter(JsonDocument& filter) {
+	filter["value"][0]["id"] = true;
+	filter["value"][0]["availability"] = true;
+	filter["value"][0]["activity"] = true;
+	filter["error"]["code"] = true;
+}
+
+// Presence of every id from the "value" array of the response, USER_PRESENCE_MISSING for ids not in it
+void parseUserPresences(JsonArrayConst value, const char ids[][USER_ID_LEN], uint8_t count, uint8_t* availabilityIds, uint8_t* activityIds) {
+	memset(availabilityIds, USER_PRESENCE_MISSING, count);
+	memset(activityIds, USER_PRESENCE_MISSING, count);
+	for (JsonVariantConst entry : value) {
+		const char* id = entry["id"] | "";
+		for (uint8_t i = 0; i < count; i++) {
+			if (strcasecmp(ids[i], id) == 0) {
+				availabilityIds[i] = getPresenceId(entry["availability"] | "");
+				activityIds[i] = getPresenceId(entry["activity"] | "");
+				break;
+			}
+		}
+	}
+}
@@ -0,0 +1,3 @@
+// Generated by scripts/build_web.py from web/, do not edit
+#define WEB_ASSET_CSS "/app.9eac7967.css"
+#define WEB_ASSET_JS "/app.f0d7e7e5.js"
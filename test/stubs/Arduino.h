@@ -0,0 +1,170 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * Minimal Arduino core for the native tests
+ * Only what the headers under test use. Time is virtual: millis() returns stubMillis,
+ * delay() advances it, so timeouts run instantly. With STUB_DELAY_SLEEPS, delay() also
+ * sleeps, for tests talking to a real server over sockets.
+ */
+#pragma once
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <string>
+#ifdef STUB_DELAY_SLEEPS
+#include <unistd.h>
+#endif
+
+typedef bool boolean;
+
+using std::max;
+using std::min;
+
+unsigned long stubMillis = 0;
+
+inline unsigned long millis() {
+	return stubMillis;
+}
+
+inline unsigned long micros() {
+	return stubMillis * 1000;
+}
+
+inline void delay(unsigned long ms) {
+	stubMillis += ms;
+	#ifdef STUB_DELAY_SLEEPS
+	usleep(ms * 1000);
+	#endif
+}
+
+// Part of newlib on the ESP32, glibc has it only since 2.38
+#if defined(__GLIBC__) && (__GLIBC__ < 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 38))
+inline size_t strlcpy(char* dest, const char* src, size_t size) {
+	size_t len = strlen(src);
+	if (size > 0) {
+		size_t n = (len < size - 1) ? len : size - 1;
+		memcpy(dest, src, n);
+		dest[n] = '\0';
+	}
+	return len;
+}
+#endif
+
+// toString() returns a std::string, the stub has no String
+class IPAddress {
+public:
+	IPAddress(uint8_t a = 0, uint8_t b = 0, uint8_t c = 0, uint8_t d = 0) : _bytes{a, b, c, d} {}
+	std::string toString() const {
+		char buf[16];
+		snprintf(buf, sizeof(buf), "%u.%u.%u.%u", _bytes[0], _bytes[1], _bytes[2], _bytes[3]);
+		return buf;
+	}
+private:
+	uint8_t _bytes[4];
+};
+
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper*>(s))
+
+// Flash is readable like RAM on the host
+#define PROGMEM
+#define PGM_P const char*
+#define strlen_P strlen
+#define vsnprintf_P vsnprintf
+
+class Print {
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t c) = 0;
+	virtual size_t write(const uint8_t* buf, size_t size) {
+		size_t n = 0;
+		while (size-- && write(*buf++)) {
+			n++;
+		}
+		return n;
+	}
+	size_t print(const char* s) {
+		return write((const uint8_t*)s, strlen(s));
+	}
+	size_t print(const __FlashStringHelper* s) {
+		return print(reinterpret_cast<const char*>(s));
+	}
+	size_t print(long n) {
+		char buf[24];
+		snprintf(buf, sizeof(buf), "%ld", n);
+		return print(buf);
+	}
+	size_t println(const char* s = "") {
+		return print(s) + print("\r\n");
+	}
+	size_t println(const __FlashStringHelper* s) {
+		return println(reinterpret_cast<const char*>(s));
+	}
+	size_t println(long n) {
+		return print(n) + print("\r\n");
+	}
+	size_t printf(const char* format, ...) {
+		char buf[256];
+		va_list args;
+		va_start(args, format);
+		int len = vsnprintf(buf, sizeof(buf), format, args);
+		va_end(args);
+		return (len > 0) ? write((const uint8_t*)buf, min((size_t)len, sizeof(buf) - 1)) : 0;
+	}
+};
+
+class Stream : public Print {
+public:
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+	virtual void flush() {}
+	// ArduinoJson reads streams through readBytes()
+	size_t readBytes(char* buf, size_t len) {
+		size_t n = 0;
+		int c;
+		while (n < len && (c = read()) >= 0) {
+			buf[n++] = (char)c;
+		}
+		return n;
+	}
+};
+
+class Client : public Stream {
+public:
+	virtual int connect(const char* host, uint16_t port) = 0;
+	virtual int read(uint8_t* buf, size_t size) = 0;
+	virtual void stop() = 0;
+	virtual uint8_t connected() = 0;
+	using Stream::read;
+	using Print::write;
+};
+
+// Serial output goes to stdout, only shown if STUB_SERIAL_ECHO is set
+class StubSerial : public Print {
+public:
+	size_t write(uint8_t c) {
+		#ifdef STUB_SERIAL_ECHO
+		putchar(c);
+		#endif
+		return 1;
+	}
+	using Print::write;
+};
+
+StubSerial Serial;
@@ -0,0 +1,88 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * SPIFFS for the native tests, files are kept in memory until the test ends.
+ * Only whole-file reads and writes, like the firmware does them.
+ */
+#pragma once
+
+#include <Arduino.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+
+class File {
+public:
+	File(std::vector<uint8_t>* data = NULL) : _data(data), _pos(0) {}
+
+	operator bool() const {
+		return _data != NULL;
+	}
+
+	size_t size() const {
+		return _data ? _data->size() : 0;
+	}
+
+	size_t read(uint8_t* buf, size_t len) {
+		if (!_data) {
+			return 0;
+		}
+		size_t n = min(len, _data->size() - _pos);
+		memcpy(buf, _data->data() + _pos, n);
+		_pos += n;
+		return n;
+	}
+
+	size_t write(const uint8_t* buf, size_t len) {
+		if (!_data) {
+			return 0;
+		}
+		_data->insert(_data->end(), buf, buf + len);
+		return len;
+	}
+
+	void close() {
+		_data = NULL;
+	}
+
+private:
+	std::vector<uint8_t>* _data;
+	size_t _pos;
+};
+
+class StubFS {
+public:
+	File open(const char* path, const char* mode = FILE_READ) {
+		if (mode[0] == 'w') {
+			files[path].clear();
+			return File(&files[path]);
+		}
+		auto file = files.find(path);
+		return (file != files.end()) ? File(&file->second) : File();
+	}
+
+	bool exists(const char* path) {
+		return files.count(path) > 0;
+	}
+
+	bool remove(const char* path) {
+		return files.erase(path) > 0;
+	}
+
+	std::map<std::string, std::vector<uint8_t>> files;
+};
+
+StubFS SPIFFS;
@@ -0,0 +1,115 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * WiFiClient for the native tests, a plain TCP socket of the host.
+ * Reads and writes don't block, like the lwIP based client on the ESP32.
+ * Host names resolve to IPv4 only, stubTcpPort redirects all connections to a local test server.
+ */
+#pragma once
+
+#include <Arduino.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+uint16_t stubTcpPort = 0;		// Port used instead of the requested one, if set
+
+class WiFiClient : public Client {
+public:
+	~WiFiClient() {
+		stop();
+	}
+
+	int connect(const char* host, uint16_t port) {
+		stop();
+		addrinfo hints = {};
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		addrinfo* addr;
+		char service[8];
+		snprintf(service, sizeof(service), "%u", stubTcpPort ? stubTcpPort : port);
+		if (getaddrinfo(host, service, &hints, &addr) != 0) {
+			return 0;
+		}
+		_fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+		if (_fd >= 0 && ::connect(_fd, addr->ai_addr, addr->ai_addrlen) != 0) {
+			::close(_fd);
+			_fd = -1;
+		}
+		freeaddrinfo(addr);
+		if (_fd >= 0) {
+			int one = 1;
+			setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		}
+		return _fd >= 0;
+	}
+
+	size_t write(uint8_t c) {
+		return write(&c, 1);
+	}
+
+	size_t write(const uint8_t* buf, size_t size) {
+		if (_fd < 0) {
+			return 0;
+		}
+		ssize_t n = send(_fd, buf, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+		return n > 0 ? n : 0;
+	}
+
+	int available() {
+		int n = 0;
+		return (_fd >= 0 && ioctl(_fd, FIONREAD, &n) == 0) ? n : 0;
+	}
+
+	int read() {
+		uint8_t c;
+		return (read(&c, 1) > 0) ? c : -1;
+	}
+
+	int read(uint8_t* buf, size_t size) {
+		if (_fd < 0) {
+			return -1;
+		}
+		ssize_t n = recv(_fd, buf, size, MSG_DONTWAIT);
+		return n > 0 ? n : -1;
+	}
+
+	int peek() {
+		uint8_t c;
+		return (_fd >= 0 && recv(_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 1) ? c : -1;
+	}
+
+	void stop() {
+		if (_fd >= 0) {
+			::close(_fd);
+			_fd = -1;
+		}
+	}
+
+	// Open until the peer closed and everything was read
+	uint8_t connected() {
+		if (_fd < 0) {
+			return 0;
+		}
+		uint8_t c;
+		ssize_t n = recv(_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+		return n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+	}
+
+private:
+	int _fd = -1;
+};
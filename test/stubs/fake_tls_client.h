@@ -0,0 +1,167 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * Stand-in for TlsClient (tls_client.h) in the native tests, include before connection_pool.h.
+ * No TLS and no socket, so no mbedTLS code runs: the first connect counts as full handshake,
+ * later ones as resumed, only to check the bookkeeping of the pool. Every
+ * complete request is answered with the next queued response. Uses no heap, so the
+ * allocation test can run requests through it.
+ */
+#pragma once
+
+#define FAKE_TLS_MAX_RESPONSES 8
+#define FAKE_TLS_TX_LEN 2048
+
+// Server side, shared by all connections
+struct FakeServer {
+	const char* responses[FAKE_TLS_MAX_RESPONSES];	// Sent in order, one per complete request
+	int numResponses;
+	int nextResponse;
+	int handshakes;
+	int resumedHandshakes;
+	int requests;					// Complete requests the server received
+	bool dropNextRequest;			// Kept-alive socket was closed: the request is written, no response follows
+	bool refuseNextWrite;			// Socket error before anything was written
+
+	void respond(const char* response) {
+		if (numResponses < FAKE_TLS_MAX_RESPONSES) {
+			responses[numResponses++] = response;
+		}
+	}
+};
+
+FakeServer fakeServer;
+
+boolean initTls(const char* caCert) {
+	return true;
+}
+
+class TlsClient : public Client {
+public:
+	int connect(const char* host, uint16_t port) {
+		stop();
+		_open = true;
+		_resumed = _hasSession;
+		_sessionChanged = !_hasSession;
+		_hasSession = true;
+		fakeServer.handshakes++;
+		if (_resumed) {
+			fakeServer.resumedHandshakes++;
+		}
+		return 1;
+	}
+
+	size_t write(uint8_t c) {
+		return write(&c, 1);
+	}
+
+	size_t write(const uint8_t* buf, size_t size) {
+		if (!_open) {
+			return 0;
+		}
+		if (fakeServer.refuseNextWrite) {
+			fakeServer.refuseNextWrite = false;
+			_open = false;
+			return 0;
+		}
+		if (_txLen + size >= FAKE_TLS_TX_LEN) {
+			return 0;
+		}
+		memcpy(_tx + _txLen, buf, size);
+		_txLen += size;
+		_tx[_txLen] = '\0';
+		handleRequest();
+		return size;
+	}
+
+	int available() {
+		return _rx ? strlen(_rx + _rxPos) : 0;
+	}
+
+	int read() {
+		return available() > 0 ? (uint8_t)_rx[_rxPos++] : -1;
+	}
+
+	int read(uint8_t* buf, size_t size) {
+		int n = 0;
+		int c;
+		while ((size_t)n < size && (c = read()) >= 0) {
+			buf[n++] = (uint8_t)c;
+		}
+		return n > 0 ? n : -1;
+	}
+
+	int peek() {
+		return available() > 0 ? (uint8_t)_rx[_rxPos] : -1;
+	}
+
+	void stop() {
+		_open = false;
+		_txLen = 0;
+		_rx = NULL;
+		_rxPos = 0;
+	}
+
+	uint8_t connected() {
+		return _open || available() > 0;
+	}
+
+	boolean resumed() {
+		return _resumed;
+	}
+
+	boolean sessionChanged() {
+		boolean changed = _sessionChanged;
+		_sessionChanged = false;
+		return changed;
+	}
+
+private:
+	// Answer once the header and the Content-Length bytes of the body arrived
+	void handleRequest() {
+		const char* end = strstr(_tx, "\r\n\r\n");
+		if (end == NULL) {
+			return;
+		}
+		size_t length = 0;
+		const char* field = strstr(_tx, "Content-Length: ");
+		if (field != NULL && field < end) {
+			length = atoi(field + 16);
+		}
+		size_t requestLen = end + 4 - _tx + length;
+		if (_txLen < requestLen) {
+			return;
+		}
+		memmove(_tx, _tx + requestLen, _txLen - requestLen + 1);
+		_txLen -= requestLen;
+		if (fakeServer.dropNextRequest) {
+			fakeServer.dropNextRequest = false;
+			_open = false;
+			return;
+		}
+		fakeServer.requests++;
+		if (fakeServer.nextResponse < fakeServer.numResponses) {
+			_rx = fakeServer.responses[fakeServer.nextResponse++];
+			_rxPos = 0;
+		}
+	}
+
+	bool _open = false;
+	bool _hasSession = false;
+	bool _resumed = false;
+	bool _sessionChanged = false;
+	char _tx[FAKE_TLS_TX_LEN];
+	size_t _txLen = 0;
+	const char* _rx = NULL;			// Response being read
+	size_t _rxPos = 0;
+};
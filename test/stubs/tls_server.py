@@ -0,0 +1,92 @@
+"""
+Local HTTPS server for the native TLS tests (test/test_tls_client).
+
+TLS 1.2 with session tickets and HTTP/1.1 keep-alive, on 127.0.0.1 with a self-signed
+certificate for "localhost" (made with the openssl command line tool). Once it listens it
+prints "<port> <pid> <certificate file>" and runs until it gets SIGTERM.
+
+Every response body reports the handshakes the server did so far: {"full":N,"resumed":M}.
+A request to /close is answered with "Connection: close".
+"""
+
+import json
+import os
+import signal
+import socket
+import ssl
+import subprocess
+import sys
+import tempfile
+import threading
+
+stats = {"full": 0, "resumed": 0}
+lock = threading.Lock()
+
+
+def make_certificate(directory):
+    cert = os.path.join(directory, "cert.pem")
+    key = os.path.join(directory, "key.pem")
+    subprocess.run(["openssl", "req", "-x509", "-newkey", "ec", "-pkeyopt", "ec_paramgen_curve:prime256v1",
+                    "-nodes", "-days", "1", "-subj", "/CN=localhost", "-addext", "subjectAltName=DNS:localhost",
+                    "-keyout", key, "-out", cert], check=True, capture_output=True)
+    return cert, key
+
+
+def serve(conn):
+    try:
+        conn.do_handshake()
+        with lock:
+            stats["resumed" if conn.session_reused else "full"] += 1
+        requests = conn.makefile("rb")
+        while True:
+            line = requests.readline()
+            if not line:
+                break
+            path = line.split()[1].decode()
+            length = 0
+            while True:
+                header = requests.readline()
+                if header in (b"\r\n", b""):
+                    break
+                name, _, value = header.decode().partition(":")
+                if name.strip().lower() == "content-length":
+                    length = int(value)
+            requests.read(length)
+
+            close = (path == "/close")
+            with lock:
+                body = json.dumps(stats, separators=(",", ":")).encode()
+            head = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %d\r\n" % len(body)
+            if close:
+                head += "Connection: close\r\n"
+            conn.sendall(head.encode() + b"\r\n" + body)
+            if close:
+                break
+    except (OSError, ValueError, IndexError):
+        pass
+    finally:
+        conn.close()
+
+
+def main():
+    signal.signal(signal.SIGTERM, lambda signum, frame: sys.exit(0))
+    with tempfile.TemporaryDirectory() as directory:
+        cert, key = make_certificate(directory)
+        context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        context.maximum_version = ssl.TLSVersion.TLSv1_2
+        context.load_cert_chain(cert, key)
+
+        listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        listener.bind(("127.0.0.1", 0))
+        listener.listen(8)
+        print(listener.getsockname()[1], os.getpid(), cert, flush=True)
+
+        while True:
+            sock, _ = listener.accept()
+            conn = context.wrap_socket(sock, server_side=True, do_handshake_on_connect=False)
+            threading.Thread(target=serve, args=(conn,), daemon=True).start()
+
+
+if __name__ == "__main__":
+    main()
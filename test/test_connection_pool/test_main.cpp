@@ -0,0 +1,180 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * HTTP logic of the connection pool (connection_pool.h) on a stand-in for TlsClient that
+ * answers with canned responses: keep-alive reuse, idle timeout, closing idle connections,
+ * and which requests are repeated after the server dropped a kept-alive socket.
+ * No TLS runs here, the stand-in only counts its connects. The real TLS client and session
+ * resumption are tested against a local TLS server in test/test_tls_client.
+ */
+#include <Arduino.h>
+#include <unity.h>
+
+#define VERSION "test"
+#define DISABLECERTCHECK
+#define DBG_PRINT(x) Serial.print(x)
+#define DBG_PRINTLN(x) Serial.println(x)
+
+#define RESPONSE_OK "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\n{}"
+#define RESPONSE_CLOSE "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\n{}"
+#define RESPONSE_CHUNKED "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n2\r\n{}\r\n0\r\n\r\n"
+
+#include "fake_tls_client.h"
+#include "connection_pool.h"
+
+PooledConnection* graph;
+
+// Request and read the body like requestJsonApiLocked(), returns the status or 0 if the request failed
+int request(const char* method, const char* payload = NULL) {
+	HttpResponseHeaders headers;
+	if (!poolRequest(graph, method, "/v1.0/me/presence", payload, "token", headers)) {
+		return 0;
+	}
+	HttpBodyStream body(graph->client, headers);
+	char content[8];
+	size_t len = 0;
+	int c;
+	while ((c = body.read()) >= 0 && len < sizeof(content) - 1) {
+		content[len++] = (char)c;
+	}
+	content[len] = '\0';
+	poolRelease(graph, body, headers);
+	return (strcmp(content, "{}") == 0) ? headers.status : -1;
+}
+
+void setUp() {
+	for (int i = 0; i < POOL_SIZE; i++) {
+		connectionPool[i] = PooledConnection();
+	}
+	initConnectionPool();
+	const char* path;
+	graph = getPooledConnection("https://graph.microsoft.com/v1.0/me/presence", &path);
+	fakeServer = FakeServer();
+	stubMillis = 1000;
+}
+
+void tearDown() {}
+
+void test_keepalive_reuses_connection() {
+	for (int i = 0; i < 5; i++) {
+		fakeServer.respond(RESPONSE_OK);
+		TEST_ASSERT_EQUAL_INT(200, request("GET"));
+		stubMillis += 1000;
+	}
+	TEST_ASSERT_EQUAL_INT(1, fakeServer.handshakes);
+	TEST_ASSERT_EQUAL_UINT(1, graph->fullHandshakes);
+	TEST_ASSERT_EQUAL_UINT(5, graph->requests);
+}
+
+void test_chunked_body_keeps_connection() {
+	fakeServer.respond(RESPONSE_CHUNKED);
+	fakeServer.respond(RESPONSE_OK);
+	TEST_ASSERT_EQUAL_INT(200, request("GET"));
+	TEST_ASSERT_EQUAL_INT(200, request("GET"));
+	TEST_ASSERT_EQUAL_INT(1, fakeServer.handshakes);
+}
+
+void test_connection_close_reconnects() {
+	fakeServer.respond(RESPONSE_CLOSE);
+	fakeServer.respond(RESPONSE_OK);
+	TEST_ASSERT_EQUAL_INT(200, request("GET"));
+	TEST_ASSERT_FALSE(graph->client.connected());
+	TEST_ASSERT_EQUAL_INT(200, request("GET"));
+	TEST_ASSERT_EQUAL_INT(2, fakeServer.handshakes);
+	TEST_ASSERT_EQUAL_UINT(1, graph->resumedHandshakes);
+}
+
+// A connection idle for longer than POOL_IDLE_TIMEOUT is not used anymore, the session is resumed
+void test_idle_timeout_reconnects() {
+	fakeServer.respond(RESPONSE_OK);
+	fakeServer.respond(RESPONSE_OK);
+	TEST_ASSERT_EQUAL_INT(200, request("GET"));
+	stubMillis += POOL_IDLE_TIMEOUT + 1;
+	TEST_ASSERT_EQUAL_INT(200, request("GET"));
+	TEST_ASSERT_EQUAL_INT(2, fakeServer.handshakes);
+	TEST_ASSERT_EQUAL_INT(1, fakeServer.resumedHandshakes);
+	TEST_ASSERT_EQUAL_UINT(1, graph->fullHandshakes);
+	TEST_ASSERT_EQUAL_UINT(1, graph->resumedHandshakes);
+}
+
+void test_reap_closes_idle_connection() {
+	TEST_ASSERT_EQUAL_UINT32(0, reapIdleConnections());
+
+	fakeServer.respond(RESPONSE_OK);
+	TEST_ASSERT_EQUAL_INT(200, request("GET"));
+	stubMillis += 10000;
+	TEST_ASSERT_EQUAL_UINT32(POOL_IDLE_TIMEOUT - 10000 + 1, reapIdleConnections());
+	TEST_ASSERT_TRUE(graph->client.connected());
+
+	stubMillis += POOL_IDLE_TIMEOUT - 10000 + 1;
+	TEST_ASSERT_EQUAL_UINT32(0, reapIdleConnections());
+	TEST_ASSERT_FALSE(graph->client.connected());
+	TEST_ASSERT_FALSE(connectionPool[POOL_HOST_LOGIN].client.connected());
+}
+
+// The server dropped the kept-alive socket, a GET can safely be sent again
+void test_dropped_get_is_repeated() {
+	fakeServer.respond(RESPONSE_OK);
+	fakeServer.respond(RESPONSE_OK);
+	TEST_ASSERT_EQUAL_INT(200, request("GET"));
+	fakeServer.dropNextRequest = true;
+	TEST_ASSERT_EQUAL_INT(200, request("GET"));
+	TEST_ASSERT_EQUAL_INT(2, fakeServer.handshakes);
+	TEST_ASSERT_EQUAL_INT(2, fakeServer.requests);
+}
+
+// The POST went out, the server may have run it: not repeated, the caller retries later
+void test_dropped_post_is_not_repeated() {
+	fakeServer.respond(RESPONSE_OK);
+	fakeServer.respond(RESPONSE_OK);
+	TEST_ASSERT_EQUAL_INT(200, request("GET"));
+	fakeServer.dropNextRequest = true;
+	TEST_ASSERT_EQUAL_INT(0, request("POST", "grant_type=refresh_token"));
+	TEST_ASSERT_EQUAL_INT(1, fakeServer.handshakes);
+
+	// Next request connects again
+	TEST_ASSERT_EQUAL_INT(200, request("POST", "grant_type=refresh_token"));
+	TEST_ASSERT_EQUAL_INT(2, fakeServer.handshakes);
+}
+
+// Nothing of the POST was written, it is repeated on a fresh connection
+void test_unsent_post_is_repeated() {
+	fakeServer.respond(RESPONSE_OK);
+	fakeServer.respond(RESPONSE_OK);
+	TEST_ASSERT_EQUAL_INT(200, request("GET"));
+	fakeServer.refuseNextWrite = true;
+	TEST_ASSERT_EQUAL_INT(200, request("POST", "{\"ids\": []}"));
+	TEST_ASSERT_EQUAL_INT(2, fakeServer.handshakes);
+	TEST_ASSERT_EQUAL_INT(2, fakeServer.requests);
+}
+
+// A request failing on a fresh connection is not repeated
+void test_fresh_connection_is_not_repeated() {
+	fakeServer.refuseNextWrite = true;
+	TEST_ASSERT_EQUAL_INT(0, request("GET"));
+	TEST_ASSERT_EQUAL_INT(1, fakeServer.handshakes);
+}
+
+int main(int argc, char** argv) {
+	UNITY_BEGIN();
+	RUN_TEST(test_keepalive_reuses_connection);
+	RUN_TEST(test_chunked_body_keeps_connection);
+	RUN_TEST(test_connection_close_reconnects);
+	RUN_TEST(test_idle_timeout_reconnects);
+	RUN_TEST(test_reap_closes_idle_connection);
+	RUN_TEST(test_dropped_get_is_repeated);
+	RUN_TEST(test_dropped_post_is_not_repeated);
+	RUN_TEST(test_unsent_post_is_repeated);
+	RUN_TEST(test_fresh_connection_is_not_repeated);
+	return UNITY_END();
+}
@@ -0,0 +1,183 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * Heap allocations of a presence poll on a kept-alive connection: request, response headers,
+ * filtered parsing from the body stream and mapping to PRESENCE_* ids, for the own presence
+ * (GET me/presence) and the users (POST getPresencesByUserId). TLS is the stand-in of
+ * fake_tls_client.h, mbedTLS and lwIP are not covered.
+ * malloc is counted by replacing it (glibc only), operator new ends up there as well.
+ */
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <unity.h>
+
+#define VERSION "test"
+#define DISABLECERTCHECK
+#define DBG_PRINT(x) Serial.print(x)
+#define DBG_PRINTLN(x) Serial.println(x)
+#define POLL_ROUNDS 10
+
+#include "fake_tls_client.h"
+#include "connection_pool.h"
+#include "graph_presence.h"
+#include "user_presence.h"
+
+bool countAllocations = false;
+size_t allocations = 0;
+
+#ifdef __GLIBC__
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void __libc_free(void* ptr);
+}
+
+extern "C" void* malloc(size_t size) {
+	allocations += countAllocations;
+	return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+	allocations += countAllocations;
+	return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size) {
+	allocations += countAllocations;
+	return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void* ptr) {
+	__libc_free(ptr);
+}
+#endif
+
+const char* ownResponse =
+	"HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nTransfer-Encoding: chunked\r\n\r\n"
+	"C1\r\n{\"@odata.context\":\"https://graph.microsoft.com/v1.0/$metadata#users('fa8bf3dc-eca7-46b7-bad1-db199b62afc3')/presence/$entity\","
+	"\"id\":\"fa8bf3dc-eca7-46b7-bad1-db199b62afc3\",\"availability\":\"Busy\",\"\r\n"
+	"29\r\nactivity\":\"InACall\",\"statusMessage\":null}\r\n0\r\n\r\n";
+
+const char* usersResponse =
+	"HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: 207\r\n\r\n"
+	"{\"value\":[{\"@odata.type\":\"#microsoft.graph.presence\",\"id\":\"66825e03-7ef5-42da-9069-724602c31f6b\","
+	"\"availability\":\"Away\",\"activity\":\"BeRightBack\",\"outOfOfficeSettings\":{\"message\":null,\"isOutOfOffice\":false}}]}";
+
+char access_token[] = "eyJ0eXAiOiJKV1QiLCJhbGciOiJSUzI1NiJ9.test";
+PooledConnection* graph;
+const char ids[2][USER_ID_LEN] = { "66825e03-7ef5-42da-9069-724602c31f6b", "0a1b2c3d-4e5f-4a6b-8c7d-9e0f1a2b3c4d" };
+
+// Like pollOwnPresence() and requestJsonApiLocked()
+uint8_t pollOwn() {
+	StaticJsonDocument<PRESENCE_FILTER_CAPACITY> filter;
+	setPresenceFilter(filter);
+	StaticJsonDocument<PRESENCE_RESPONSE_CAPACITY> responseDoc;
+	HttpResponseHeaders headers;
+	if (!poolRequest(graph, "GET", "/v1.0/me/presence", NULL, access_token, headers)) {
+		return 0xFF;
+	}
+	HttpBodyStream body(graph->client, headers);
+	DeserializationError error = deserializeJson(responseDoc, body, DeserializationOption::Filter(filter));
+	poolRelease(graph, body, headers);
+	return error ? 0xFF : getPresenceId(responseDoc["activity"] | "");
+}
+
+// Like pollUserPresences()
+uint8_t pollUsers() {
+	static char payload[USER_PRESENCE_PAYLOAD_LEN];
+	StaticJsonDocument<USER_PRESENCE_FILTER_CAPACITY> filter;
+	setUserPresenceFilter(filter);
+	StaticJsonDocument<USER_PRESENCE_RESPONSE_CAPACITY> responseDoc;
+	HttpResponseHeaders headers;
+	if (!poolRequest(graph, "POST", "/v1.0/communications/getPresencesByUserId", getUserPresencePayload(payload, sizeof(payload), ids, 2), access_token, headers)) {
+		return 0xFF;
+	}
+	HttpBodyStream body(graph->client, headers);
+	DeserializationError error = deserializeJson(responseDoc, body, DeserializationOption::Filter(filter));
+	poolRelease(graph, body, headers);
+	uint8_t availabilityIds[2];
+	uint8_t activityIds[2];
+	parseUserPresences(responseDoc["value"].as<JsonArrayConst>(), ids, 2, availabilityIds, activityIds);
+	return (error || availabilityIds[1] != USER_PRESENCE_MISSING) ? 0xFF : activityIds[0];
+}
+
+void setUp() {
+	#ifndef __GLIBC__
+	TEST_IGNORE_MESSAGE("malloc can only be counted with glibc");
+	#endif
+	initConnectionPool();
+	const char* path;
+	graph = getPooledConnection("https://graph.microsoft.com/v1.0/me/presence", &path);
+	fakeServer = FakeServer();
+}
+
+void tearDown() {
+	countAllocations = false;
+}
+
+// The counter sees what the poll used to do
+void test_counter_sees_allocations() {
+	countAllocations = true;
+	DynamicJsonDocument doc(1024);
+	deserializeJson(doc, "{\"availability\":\"Busy\"}");
+	countAllocations = false;
+	TEST_ASSERT_GREATER_THAN(0, allocations);
+}
+
+void test_poll_own_presence_allocates_nothing() {
+	for (int i = 0; i <= POLL_ROUNDS; i++) {
+		fakeServer.respond(ownResponse);
+	}
+	// First poll connects, on the device that allocates the TLS context
+	TEST_ASSERT_EQUAL_UINT8(PRESENCE_INACALL, pollOwn());
+	fakeServer.nextResponse = fakeServer.numResponses = 0;
+
+	allocations = 0;
+	countAllocations = true;
+	uint8_t activity = PRESENCE_NONE;
+	for (int i = 0; i < POLL_ROUNDS; i++) {
+		fakeServer.respond(ownResponse);
+		activity = pollOwn();
+	}
+	countAllocations = false;
+	TEST_ASSERT_EQUAL_UINT8(PRESENCE_INACALL, activity);
+	TEST_ASSERT_EQUAL_INT(1, fakeServer.handshakes);
+	TEST_ASSERT_EQUAL_UINT32(0, allocations);
+}
+
+void test_poll_users_allocates_nothing() {
+	fakeServer.respond(usersResponse);
+	TEST_ASSERT_EQUAL_UINT8(PRESENCE_BERIGHTBACK, pollUsers());
+	fakeServer.nextResponse = fakeServer.numResponses = 0;
+
+	allocations = 0;
+	countAllocations = true;
+	uint8_t activity = PRESENCE_NONE;
+	for (int i = 0; i < POLL_ROUNDS; i++) {
+		fakeServer.respond(usersResponse);
+		activity = pollUsers();
+	}
+	countAllocations = false;
+	TEST_ASSERT_EQUAL_UINT8(PRESENCE_BERIGHTBACK, activity);
+	TEST_ASSERT_EQUAL_INT(1, fakeServer.handshakes);
+	TEST_ASSERT_EQUAL_UINT32(0, allocations);
+}
+
+int main(int argc, char** argv) {
+	UNITY_BEGIN();
+	RUN_TEST(test_counter_sees_allocations);
+	RUN_TEST(test_poll_own_presence_allocates_nothing);
+	RUN_TEST(test_poll_users_allocates_nothing);
+	return UNITY_END();
+}
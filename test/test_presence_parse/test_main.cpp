@@ -0,0 +1,126 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * me/presence parsing (graph_presence.h): the filtered fixed document keeps what the
+ * poll needs, and a benchmark against the unfiltered 1 KB DynamicJsonDocument it replaced.
+ * The benchmark only reports, host timings say little about the ESP32.
+ */
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <unity.h>
+#include <chrono>
+#include "graph_presence.h"
+
+#define BENCH_ROUNDS 20000
+#define UNFILTERED_CAPACITY 1024		// Document size of the unfiltered parser
+
+const char* presenceResponse =
+	"{\"@odata.context\":\"https://graph.microsoft.com/v1.0/$metadata#users('fa8bf3dc-eca7-46b7-bad1-db199b62afc3')/presence/$entity\","
+	"\"id\":\"fa8bf3dc-eca7-46b7-bad1-db199b62afc3\",\"availability\":\"Busy\",\"activity\":\"InAConferenceCall\","
+	"\"statusMessage\":null,\"outOfOfficeSettings\":{\"message\":null,\"isOutOfOffice\":false},"
+	"\"sequenceNumber\":\"C2D3B1A5E7F94E0B8C6D\"}";
+
+const char* errorResponse =
+	"{\"error\":{\"code\":\"InvalidAuthenticationToken\",\"message\":\"Access token has expired or is not yet valid.\","
+	"\"innerError\":{\"date\":\"2020-11-02T10:00:00\",\"request-id\":\"4a2d6c1e-3f5b-4e7a-9c8d-1b2a3c4d5e6f\","
+	"\"client-request-id\":\"4a2d6c1e-3f5b-4e7a-9c8d-1b2a3c4d5e6f\"}}}";
+
+StaticJsonDocument<PRESENCE_FILTER_CAPACITY> filter;
+StaticJsonDocument<PRESENCE_RESPONSE_CAPACITY> filtered;
+
+DeserializationError parseFiltered(const char* json) {
+	return deserializeJson(filtered, json, DeserializationOption::Filter(filter));
+}
+
+void setUp() {
+	filter.clear();
+	setPresenceFilter(filter);
+}
+
+void tearDown() {}
+
+void test_filter_fits() {
+	TEST_ASSERT_FALSE(filter.overflowed());
+}
+
+void test_filtered_keeps_presence() {
+	TEST_ASSERT_TRUE(parseFiltered(presenceResponse) == DeserializationError::Ok);
+	TEST_ASSERT_FALSE(filtered.overflowed());
+	TEST_ASSERT_EQUAL_STRING("Busy", filtered["availability"] | "");
+	TEST_ASSERT_EQUAL_STRING("InAConferenceCall", filtered["activity"] | "");
+	TEST_ASSERT_EQUAL_UINT8(PRESENCE_BUSY, getPresenceId(filtered["availability"].as<const char*>()));
+	TEST_ASSERT_EQUAL_UINT8(PRESENCE_INACONFERENCECALL, getPresenceId(filtered["activity"].as<const char*>()));
+	TEST_ASSERT_FALSE(filtered.containsKey("id"));
+	TEST_ASSERT_FALSE(filtered.containsKey("@odata.context"));
+	TEST_ASSERT_FALSE(filtered.containsKey("outOfOfficeSettings"));
+	TEST_ASSERT_EQUAL_size_t(2, filtered.size());
+}
+
+void test_filtered_keeps_error_code() {
+	TEST_ASSERT_TRUE(parseFiltered(errorResponse) == DeserializationError::Ok);
+	TEST_ASSERT_FALSE(filtered.overflowed());
+	TEST_ASSERT_EQUAL_STRING("InvalidAuthenticationToken", filtered["error"]["code"] | "");
+	TEST_ASSERT_FALSE(filtered["error"].containsKey("message"));
+	TEST_ASSERT_FALSE(filtered["error"].containsKey("innerError"));
+}
+
+// Longest names Graph sends still fit into the fixed document
+void test_longest_names_fit() {
+	char json[160];
+	snprintf(json, sizeof(json), "{\"availability\":\"%s\",\"activity\":\"%s\"}",
+		presenceNames[PRESENCE_URGENTINTERRUPTIONSONLY], presenceNames[PRESENCE_URGENTINTERRUPTIONSONLY]);
+	TEST_ASSERT_TRUE(parseFiltered(json) == DeserializationError::Ok);
+	TEST_ASSERT_FALSE(filtered.overflowed());
+	TEST_ASSERT_EQUAL_UINT8(PRESENCE_URGENTINTERRUPTIONSONLY, getPresenceId(filtered["activity"].as<const char*>()));
+}
+
+template <typename F>
+double nsPerParse(F parse) {
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < BENCH_ROUNDS; i++) {
+		parse();
+	}
+	auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	return (double)ns / BENCH_ROUNDS;
+}
+
+void test_benchmark() {
+	volatile uint8_t sink = 0;
+	size_t unfilteredUsage = 0;
+	double unfilteredNs = nsPerParse([&]() {
+		DynamicJsonDocument doc(UNFILTERED_CAPACITY);
+		deserializeJson(doc, presenceResponse);
+		sink += getPresenceId(doc["activity"].as<const char*>());
+		unfilteredUsage = doc.memoryUsage();
+	});
+	double filteredNs = nsPerParse([&]() {
+		parseFiltered(presenceResponse);
+		sink += getPresenceId(filtered["activity"].as<const char*>());
+	});
+
+	char msg[160];
+	snprintf(msg, sizeof(msg), "unfiltered: %.0f ns, %u of %u bytes (heap) / filtered: %.0f ns, %u of %u bytes (stack) (host)",
+		unfilteredNs, (unsigned)unfilteredUsage, UNFILTERED_CAPACITY, filteredNs, (unsigned)filtered.memoryUsage(), (unsigned)PRESENCE_RESPONSE_CAPACITY);
+	TEST_MESSAGE(msg);
+	TEST_ASSERT_LESS_THAN(unfilteredUsage, filtered.memoryUsage());
+}
+
+int main(int argc, char** argv) {
+	UNITY_BEGIN();
+	RUN_TEST(test_filter_fits);
+	RUN_TEST(test_filtered_keeps_presence);
+	RUN_TEST(test_filtered_keeps_error_code);
+	RUN_TEST(test_longest_names_fit);
+	RUN_TEST(test_benchmark);
+	return UNITY_END();
+}
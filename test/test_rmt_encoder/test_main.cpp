@@ -0,0 +1,158 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * RMT encoder (rmt_encoder.h): golden test against the per-bit encoder the table replaced,
+ * for all 256 byte values and the wanted_num limits the RMT driver uses, plus a benchmark.
+ * The benchmark only reports, host timings say little about the ESP32.
+ */
+#include <unity.h>
+#include <chrono>
+#include <stdio.h>
+#include <vector>
+#include "rmt_encoder.h"
+
+#define BENCH_PIXELS 300			// Bytes per frame: 3 per pixel + reset
+#define BENCH_ROUNDS 2000
+
+// Same layout as rmt_item32_t of the IDF
+union RefItem {
+	struct {
+		uint32_t duration0 : 15;
+		uint32_t level0 : 1;
+		uint32_t duration1 : 15;
+		uint32_t level1 : 1;
+	};
+	uint32_t val;
+};
+
+// The per-bit encoder that was replaced by the table
+void refEncode(const uint8_t* psrc, RefItem* pdest, size_t src_size, size_t wanted_num, size_t* translated_size, size_t* item_num) {
+	RefItem bit0, bit1, reset;
+	bit0.duration0 = T1_TICKS; bit0.level0 = 1; bit0.duration1 = T2_TICKS + T3_TICKS; bit0.level1 = 0;
+	bit1.duration0 = T1_TICKS + T2_TICKS; bit1.level0 = 1; bit1.duration1 = T3_TICKS; bit1.level1 = 0;
+	reset.duration0 = RESET_TICKS / 2; reset.level0 = 0; reset.duration1 = RESET_TICKS / 2; reset.level1 = 0;
+	size_t size = 0;
+	size_t num = 0;
+	while (size < src_size && num < wanted_num) {
+		if (size < src_size - 1) {
+			for (uint8_t mask = 0x80; mask != 0; mask >>= 1) {
+				(pdest++)->val = (*psrc & mask) ? bit1.val : bit0.val;
+			}
+			num += 8;
+		} else {
+			(pdest++)->val = reset.val;
+			num++;
+		}
+		size++;
+		psrc++;
+	}
+	*translated_size = size;
+	*item_num = num;
+}
+
+void setUp() {}
+void tearDown() {}
+
+// Encode src with both encoders and compare everything they return
+void checkSame(const uint8_t* src, size_t srcSize, size_t wantedNum, const char* what) {
+	std::vector<uint32_t> lut(srcSize * 8 + 8, 0xDEADBEEF);
+	std::vector<RefItem> ref(srcSize * 8 + 8);
+	for (RefItem& item : ref) {
+		item.val = 0xDEADBEEF;
+	}
+	size_t lutSize, lutNum, refSize, refNum;
+	rmt_encode_bytes(src, lut.data(), srcSize, wantedNum, &lutSize, &lutNum);
+	refEncode(src, ref.data(), srcSize, wantedNum, &refSize, &refNum);
+
+	TEST_ASSERT_EQUAL_UINT32_MESSAGE(refSize, lutSize, what);
+	TEST_ASSERT_EQUAL_UINT32_MESSAGE(refNum, lutNum, what);
+	for (size_t i = 0; i < lut.size(); i++) {
+		TEST_ASSERT_EQUAL_UINT32_MESSAGE(ref[i].val, lut[i], what);
+	}
+}
+
+// Bit layout of the raw values matches the bitfields of the item
+void test_item_values() {
+	RefItem item;
+	item.val = RMT_BIT1;
+	TEST_ASSERT_EQUAL_UINT32(T1_TICKS + T2_TICKS, item.duration0);
+	TEST_ASSERT_EQUAL_UINT32(1, item.level0);
+	TEST_ASSERT_EQUAL_UINT32(T3_TICKS, item.duration1);
+	TEST_ASSERT_EQUAL_UINT32(0, item.level1);
+	item.val = RMT_RESET;
+	TEST_ASSERT_EQUAL_UINT32(RESET_TICKS / 2, item.duration0);
+	TEST_ASSERT_EQUAL_UINT32(0, item.level0);
+}
+
+// Every byte value, followed by the reset byte
+void test_all_bytes() {
+	for (int value = 0; value < 256; value++) {
+		uint8_t src[2] = { (uint8_t)value, 0 };
+		char what[16];
+		snprintf(what, sizeof(what), "byte 0x%02X", value);
+		checkSame(src, sizeof(src), 64, what);
+	}
+}
+
+// The driver hands over one RMT memory block (64 items) at a time, limits cut between bytes
+void test_wanted_num_limits() {
+	uint8_t src[49];
+	for (size_t i = 0; i < sizeof(src); i++) {
+		src[i] = (uint8_t)(i * 37 + 11);
+	}
+	const size_t limits[] = { 0, 1, 7, 8, 9, 32, 63, 64, 65, 384, 385, 1000 };
+	for (size_t wanted : limits) {
+		char what[24];
+		snprintf(what, sizeof(what), "wanted_num %u", (unsigned)wanted);
+		checkSame(src, sizeof(src), wanted, what);
+	}
+	checkSame(src, 1, 64, "reset only");
+	checkSame(src, 0, 64, "empty");
+}
+
+template <typename F>
+double nsPerByte(F encode) {
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < BENCH_ROUNDS; i++) {
+		encode();
+	}
+	auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	return (double)ns / BENCH_ROUNDS / (BENCH_PIXELS * 3 + 1);
+}
+
+void test_benchmark() {
+	static uint8_t src[BENCH_PIXELS * 3 + 1];
+	static uint32_t lut[sizeof(src) * 8];
+	static RefItem ref[sizeof(src) * 8];
+	for (size_t i = 0; i < sizeof(src); i++) {
+		src[i] = (uint8_t)(i * 131 + 7);
+	}
+	size_t size, num;
+	volatile uint32_t sink = 0;
+	double refNs = nsPerByte([&]() { refEncode(src, ref, sizeof(src), sizeof(ref) / sizeof(ref[0]), &size, &num); sink += ref[num / 2].val; });
+	double lutNs = nsPerByte([&]() { rmt_encode_bytes(src, lut, sizeof(src), sizeof(lut) / sizeof(lut[0]), &size, &num); sink += lut[num / 2]; });
+
+	char msg[96];
+	snprintf(msg, sizeof(msg), "per-bit: %.2f ns/byte, table: %.2f ns/byte (host)", refNs, lutNs);
+	TEST_MESSAGE(msg);
+	TEST_ASSERT_EQUAL_UINT32(sizeof(src) * 8 - 7, num);
+}
+
+int main(int argc, char** argv) {
+	UNITY_BEGIN();
+	RUN_TEST(test_item_values);
+	RUN_TEST(test_all_bytes);
+	RUN_TEST(test_wanted_num_limits);
+	RUN_TEST(test_benchmark);
+	return UNITY_END();
+}
@@ -0,0 +1,418 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * Peak heap of the status page (root_page.h), streamed from flash templates, compared to the
+ * page built in one String like before (handleRootBaseline(), copied from the old
+ * request_handler.h). The String stand-in grows like the one of the ESP32 core: by realloc in
+ * 16 byte steps, up to 11 characters are kept inline. The WebServer stand-in builds the response
+ * header in a String like the ESP32 one and writes everything to a buffer, lwIP is not covered.
+ * malloc is tracked by replacing it (glibc only), a realloc that moves counts old and new block.
+ */
+#include <Arduino.h>
+#include <unity.h>
+#include <malloc.h>
+
+#define VERSION "test"
+#define DBG_PRINTLN(x) Serial.println(x)
+#define CONTENT_LENGTH_UNKNOWN ((size_t)-1)
+#define STRING_LEN 128
+#define INTEGER_LEN 16
+
+bool trackHeap = false;
+size_t heapUsed = 0;
+size_t heapPeak = 0;
+
+#ifdef __GLIBC__
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void __libc_free(void* ptr);
+}
+
+void addHeap(size_t size) {
+	heapUsed += size;
+	heapPeak = max(heapPeak, heapUsed);
+}
+
+extern "C" void* malloc(size_t size) {
+	void* ptr = __libc_malloc(size);
+	if (trackHeap && ptr) {
+		addHeap(malloc_usable_size(ptr));
+	}
+	return ptr;
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+	void* ptr = __libc_calloc(count, size);
+	if (trackHeap && ptr) {
+		addHeap(malloc_usable_size(ptr));
+	}
+	return ptr;
+}
+
+extern "C" void* realloc(void* ptr, size_t size) {
+	size_t oldSize = ptr ? malloc_usable_size(ptr) : 0;
+	void* newPtr = __libc_realloc(ptr, size);
+	if (trackHeap && newPtr) {
+		if (newPtr != ptr) {
+			// Old and new block existed at the same time while copying
+			addHeap(malloc_usable_size(newPtr));
+			heapUsed -= oldSize;
+		} else {
+			heapUsed -= oldSize;
+			addHeap(malloc_usable_size(newPtr));
+		}
+	}
+	return newPtr;
+}
+
+extern "C" void free(void* ptr) {
+	if (trackHeap && ptr) {
+		heapUsed -= malloc_usable_size(ptr);
+	}
+	__libc_free(ptr);
+}
+#endif
+
+// Like WString of the ESP32 core
+class StringSumHelper;
+
+class String {
+public:
+	String(const char* cstr = "") {
+		concat(cstr, strlen(cstr));
+	}
+	String(const String& other) {
+		concat(other.c_str(), other._len);
+	}
+	explicit String(unsigned long value) {
+		char buf[12];
+		snprintf(buf, sizeof(buf), "%lu", value);
+		concat(buf, strlen(buf));
+	}
+	explicit String(uint32_t value) : String((unsigned long)value) {}
+	explicit String(int value) : String((unsigned long)value) {}
+	~String() {
+		free(_buffer);
+	}
+
+	const char* c_str() const {
+		return _buffer ? _buffer : _sso;
+	}
+	size_t length() const {
+		return _len;
+	}
+
+	String& operator+=(const char* cstr) {
+		concat(cstr, strlen(cstr));
+		return *this;
+	}
+	String& operator+=(const String& other) {
+		concat(other.c_str(), other._len);
+		return *this;
+	}
+	friend StringSumHelper& operator+(const StringSumHelper& lhs, const String& rhs);
+	friend StringSumHelper& operator+(const StringSumHelper& lhs, const char* cstr);
+
+protected:
+	void concat(const char* cstr, size_t len) {
+		if (!reserve(_len + len)) {
+			return;
+		}
+		memmove((char*)c_str() + _len, cstr, len);
+		_len += len;
+		((char*)c_str())[_len] = '\0';
+	}
+
+	bool reserve(size_t size) {
+		if (size < sizeof(_sso) && !_buffer) {
+			return true;
+		}
+		if (_buffer && size < _capacity) {
+			return true;
+		}
+		size_t capacity = (size + 16) & ~(size_t)0xf;
+		char* buffer = (char*)realloc(_buffer, capacity);
+		if (!buffer) {
+			return false;
+		}
+		if (!_buffer) {
+			memcpy(buffer, _sso, _len + 1);
+		}
+		_buffer = buffer;
+		_capacity = capacity;
+		return true;
+	}
+
+	char _sso[12] = "";
+	char* _buffer = NULL;
+	size_t _capacity = 0;
+	size_t _len = 0;
+};
+
+class StringSumHelper : public String {
+public:
+	StringSumHelper(const String& s) : String(s) {}
+	StringSumHelper(const char* cstr) : String(cstr) {}
+};
+
+StringSumHelper& operator+(const StringSumHelper& lhs, const String& rhs) {
+	StringSumHelper& a = const_cast<StringSumHelper&>(lhs);
+	a.concat(rhs.c_str(), rhs._len);
+	return a;
+}
+
+StringSumHelper& operator+(const StringSumHelper& lhs, const char* cstr) {
+	StringSumHelper& a = const_cast<StringSumHelper&>(lhs);
+	a.concat(cstr, strlen(cstr));
+	return a;
+}
+
+// Like WebServer of the ESP32 core, the client writes go to page
+char page[16384];
+size_t pageLen = 0;
+
+class StubWebServer {
+public:
+	void setContentLength(size_t length) {
+		_contentLength = length;
+	}
+
+	void send(int code, const char* contentType, const String& content) {
+		String header = "HTTP/1.1 ";
+		header += String(code);
+		header += " OK\r\nContent-Type: ";
+		header += contentType;
+		if (_contentLength == CONTENT_LENGTH_UNKNOWN) {
+			header += "\r\nTransfer-Encoding: chunked";
+		} else {
+			header += "\r\nContent-Length: ";
+			header += String((uint32_t)content.length());
+		}
+		header += "\r\nConnection: close\r\n\r\n";
+		write(header.c_str(), header.length());
+		write(content.c_str(), content.length());
+	}
+
+	void sendContent(const char* content) {
+		write(content, strlen(content));
+	}
+
+	void sendContent_P(PGM_P content) {
+		write(content, strlen_P(content));
+	}
+
+	void write(const char* data, size_t len) {
+		len = min(len, sizeof(page) - pageLen);
+		memcpy(page + pageLen, data, len);
+		pageLen += len;
+	}
+
+private:
+	size_t _contentLength = 0;
+};
+
+struct StubEsp {
+	uint32_t getFreeHeap() {
+		return 327680 - heapUsed;
+	}
+	uint32_t getFreeSketchSpace() {
+		return 1966080;
+	}
+	uint32_t getSketchSize() {
+		return 1048576;
+	}
+};
+
+struct StubIotWebConf {
+	bool handleCaptivePortal() {
+		return false;
+	}
+};
+
+StubWebServer server;
+StubEsp ESP;
+StubIotWebConf iotWebConf;
+char paramClientIdValue[STRING_LEN] = "3837bbf0-30fb-47ad-bce8-f460ba9880c3";
+char paramTenantValue[STRING_LEN] = "contoso.onmicrosoft.com";
+char paramPollIntervalValue[INTEGER_LEN] = "30";
+char paramNumLedsValue[INTEGER_LEN] = "16";
+char access_token[] = "eyJ0eXAiOiJKV1QiLCJhbGciOiJSUzI1NiJ9.test";
+bool powerSave = false;
+
+#include "web_assets.h"
+#include "root_page.h"
+
+// handleRoot() before the page was streamed, access_token was a String then
+void handleRootBaseline() {
+	DBG_PRINTLN("handleRoot()");
+	// -- Let IotWebConf test and handle captive portal requests.
+	if (iotWebConf.handleCaptivePortal()) { return; }
+
+	String s = "<!DOCTYPE html>\n<html lang=\"en\">\n<head><meta name=\"viewport\" content=\"width=device-width, initial-scale=1, user-scalable=no\"/>";
+	s += "<link href=\"https://fonts.googleapis.com/css?family=Press+Start+2P\" rel=\"stylesheet\">";
+	s += "<link href=\"https://unpkg.com/nes.css@2.3.0/css/nes.min.css\" rel=\"stylesheet\" />";
+	s += "<style type=\"text/css\">\n";
+	s += "  body {padding:3.5rem}\n";
+	s += "  .ml-s {margin-left:1.0rem}\n";
+	s += "  .mt-s {margin-top:1.0rem}\n";
+	s += "  .mt {margin-top:3.5rem}\n";
+	s += "  #dialog-devicelogin {max-width:800px}\n";
+	s += "</style>\n";
+	s += "<script>\n";
+	s += "function closeDeviceLoginModal() {\n";
+	s += "  document.getElementById('dialog-devicelogin').close();\n";
+	s += "}\n";
+	s += "function performClearSettings() {\n";
+	s += "  fetch('/api/clearSettings').then(r => r.json()).then(data => {\n";
+	s += "    console.log('clearSettings', data);\n";
+	s += "    document.getElementById('dialog-clearsettings').close();\n";
+	s += "    document.getElementById('dialog-clearsettings-result').showModal();\n";
+	s += "  });\n";
+	s += "}\n";
+	s += "function openDeviceLoginModal() {\n";
+	s += "  fetch('/api/startDevicelogin').then(r => r.json()).then(data => {\n";
+	s += "    console.log('startDevicelogin', data);\n";
+	s += "    if (data && data.user_code) {\n";
+	s += "      document.getElementById('btn_open').href = data.verification_uri;\n";
+	s += "      document.getElementById('lbl_message').innerText = data.message;\n";
+	s += "      document.getElementById('code_field').value = data.user_code;\n";
+	s += "    }\n";
+	s += "    document.getElementById('dialog-devicelogin').showModal();\n";
+	s += "  });\n";
+	s += "}\n";
+	s += "</script>\n";
+	s += "<title>ESP32 teams presence</title></head>\n";
+	s += "<body><h2>ESP32 teams presence - v" + String(VERSION) + "</h2>";
+
+	s += "<section class=\"mt\"><div class=\"nes-balloon from-left\">";
+	if (strlen(paramTenantValue) == 0 || strlen(paramClientIdValue) == 0) {
+		s += "<p class=\"note nes-text is-error\">Some settings are missing. Go to <a href=\"config\">configuration page</a> to complete setup.</p></div>";
+	} else {
+		if (access_token[0] == '\0') {
+			s += "<p class=\"note nes-text is-error\">No authentication infos found, start device login flow to complete widget setup!</p></div>";
+		} else {
+			s += "<p class=\"note nes-text\">Device setup complete, but you can start the device login flow if you need to re-authenticate.</p></div>";
+		}
+		s += "<div><button type=\"button\" class=\"nes-btn\" onclick=\"openDeviceLoginModal()\">Start device login</button></div>";
+	}
+	s += "<dialog class=\"nes-dialog is-rounded\" id=\"dialog-devicelogin\">\n";
+	s += "<p class=\"title\">Start device login</p>\n";
+	s += "<p id=\"lbl_message\"></p>\n";
+	s += "<input type=\"text\" id=\"code_field\" class=\"nes-input\" disabled>\n";
+	s += "<menu class=\"dialog-menu\">\n";
+	s += "<button id=\"btn_close\" class=\"nes-btn\" onclick=\"closeDeviceLoginModal()\">Close</button>\n";
+	s += "<a class=\"nes-btn is-primary ml-s\" id=\"btn_open\" href=\"https://microsoft.com/devicelogin\" target=\"_blank\">Open device login</a>\n";
+	s += "</menu>\n";
+	s += "</dialog>\n";
+	s += "</section>\n";
+
+	s += "<div class=\"nes-balloon from-left mt\">";
+	s += "Go to <a href=\"config\">configuration page</a> to change settings.";
+	s += "</div>";
+	s += "<section class=\"nes-container with-title\"><h3 class=\"title\">Current settings</h3>";
+	s += "<div class=\"nes-field mt-s\"><label for=\"name_field\">Client-ID</label><input type=\"text\" id=\"name_field\" class=\"nes-input\" disabled value=\"" + String(paramClientIdValue) +  "\"></div>";
+	s += "<div class=\"nes-field mt-s\"><label for=\"name_field\">Tenant hostname / ID</label><input type=\"text\" id=\"name_field\" class=\"nes-input\" disabled value=\"" + String(paramTenantValue) +  "\"></div>";
+	s += "<div class=\"nes-field mt-s\"><label for=\"name_field\">Polling interval (sec)</label><input type=\"text\" id=\"name_field\" class=\"nes-input\" disabled value=\"" + String(paramPollIntervalValue) +  "\"></div>";
+	s += "<div class=\"nes-field mt-s\"><label for=\"name_field\">Number of LEDs</label><input type=\"text\" id=\"name_field\" class=\"nes-input\" disabled value=\"" + String(paramNumLedsValue) +  "\"></div>";
+	s += "</section>";
+
+	s += "<section class=\"nes-container with-title mt\"><h3 class=\"title\">Memory usage</h3>";
+	s += "<div>Sketch: " + String(ESP.getFreeSketchSpace() - ESP.getSketchSize()) + " of " + String(ESP.getFreeSketchSpace()) + " bytes free</div>";
+	s += "<progress class=\"nes-progress\" value=\"" + String(ESP.getSketchSize()) + "\" max=\"" + String(ESP.getFreeSketchSpace()) + "\"></progress>";
+	s += "<div class=\"mt-s\">RAM: " + String(ESP.getFreeHeap()) + " of 327680 bytes free</div>";
+	s += "<progress class=\"nes-progress\" value=\"" + String(327680 - ESP.getFreeHeap()) + "\" max=\"327680\"></progress>";
+	s += "</section>";
+
+	s += "<section class=\"nes-container with-title mt\"><h3 class=\"title\">Danger area</h3>";
+	s += "<dialog class=\"nes-dialog is-rounded\" id=\"dialog-clearsettings\">\n";
+	s += "<p class=\"title\">Really clear all settings?</p>\n";
+	s += "<button class=\"nes-btn\" onclick=\"document.getElementById('dialog-clearsettings').close()\">Close</button>\n";
+	s += "<button class=\"nes-btn is-error\" onclick=\"performClearSettings()\">Clear all settings</button>\n";
+	s += "</dialog>\n";
+	s += "<dialog class=\"nes-dialog is-rounded\" id=\"dialog-clearsettings-result\">\n";
+	s += "<p class=\"title\">All settings were cleared.</p>\n";
+	s += "</dialog>\n";
+	s += "<div><button type=\"button\" class=\"nes-btn is-error\" onclick=\"document.getElementById('dialog-clearsettings').showModal();\">Clear all settings</button></div>";
+	s += "</section>";
+
+	s += "<div class=\"mt\"><i class=\"nes-icon github\"></i> Find the <a href=\"https://github.com/toblum/ESPTeamsPresence\" target=\"_blank\">ESPTeamsPresence</a> project on GitHub.</i></div>";
+
+	s += "</body>\n</html>\n";
+
+	server.send(200, "text/html", s);
+}
+
+// Peak heap above the level before the request
+size_t measurePeakHeap(void (*handler)()) {
+	pageLen = 0;
+	heapUsed = heapPeak = 0;
+	trackHeap = true;
+	handler();
+	trackHeap = false;
+	return heapPeak;
+}
+
+void setUp() {
+	#ifndef __GLIBC__
+	TEST_IGNORE_MESSAGE("malloc can only be tracked with glibc");
+	#endif
+}
+
+void tearDown() {
+	trackHeap = false;
+}
+
+// The tracking sees the page String of the old handler, everything is freed again
+void test_baseline_peak_covers_page() {
+	size_t peak = measurePeakHeap(handleRootBaseline);
+	TEST_ASSERT_EQUAL_UINT32(0, heapUsed);
+	TEST_ASSERT_GREATER_THAN(4096, pageLen);
+	TEST_ASSERT_GREATER_OR_EQUAL(pageLen, peak);
+}
+
+void test_streamed_page_peak_heap() {
+	size_t baselinePeak = measurePeakHeap(handleRootBaseline);
+	size_t baselineLen = pageLen;
+	size_t peak = measurePeakHeap(handleRoot);
+	TEST_ASSERT_EQUAL_UINT32(0, heapUsed);
+
+	char message[128];
+	snprintf(message, sizeof(message), "Peak heap: baseline %u bytes (page %u bytes), streamed %u bytes (page %u bytes)",
+		(unsigned)baselinePeak, (unsigned)baselineLen, (unsigned)peak, (unsigned)pageLen);
+	TEST_MESSAGE(message);
+	// Only the response header String is left on the heap
+	TEST_ASSERT_LESS_THAN(256, peak);
+	TEST_ASSERT_LESS_THAN(baselinePeak / 10, peak);
+}
+
+void test_streamed_page_content() {
+	measurePeakHeap(handleRoot);
+	page[min(pageLen, sizeof(page) - 1)] = '\0';
+	TEST_ASSERT_NOT_NULL(strstr(page, "Transfer-Encoding: chunked"));
+	TEST_ASSERT_NOT_NULL(strstr(page, "ESP32 teams presence - vtest</h2>"));
+	TEST_ASSERT_NOT_NULL(strstr(page, "Device setup complete"));
+	TEST_ASSERT_NOT_NULL(strstr(page, "value=\"3837bbf0-30fb-47ad-bce8-f460ba9880c3\""));
+	TEST_ASSERT_NOT_NULL(strstr(page, "value=\"contoso.onmicrosoft.com\""));
+	TEST_ASSERT_NOT_NULL(strstr(page, "Sketch: 917504 of 1966080 bytes free"));
+	TEST_ASSERT_NOT_NULL(strstr(page, "</html>\n"));
+}
+
+int main(int argc, char** argv) {
+	UNITY_BEGIN();
+	RUN_TEST(test_baseline_peak_covers_page);
+	RUN_TEST(test_streamed_page_peak_heap);
+	RUN_TEST(test_streamed_page_content);
+	return UNITY_END();
+}
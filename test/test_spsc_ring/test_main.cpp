@@ -0,0 +1,114 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * SPSC ring (spsc_ring.h): single-threaded edge cases and a producer / consumer stress
+ * test on two threads. Items carry a sequence and a checksum, so lost, repeated,
+ * reordered or torn items are found.
+ */
+#include <unity.h>
+#include <thread>
+#include "spsc_ring.h"
+
+#define STRESS_ITEMS 2000000UL
+
+struct Item {
+	uint32_t seq;
+	uint32_t payload[3];
+	uint32_t check;
+};
+
+Item makeItem(uint32_t seq) {
+	Item item = { seq, { seq * 3, ~seq, seq ^ 0xA5A5A5A5 }, 0 };
+	item.check = item.seq ^ item.payload[0] ^ item.payload[1] ^ item.payload[2];
+	return item;
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_empty_pop_fails() {
+	SpscRing<uint32_t, 4> ring;
+	uint32_t value;
+	TEST_ASSERT_FALSE(ring.pop(value));
+	TEST_ASSERT_EQUAL_UINT32(0, ring.size());
+}
+
+void test_full_push_fails() {
+	SpscRing<uint32_t, 4> ring;
+	for (uint32_t i = 0; i < 4; i++) {
+		TEST_ASSERT_TRUE(ring.push(i));
+	}
+	TEST_ASSERT_FALSE(ring.push(4));
+	uint32_t value;
+	TEST_ASSERT_TRUE(ring.pop(value));
+	TEST_ASSERT_EQUAL_UINT32(0, value);
+	TEST_ASSERT_TRUE(ring.push(4));
+	TEST_ASSERT_EQUAL_UINT32(4, ring.size());
+}
+
+// Head and tail wrap many times around the slots, the order must hold
+void test_fifo_order_across_wraps() {
+	SpscRing<uint32_t, 8> ring;
+	uint32_t next = 0;
+	for (uint32_t i = 0; i < 1000; i++) {
+		TEST_ASSERT_TRUE(ring.push(i * 2));
+		TEST_ASSERT_TRUE(ring.push(i * 2 + 1));
+		uint32_t value;
+		TEST_ASSERT_TRUE(ring.pop(value));
+		TEST_ASSERT_EQUAL_UINT32(next++, value);
+		TEST_ASSERT_TRUE(ring.pop(value));
+		TEST_ASSERT_EQUAL_UINT32(next++, value);
+	}
+}
+
+// Producer and consumer on own threads, as loop() and neopixelTask on the device
+void test_stress_two_threads() {
+	static SpscRing<Item, 16> ring;
+	uint32_t received = 0;
+	uint32_t errors = 0;
+
+	std::thread consumer([&]() {
+		Item item;
+		while (received < STRESS_ITEMS) {
+			if (!ring.pop(item)) {
+				std::this_thread::yield();
+				continue;
+			}
+			uint32_t check = item.seq ^ item.payload[0] ^ item.payload[1] ^ item.payload[2];
+			if (item.seq != received || check != item.check) {
+				errors++;
+			}
+			received++;
+		}
+	});
+	for (uint32_t seq = 0; seq < STRESS_ITEMS; seq++) {
+		Item item = makeItem(seq);
+		while (!ring.push(item)) {
+			std::this_thread::yield();
+		}
+	}
+	consumer.join();
+
+	TEST_ASSERT_EQUAL_UINT32(STRESS_ITEMS, received);
+	TEST_ASSERT_EQUAL_UINT32(0, errors);
+	TEST_ASSERT_EQUAL_UINT32(0, ring.size());
+}
+
+int main(int argc, char** argv) {
+	UNITY_BEGIN();
+	RUN_TEST(test_empty_pop_fails);
+	RUN_TEST(test_full_push_fails);
+	RUN_TEST(test_fifo_order_across_wraps);
+	RUN_TEST(test_stress_two_threads);
+	return UNITY_END();
+}
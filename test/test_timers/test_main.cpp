@@ -0,0 +1,208 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * Statemachine timers (timers.h) on a virtual clock: arming, expiry, re-arming,
+ * the wait of loop() and the millis() wrap.
+ */
+#include <unity.h>
+#include <vector>
+#include "timers.h"
+
+#define TIMER_A 0
+#define TIMER_B 1
+#define TIMER_C 2
+
+unsigned long virtualMillis = 0;
+
+unsigned long virtualClock() {
+	return virtualMillis;
+}
+
+TimerSet<3> timers(virtualClock);
+std::vector<uint8_t> fired;
+bool acceptEvents = true;
+
+// Stand-in for runTimers(), the event queue accepts or refuses the events
+void runTimers() {
+	timers.fireExpired([](uint8_t timer) {
+		if (acceptEvents) {
+			fired.push_back(timer);
+		}
+		return acceptEvents;
+	});
+}
+
+void setUp() {
+	virtualMillis = 1000;
+	timers = TimerSet<3>(virtualClock);
+	fired.clear();
+	acceptEvents = true;
+}
+
+void tearDown() {}
+
+void test_not_armed() {
+	TEST_ASSERT_FALSE(timers.isArmed(TIMER_A));
+	TEST_ASSERT_EQUAL_INT(0, timers.remaining(TIMER_A));
+	TEST_ASSERT_EQUAL_UINT32(20, timers.nextDelay(20));
+	runTimers();
+	TEST_ASSERT_EQUAL_UINT32(0, fired.size());
+}
+
+void test_fires_once_at_deadline() {
+	timers.arm(TIMER_A, 500);
+	TEST_ASSERT_TRUE(timers.isArmed(TIMER_A));
+	TEST_ASSERT_EQUAL_INT(500, timers.remaining(TIMER_A));
+
+	virtualMillis += 499;
+	runTimers();
+	TEST_ASSERT_EQUAL_UINT32(0, fired.size());
+	TEST_ASSERT_EQUAL_INT(1, timers.remaining(TIMER_A));
+
+	virtualMillis += 1;
+	runTimers();
+	TEST_ASSERT_EQUAL_UINT32(1, fired.size());
+	TEST_ASSERT_EQUAL_UINT8(TIMER_A, fired[0]);
+	TEST_ASSERT_FALSE(timers.isArmed(TIMER_A));
+
+	virtualMillis += 1000;
+	runTimers();
+	TEST_ASSERT_EQUAL_UINT32(1, fired.size());
+}
+
+void test_zero_delay_fires_on_next_pass() {
+	timers.arm(TIMER_B, 0);
+	TEST_ASSERT_EQUAL_UINT32(0, timers.nextDelay(20));
+	runTimers();
+	TEST_ASSERT_EQUAL_UINT32(1, fired.size());
+	TEST_ASSERT_EQUAL_UINT8(TIMER_B, fired[0]);
+}
+
+// Arming again replaces the deadline, earlier or later
+void test_rearm_moves_deadline() {
+	timers.arm(TIMER_A, 1000);
+	virtualMillis += 600;
+	timers.arm(TIMER_A, 1000);
+	virtualMillis += 600;
+	runTimers();
+	TEST_ASSERT_EQUAL_UINT32(0, fired.size());
+	TEST_ASSERT_EQUAL_INT(400, timers.remaining(TIMER_A));
+
+	timers.arm(TIMER_A, 50);
+	virtualMillis += 50;
+	runTimers();
+	TEST_ASSERT_EQUAL_UINT32(1, fired.size());
+}
+
+void test_rearm_after_fire() {
+	timers.arm(TIMER_A, 100);
+	virtualMillis += 100;
+	runTimers();
+	timers.arm(TIMER_A, 100);
+	virtualMillis += 100;
+	runTimers();
+	TEST_ASSERT_EQUAL_UINT32(2, fired.size());
+}
+
+void test_cancel() {
+	timers.arm(TIMER_C, 100);
+	timers.cancel(TIMER_C);
+	virtualMillis += 200;
+	runTimers();
+	TEST_ASSERT_EQUAL_UINT32(0, fired.size());
+	TEST_ASSERT_EQUAL_INT(0, timers.remaining(TIMER_C));
+}
+
+void test_overdue_is_negative() {
+	acceptEvents = false;
+	timers.arm(TIMER_A, 100);
+	virtualMillis += 350;
+	runTimers();
+	TEST_ASSERT_EQUAL_INT(-250, timers.remaining(TIMER_A));
+}
+
+// A full event queue must not lose the timer, it fires on the next pass
+void test_stays_armed_if_event_refused() {
+	timers.arm(TIMER_A, 10);
+	virtualMillis += 10;
+	acceptEvents = false;
+	runTimers();
+	TEST_ASSERT_TRUE(timers.isArmed(TIMER_A));
+	TEST_ASSERT_EQUAL_UINT32(0, timers.nextDelay(20));
+
+	acceptEvents = true;
+	virtualMillis += 5;
+	runTimers();
+	TEST_ASSERT_EQUAL_UINT32(1, fired.size());
+	TEST_ASSERT_FALSE(timers.isArmed(TIMER_A));
+}
+
+// loop() waits for the earliest timer, capped at its max. wait
+void test_next_delay_is_earliest() {
+	timers.arm(TIMER_A, 300);
+	timers.arm(TIMER_B, 15);
+	timers.arm(TIMER_C, 120);
+	TEST_ASSERT_EQUAL_UINT32(15, timers.nextDelay(20));
+	TEST_ASSERT_EQUAL_UINT32(15, timers.nextDelay(1000));
+	TEST_ASSERT_EQUAL_UINT32(10, timers.nextDelay(10));
+
+	virtualMillis += 15;
+	runTimers();
+	TEST_ASSERT_EQUAL_UINT32(105, timers.nextDelay(1000));
+}
+
+void test_fire_order_within_pass() {
+	timers.arm(TIMER_C, 10);
+	timers.arm(TIMER_A, 20);
+	virtualMillis += 30;
+	runTimers();
+	TEST_ASSERT_EQUAL_UINT32(2, fired.size());
+	TEST_ASSERT_EQUAL_UINT8(TIMER_A, fired[0]);
+	TEST_ASSERT_EQUAL_UINT8(TIMER_C, fired[1]);
+}
+
+// millis() wraps after 49 days, a deadline behind the wrap is still in the future
+void test_millis_wrap() {
+	virtualMillis = 0xFFFFFF00UL;
+	timers.arm(TIMER_A, 0x200);
+	TEST_ASSERT_EQUAL_INT(0x200, timers.remaining(TIMER_A));
+
+	virtualMillis = 0xFFFFFFFFUL;
+	runTimers();
+	TEST_ASSERT_EQUAL_UINT32(0, fired.size());
+
+	virtualMillis = 0xFFUL;
+	runTimers();
+	TEST_ASSERT_EQUAL_UINT32(0, fired.size());
+	TEST_ASSERT_EQUAL_INT(1, timers.remaining(TIMER_A));
+
+	virtualMillis = 0x100UL;
+	runTimers();
+	TEST_ASSERT_EQUAL_UINT32(1, fired.size());
+}
+
+int main(int argc, char** argv) {
+	UNITY_BEGIN();
+	RUN_TEST(test_not_armed);
+	RUN_TEST(test_fires_once_at_deadline);
+	RUN_TEST(test_zero_delay_fires_on_next_pass);
+	RUN_TEST(test_rearm_moves_deadline);
+	RUN_TEST(test_rearm_after_fire);
+	RUN_TEST(test_cancel);
+	RUN_TEST(test_overdue_is_negative);
+	RUN_TEST(test_stays_armed_if_event_refused);
+	RUN_TEST(test_next_delay_is_earliest);
+	RUN_TEST(test_fire_order_within_pass);
+	RUN_TEST(test_millis_wrap);
+	return UNITY_END();
+}
@@ -0,0 +1,212 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * TLS client (tls_client.h) and connection pool (connection_pool.h) on mbedTLS against a local
+ * TLS 1.2 server with session tickets (test/stubs/tls_server.py), which counts full and resumed
+ * handshakes: keep-alive reuse, ticket resumption after Connection: close, after the idle
+ * timeout and after closing idle connections, and after a reboot with the session saved to
+ * SPIFFS. The certificate of the server is verified.
+ * Needs the mbedTLS 2.x of the host (libmbedtls-dev), python3 and openssl: pio test -e native_tls
+ */
+#include <Arduino.h>
+#include <WiFiClient.h>
+#include <SPIFFS.h>
+#include <unity.h>
+#include <signal.h>
+
+#define VERSION "test"
+#define DBG_PRINT(x) Serial.print(x)
+#define DBG_PRINTLN(x) Serial.println(x)
+#define TLS_SERVER_COMMAND "python3 test/stubs/tls_server.py"
+
+const char* rootCACertificate = NULL;		// Certificate of the local server, read in main()
+
+#include "tls_client.h"
+#include "connection_pool.h"
+
+struct ServerStats {
+	int full;
+	int resumed;
+};
+
+PooledConnection* graph;
+ServerStats seen = { 0, 0 };	// Handshakes of the server, as of the last response
+ServerStats base = { 0, 0 };	// ... at the start of the test
+
+
+// GET a path on the pooled connection, returns the status or 0 if the request failed
+int request(const char* path) {
+	HttpResponseHeaders headers;
+	if (!poolRequest(graph, "GET", path, NULL, NULL, headers)) {
+		return 0;
+	}
+	HttpBodyStream body(graph->client, headers);
+	char content[64];
+	size_t len = 0;
+	int c;
+	while ((c = body.read()) >= 0 && len < sizeof(content) - 1) {
+		content[len++] = (char)c;
+	}
+	content[len] = '\0';
+	poolRelease(graph, body, headers);
+	if (sscanf(content, "{\"full\":%d,\"resumed\":%d}", &seen.full, &seen.resumed) != 2) {
+		return -1;
+	}
+	return headers.status;
+}
+
+int serverFullHandshakes() {
+	return seen.full - base.full;
+}
+
+int serverResumedHandshakes() {
+	return seen.resumed - base.resumed;
+}
+
+// Every test starts without connection and without session
+void setUp() {
+	graph->client.stop();
+	graph->client.forgetSession();
+	graph->fullHandshakes = 0;
+	graph->resumedHandshakes = 0;
+	graph->requests = 0;
+	SPIFFS.files.clear();
+	base = seen;
+}
+
+void tearDown() {}
+
+void test_first_connection_is_full_handshake() {
+	TEST_ASSERT_EQUAL_INT(200, request("/"));
+	TEST_ASSERT_EQUAL_INT(1, serverFullHandshakes());
+	TEST_ASSERT_EQUAL_INT(0, serverResumedHandshakes());
+	TEST_ASSERT_FALSE(graph->client.resumed());
+	TEST_ASSERT_EQUAL_UINT(1, graph->fullHandshakes);
+}
+
+void test_keepalive_one_handshake() {
+	for (int i = 0; i < 5; i++) {
+		TEST_ASSERT_EQUAL_INT(200, request("/"));
+		stubMillis += 1000;
+	}
+	TEST_ASSERT_EQUAL_INT(1, serverFullHandshakes());
+	TEST_ASSERT_EQUAL_INT(0, serverResumedHandshakes());
+	TEST_ASSERT_EQUAL_UINT(5, graph->requests);
+}
+
+// The server closed the connection, the next one resumes the session with the ticket
+void test_connection_close_resumes() {
+	TEST_ASSERT_EQUAL_INT(200, request("/close"));
+	TEST_ASSERT_FALSE(graph->client.connected());
+	TEST_ASSERT_EQUAL_INT(200, request("/"));
+	TEST_ASSERT_EQUAL_INT(1, serverFullHandshakes());
+	TEST_ASSERT_EQUAL_INT(1, serverResumedHandshakes());
+	TEST_ASSERT_TRUE(graph->client.resumed());
+	TEST_ASSERT_EQUAL_UINT(1, graph->fullHandshakes);
+	TEST_ASSERT_EQUAL_UINT(1, graph->resumedHandshakes);
+}
+
+void test_idle_timeout_resumes() {
+	TEST_ASSERT_EQUAL_INT(200, request("/"));
+	stubMillis += POOL_IDLE_TIMEOUT + 1;
+	TEST_ASSERT_EQUAL_INT(200, request("/"));
+	TEST_ASSERT_EQUAL_INT(1, serverFullHandshakes());
+	TEST_ASSERT_EQUAL_INT(1, serverResumedHandshakes());
+}
+
+void test_reaped_connection_resumes() {
+	TEST_ASSERT_EQUAL_INT(200, request("/"));
+	stubMillis += POOL_IDLE_TIMEOUT + 1;
+	TEST_ASSERT_EQUAL_UINT32(0, reapIdleConnections());
+	TEST_ASSERT_FALSE(graph->client.connected());
+	TEST_ASSERT_EQUAL_INT(200, request("/"));
+	TEST_ASSERT_EQUAL_INT(1, serverFullHandshakes());
+	TEST_ASSERT_EQUAL_INT(1, serverResumedHandshakes());
+}
+
+// Without session the server has to send its certificate again
+void test_forgotten_session_is_full_handshake() {
+	TEST_ASSERT_EQUAL_INT(200, request("/close"));
+	graph->client.forgetSession();
+	TEST_ASSERT_EQUAL_INT(200, request("/"));
+	TEST_ASSERT_EQUAL_INT(2, serverFullHandshakes());
+	TEST_ASSERT_EQUAL_INT(0, serverResumedHandshakes());
+	TEST_ASSERT_EQUAL_UINT(2, graph->fullHandshakes);
+}
+
+// The first full handshake saves the session, after a reboot it is loaded and resumed
+void test_saved_session_resumes_after_reboot() {
+	TEST_ASSERT_TRUE(TLS_SESSION_PERSISTENCE);
+	TEST_ASSERT_EQUAL_INT(200, request("/"));
+	TEST_ASSERT_TRUE(SPIFFS.exists(TLS_SESSION_FILE_GRAPH));
+
+	// Reboot: no connection and no session in RAM
+	graph->client.stop();
+	graph->client.forgetSession();
+	loadTlsSessions();
+	TEST_ASSERT_EQUAL_INT(200, request("/"));
+	TEST_ASSERT_TRUE(graph->client.resumed());
+	TEST_ASSERT_EQUAL_INT(1, serverFullHandshakes());
+	TEST_ASSERT_EQUAL_INT(1, serverResumedHandshakes());
+	TEST_ASSERT_EQUAL_UINT(1, graph->resumedHandshakes);
+}
+
+// A broken session file is ignored, the handshake is a full one
+void test_corrupt_session_file_is_ignored() {
+	SPIFFS.files[TLS_SESSION_FILE_GRAPH] = std::vector<uint8_t>(64, 0xA5);
+	loadTlsSessions();
+	TEST_ASSERT_EQUAL_INT(200, request("/"));
+	TEST_ASSERT_FALSE(graph->client.resumed());
+	TEST_ASSERT_EQUAL_INT(1, serverFullHandshakes());
+	TEST_ASSERT_EQUAL_INT(0, serverResumedHandshakes());
+}
+
+int main(int argc, char** argv) {
+	FILE* server = popen(TLS_SERVER_COMMAND, "r");
+	unsigned int port;
+	int pid;
+	char certFile[256];
+	if (server == NULL || fscanf(server, "%u %d %255s", &port, &pid, certFile) != 3) {
+		printf("Local TLS server did not start: %s\n", TLS_SERVER_COMMAND);
+		return 1;
+	}
+	static char cert[4096];
+	FILE* file = fopen(certFile, "r");
+	size_t certLen = file ? fread(cert, 1, sizeof(cert) - 1, file) : 0;
+	if (file) {
+		fclose(file);
+	}
+	cert[certLen] = '\0';
+	rootCACertificate = cert;
+
+	stubTcpPort = port;
+	initConnectionPool();
+	graph = &connectionPool[POOL_HOST_GRAPH];
+	graph->host = "localhost";
+
+	UNITY_BEGIN();
+	RUN_TEST(test_first_connection_is_full_handshake);
+	RUN_TEST(test_keepalive_one_handshake);
+	RUN_TEST(test_connection_close_resumes);
+	RUN_TEST(test_idle_timeout_resumes);
+	RUN_TEST(test_reaped_connection_resumes);
+	RUN_TEST(test_forgotten_session_is_full_handshake);
+	RUN_TEST(test_saved_session_resumes_after_reboot);
+	RUN_TEST(test_corrupt_session_file_is_ignored);
+	int failures = UNITY_END();
+
+	graph->client.stop();
+	kill(pid, SIGTERM);
+	pclose(server);
+	return failures;
+}
@@ -0,0 +1,125 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * Upload buffer (upload_buffer.h): whole blocks are written, and an upload with an error
+ * (reserved name, file not created, file system full) is consumed to its end.
+ */
+#include <unity.h>
+#include <vector>
+#include "upload_buffer.h"
+
+#define BLOCK_SIZE 2048
+#define CHUNK_SIZE 1436		// Size of the upload chunks of the web server
+
+UploadBuffer<BLOCK_SIZE> buffer;
+std::vector<uint8_t> written;
+std::vector<size_t> writes;
+size_t writeLimit;			// Bytes the "file system" takes before writes fail
+
+bool writeBlock(const uint8_t* data, size_t len) {
+	writes.push_back(len);
+	if (written.size() + len > writeLimit) {
+		return false;
+	}
+	written.insert(written.end(), data, data + len);
+	return true;
+}
+
+// Feed an upload of size bytes in web server chunks, like handleFileUpload()
+void upload(size_t size) {
+	uint8_t chunk[CHUNK_SIZE];
+	for (size_t pos = 0; pos < size; ) {
+		size_t len = (size - pos < CHUNK_SIZE) ? size - pos : CHUNK_SIZE;
+		for (size_t i = 0; i < len; i++) {
+			chunk[i] = (uint8_t)(pos + i);
+		}
+		buffer.append(chunk, len, writeBlock);
+		pos += len;
+	}
+	buffer.flush(writeBlock);
+}
+
+void setUp() {
+	buffer.reset();
+	written.clear();
+	writes.clear();
+	writeLimit = SIZE_MAX;
+}
+
+void tearDown() {}
+
+void test_writes_whole_blocks() {
+	upload(3 * BLOCK_SIZE + 100);
+	TEST_ASSERT_FALSE(buffer.hasFailed());
+	TEST_ASSERT_EQUAL_UINT32(4, writes.size());
+	TEST_ASSERT_EQUAL_UINT32(BLOCK_SIZE, writes[0]);
+	TEST_ASSERT_EQUAL_UINT32(BLOCK_SIZE, writes[2]);
+	TEST_ASSERT_EQUAL_UINT32(100, writes[3]);
+	TEST_ASSERT_EQUAL_UINT32(3 * BLOCK_SIZE + 100, written.size());
+	for (size_t i = 0; i < written.size(); i++) {
+		TEST_ASSERT_EQUAL_UINT8((uint8_t)i, written[i]);
+	}
+}
+
+void test_empty_upload() {
+	upload(0);
+	TEST_ASSERT_FALSE(buffer.hasFailed());
+	TEST_ASSERT_EQUAL_UINT32(0, writes.size());
+}
+
+// Reserved name or file not created: the whole upload is dropped
+void test_failed_at_start_drops_upload() {
+	buffer.fail();
+	upload(10 * BLOCK_SIZE + 1);
+	TEST_ASSERT_TRUE(buffer.hasFailed());
+	TEST_ASSERT_EQUAL_UINT32(0, writes.size());
+	TEST_ASSERT_EQUAL_UINT32(0, buffer.buffered());
+}
+
+// File system full: no write after the first failed one
+void test_write_error_drops_rest() {
+	writeLimit = BLOCK_SIZE;
+	upload(10 * BLOCK_SIZE + 1);
+	TEST_ASSERT_TRUE(buffer.hasFailed());
+	TEST_ASSERT_EQUAL_UINT32(2, writes.size());
+	TEST_ASSERT_EQUAL_UINT32(BLOCK_SIZE, written.size());
+	TEST_ASSERT_EQUAL_UINT32(0, buffer.buffered());
+}
+
+// The last partial block fails
+void test_write_error_on_flush() {
+	writeLimit = BLOCK_SIZE;
+	upload(BLOCK_SIZE + 1);
+	TEST_ASSERT_TRUE(buffer.hasFailed());
+	TEST_ASSERT_EQUAL_UINT32(2, writes.size());
+}
+
+void test_reset_after_error() {
+	buffer.fail();
+	upload(BLOCK_SIZE);
+	buffer.reset();
+	upload(BLOCK_SIZE);
+	TEST_ASSERT_FALSE(buffer.hasFailed());
+	TEST_ASSERT_EQUAL_UINT32(BLOCK_SIZE, written.size());
+}
+
+int main(int argc, char** argv) {
+	UNITY_BEGIN();
+	RUN_TEST(test_writes_whole_blocks);
+	RUN_TEST(test_empty_upload);
+	RUN_TEST(test_failed_at_start_drops_upload);
+	RUN_TEST(test_write_error_drops_rest);
+	RUN_TEST(test_write_error_on_flush);
+	RUN_TEST(test_reset_after_error);
+	return UNITY_END();
+}
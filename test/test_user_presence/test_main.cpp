@@ -0,0 +1,160 @@
+/**
+ * ESPTeamsPresence -- A standalone Microsoft Teams presence light
+ *   based on ESP32 and RGB neopixel LEDs.
+ *   https://github.com/toblum/ESPTeamsPresence
+ *
+ * Copyright (C) 2020 Tobias Blum <make@tobiasblum.de>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+/**
+ * Presence of other users (user_presence.h): the getPresencesByUserId payload and the
+ * parsing of a canned response through the same filter and document size as the poll,
+ * including ids missing from the response.
+ */
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <unity.h>
+#include <string>
+#include "graph_presence.h"
+#include "user_presence.h"
+
+#define ID_A "fa8bf3dc-eca7-46b7-bad1-db199b62afc3"
+#define ID_B "66825e03-7ef5-42da-9069-724602c31f6b"
+#define ID_C "0a1b2c3d-4e5f-4a6b-8c7d-9e0f1a2b3c4d"		// Not in the response
+#define ID_D "d4c3b2a1-0f9e-4d8c-b7a6-5f4e3d2c1b0a"		// In the response, not requested
+
+const char* cannedResponse =
+	"{\"@odata.context\":\"https://graph.microsoft.com/v1.0/$metadata#Collection(microsoft.graph.presence)\",\"value\":["
+	"{\"@odata.type\":\"#microsoft.graph.presence\",\"id\":\"" ID_D "\",\"availability\":\"Available\",\"activity\":\"Available\","
+		"\"outOfOfficeSettings\":{\"message\":null,\"isOutOfOffice\":false}},"
+	"{\"@odata.type\":\"#microsoft.graph.presence\",\"id\":\"" ID_B "\",\"availability\":\"Away\",\"activity\":\"BeRightBack\","
+		"\"outOfOfficeSettings\":{\"message\":null,\"isOutOfOffice\":false}},"
+	"{\"@odata.type\":\"#microsoft.graph.presence\",\"id\":\"" ID_A "\",\"availability\":\"Busy\",\"activity\":\"Focusing\","
+		"\"outOfOfficeSettings\":{\"message\":null,\"isOutOfOffice\":false}}"
+	"]}";
+
+char ids[MAX_PRESENCE_USERS][USER_ID_LEN];
+char payload[USER_PRESENCE_PAYLOAD_LEN];
+uint8_t availabilityIds[MAX_PRESENCE_USERS];
+uint8_t activityIds[MAX_PRESENCE_USERS];
+StaticJsonDocument<USER_PRESENCE_FILTER_CAPACITY> filter;
+StaticJsonDocument<USER_PRESENCE_RESPONSE_CAPACITY> responseDoc;
+
+// Parse like pollUserPresences()
+void parseResponse(const char* json, uint8_t count) {
+	filter.clear();
+	setUserPresenceFilter(filter);
+	TEST_ASSERT_FALSE(filter.overflowed());
+	TEST_ASSERT_TRUE(deserializeJson(responseDoc, json, DeserializationOption::Filter(filter)) == DeserializationError::Ok);
+	TEST_ASSERT_FALSE(responseDoc.overflowed());
+	parseUserPresences(responseDoc["value"].as<JsonArrayConst>(), ids, count, availabilityIds, activityIds);
+}
+
+void setUp() {
+	memset(ids, 0, sizeof(ids));
+	clearPresenceUsers();
+}
+
+void tearDown() {}
+
+void test_payload() {
+	strlcpy(ids[0], ID_A, USER_ID_LEN);
+	strlcpy(ids[1], ID_B, USER_ID_LEN);
+	TEST_ASSERT_EQUAL_STRING("{\"ids\":[\"" ID_A "\",\"" ID_B "\"]}", getUserPresencePayload(payload, sizeof(payload), ids, 2));
+	TEST_ASSERT_EQUAL_STRING("{\"ids\":[]}", getUserPresencePayload(payload, sizeof(payload), ids, 0));
+}
+
+// All users with full length ids fit into the buffer, the payload is valid JSON
+void test_payload_max_users() {
+	for (uint8_t i = 0; i < MAX_PRESENCE_USERS; i++) {
+		snprintf(ids[i], USER_ID_LEN, "%08x-eca7-46b7-bad1-db199b62afc3", i);
+	}
+	getUserPresencePayload(payload, sizeof(payload), ids, MAX_PRESENCE_USERS);
+	TEST_ASSERT_LESS_THAN(sizeof(payload) - 1, strlen(payload));
+
+	StaticJsonDocument<1024> doc;
+	TEST_ASSERT_TRUE(deserializeJson(doc, payload) == DeserializationError::Ok);
+	TEST_ASSERT_EQUAL_size_t(MAX_PRESENCE_USERS, doc["ids"].size());
+	for (uint8_t i = 0; i < MAX_PRESENCE_USERS; i++) {
+		TEST_ASSERT_EQUAL_STRING(ids[i], doc["ids"][i] | "");
+	}
+}
+
+// Ids that would break the payload are not taken into the user table
+void test_invalid_ids_rejected() {
+	TEST_ASSERT_EQUAL_INT(-1, addPresenceUser(""));
+	TEST_ASSERT_EQUAL_INT(-1, addPresenceUser("a\",\"b"));
+	TEST_ASSERT_EQUAL_INT(-1, addPresenceUser("a\\b"));
+	TEST_ASSERT_EQUAL_INT(-1, addPresenceUser(ID_A ID_B));
+	TEST_ASSERT_EQUAL_INT(0, addPresenceUser(ID_A));
+	TEST_ASSERT_EQUAL_INT(0, addPresenceUser("FA8BF3DC-ECA7-46B7-BAD1-DB199B62AFC3"));
+	TEST_ASSERT_EQUAL_UINT8(1, numPresenceUsers);
+}
+
+// Order of the response doesn't matter, ids compare case insensitive, unknown values map to PRESENCE_NONE
+void test_parse_response() {
+	strlcpy(ids[0], "FA8BF3DC-ECA7-46B7-BAD1-DB199B62AFC3", USER_ID_LEN);
+	strlcpy(ids[1], ID_B, USER_ID_LEN);
+	parseResponse(cannedResponse, 2);
+
+	TEST_ASSERT_EQUAL_UINT8(PRESENCE_BUSY, availabilityIds[0]);
+	TEST_ASSERT_EQUAL_UINT8(PRESENCE_NONE, activityIds[0]);
+	TEST_ASSERT_EQUAL_UINT8(PRESENCE_AWAY, availabilityIds[1]);
+	TEST_ASSERT_EQUAL_UINT8(PRESENCE_BERIGHTBACK, activityIds[1]);
+}
+
+// Users missing in the response are marked, so they keep their last state
+void test_parse_missing_ids() {
+	strlcpy(ids[0], ID_C, USER_ID_LEN);
+	strlcpy(ids[1], ID_A, USER_ID_LEN);
+	availabilityIds[0] = activityIds[0] = PRESENCE_AVAILABLE;
+	parseResponse(cannedResponse, 2);
+
+	TEST_ASSERT_EQUAL_UINT8(USER_PRESENCE_MISSING, availabilityIds[0]);
+	TEST_ASSERT_EQUAL_UINT8(USER_PRESENCE_MISSING, activityIds[0]);
+	TEST_ASSERT_EQUAL_UINT8(PRESENCE_BUSY, availabilityIds[1]);
+}
+
+void test_parse_empty_and_error() {
+	strlcpy(ids[0], ID_A, USER_ID_LEN);
+	parseResponse("{\"value\":[]}", 1);
+	TEST_ASSERT_EQUAL_UINT8(USER_PRESENCE_MISSING, availabilityIds[0]);
+
+	parseResponse("{\"error\":{\"code\":\"Forbidden\",\"message\":\"Insufficient privileges\"}}", 1);
+	TEST_ASSERT_EQUAL_UINT8(USER_PRESENCE_MISSING, availabilityIds[0]);
+	TEST_ASSERT_EQUAL_STRING("Forbidden", responseDoc["error"]["code"] | "");
+}
+
+// A response for all users with the longest values fits into the fixed document
+void test_parse_max_users_fits() {
+	std::string json = "{\"value\":[";
+	for (uint8_t i = 0; i < MAX_PRESENCE_USERS; i++) {
+		snprintf(ids[i], USER_ID_LEN, "%08x-eca7-46b7-bad1-db199b62afc3", i);
+		json += (i > 0) ? "," : "";
+		json += std::string("{\"@odata.type\":\"#microsoft.graph.presence\",\"id\":\"") + ids[i] + "\","
+			"\"availability\":\"UrgentInterruptionsOnly\",\"activity\":\"UrgentInterruptionsOnly\","
+			"\"outOfOfficeSettings\":{\"message\":null,\"isOutOfOffice\":false}}";
+	}
+	json += "]}";
+	parseResponse(json.c_str(), MAX_PRESENCE_USERS);
+	for (uint8_t i = 0; i < MAX_PRESENCE_USERS; i++) {
+		TEST_ASSERT_EQUAL_UINT8(PRESENCE_URGENTINTERRUPTIONSONLY, availabilityIds[i]);
+		TEST_ASSERT_EQUAL_UINT8(PRESENCE_URGENTINTERRUPTIONSONLY, activityIds[i]);
+	}
+}
+
+int main(int argc, char** argv) {
+	UNITY_BEGIN();
+	RUN_TEST(test_payload);
+	RUN_TEST(test_payload_max_users);
+	RUN_TEST(test_invalid_ids_rejected);
+	RUN_TEST(test_parse_response);
+	RUN_TEST(test_parse_missing_ids);
+	RUN_TEST(test_parse_empty_and_error);
+	RUN_TEST(test_parse_max_users_fits);
+	return UNITY_END();
+}
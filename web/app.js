@@ -0,0 +1,36 @@
+// ESPTeamsPresence status page
+function closeDeviceLoginModal() {
+  document.getElementById('dialog-devicelogin').close();
+}
+
+function performClearSettings() {
+  fetch('/api/clearSettings').then(r => r.json()).then(data => {
+    console.log('clearSettings', data);
+    document.getElementById('dialog-clearsettings').close();
+    document.getElementById('dialog-clearsettings-result').showModal();
+  });
+}
+
+function openDeviceLoginModal() {
+  fetch('/api/startDevicelogin').then(r => r.json()).then(data => {
+    console.log('startDevicelogin', data);
+    pollDeviceLogin();
+  });
+}
+
+// The device requests the code in the background, ask until it is there
+function pollDeviceLogin() {
+  fetch('/api/devicelogin').then(r => r.json()).then(data => {
+    if (data.status === 'pending') {
+      setTimeout(pollDeviceLogin, 500);
+      return;
+    }
+    console.log('devicelogin', data);
+    if (data && data.user_code) {
+      document.getElementById('btn_open').href = data.verification_uri;
+      document.getElementById('lbl_message').innerText = data.message;
+      document.getElementById('code_field').value = data.user_code;
+    }
+    document.getElementById('dialog-devicelogin').showModal();
+  });
+}